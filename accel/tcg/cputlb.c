@@ -802,6 +802,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
     if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
+        mr->bql_dispatch_count++;
         locked = true;
     }
     r = memory_region_dispatch_read(mr, mr_offset,
@@ -868,6 +869,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
     if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
+        mr->bql_dispatch_count++;
         locked = true;
     }
     r = memory_region_dispatch_write(mr, mr_offset,
@@ -328,6 +328,7 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    qemu_mutex_init(&bs->bsc_lock);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -841,12 +842,14 @@ static void bdrv_child_cb_attach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
     bdrv_apply_subtree_drain(child, bs);
+    bdrv_bsc_invalidate(bs);
 }
 
 static void bdrv_child_cb_detach(BdrvChild *child)
 {
     BlockDriverState *bs = child->opaque;
     bdrv_unapply_subtree_drain(child, bs);
+    bdrv_bsc_invalidate(bs);
 }
 
 static int bdrv_child_cb_inactivate(BdrvChild *child)
@@ -3314,6 +3317,7 @@ void bdrv_reopen_commit(BDRVReopenState *reopen_state)
     bs->read_only = !(reopen_state->flags & BDRV_O_RDWR);
 
     bdrv_refresh_limits(bs, NULL);
+    bdrv_bsc_invalidate(bs);
 
     bdrv_set_perm(reopen_state->bs, reopen_state->perm,
                   reopen_state->shared_perm);
@@ -3372,6 +3376,7 @@ static void bdrv_close(BlockDriverState *bs)
         }
         bs->drv = NULL;
     }
+    bdrv_bsc_invalidate(bs);
 
     bdrv_set_backing_hd(bs, NULL, &error_abort);
 
@@ -3585,6 +3590,7 @@ static void bdrv_delete(BlockDriverState *bs)
     }
     QTAILQ_REMOVE(&all_bdrv_states, bs, bs_list);
 
+    qemu_mutex_destroy(&bs->bsc_lock);
     g_free(bs);
 }
 
@@ -3598,6 +3604,8 @@ static void bdrv_delete(BlockDriverState *bs)
 static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
                                       BdrvCheckResult *res, BdrvCheckMode fix)
 {
+    int ret;
+
     if (bs->drv == NULL) {
         return -ENOMEDIUM;
     }
@@ -3606,7 +3614,11 @@ static int coroutine_fn bdrv_co_check(BlockDriverState *bs,
     }
 
     memset(res, 0, sizeof(*res));
-    return bs->drv->bdrv_co_check(bs, res, fix);
+    ret = bs->drv->bdrv_co_check(bs, res, fix);
+    if (fix) {
+        bdrv_bsc_invalidate(bs);
+    }
+    return ret;
 }
 
 typedef struct CheckCo {
@@ -4394,6 +4406,9 @@ static void coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs,
     }
     bdrv_set_perm(bs, perm, shared_perm);
 
+    /* Another process may have changed the image while it was inactive */
+    bdrv_bsc_invalidate(bs);
+
     if (bs->drv->bdrv_co_invalidate_cache) {
         bs->drv->bdrv_co_invalidate_cache(bs, &local_err);
         if (local_err) {
@@ -5033,6 +5048,8 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                        BlockDriverAmendStatusCB *status_cb, void *cb_opaque,
                        Error **errp)
 {
+    int ret;
+
     if (!bs->drv) {
         error_setg(errp, "Node is ejected");
         return -ENOMEDIUM;
@@ -5042,7 +5059,9 @@ int bdrv_amend_options(BlockDriverState *bs, QemuOpts *opts,
                    bs->drv->format_name);
         return -ENOTSUP;
     }
-    return bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque, errp);
+    ret = bs->drv->bdrv_amend_options(bs, opts, status_cb, cb_opaque, errp);
+    bdrv_bsc_invalidate(bs);
+    return ret;
 }
 
 /* This function will be called by the bdrv_recurse_is_first_non_filter method
@@ -27,6 +27,10 @@
 #include "qemu/error-report.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_WORKERS_DEFAULT 16
+#define BACKUP_MAX_WORKERS_LIMIT 256
+#define BACKUP_MAX_CHUNK_DEFAULT (1 << 20)
+#define BACKUP_MAX_CHUNK_LIMIT (64 << 20)
 
 typedef struct BackupBlockJob {
     BlockJob common;
@@ -42,15 +46,35 @@ typedef struct BackupBlockJob {
     int64_t cluster_size;
     bool compress;
     NotifierWithReturn before_write;
-    QLIST_HEAD(, CowRequest) inflight_reqs;
+    IntervalTreeRoot inflight_reqs;
 
     HBitmap *copy_bitmap;
     bool use_copy_range;
     int64_t copy_range_size;
 
     bool serialize_target_writes;
+
+    /*
+     * The background copy is split into chunks, of which up to max_workers
+     * are copied in parallel.  The chunk size starts at cluster_size and
+     * doubles with every successful chunk up to max_chunk.
+     */
+    int max_workers;
+    int64_t max_chunk;
+    int64_t chunk_size;
+    int in_flight;
+    CoQueue worker_queue;
+    /* First error of a worker since the last error action */
+    int worker_ret;
+    bool worker_error_is_read;
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t offset;
+    uint64_t bytes;
+} BackupWorker;
+
 static const BlockJobDriver backup_job_driver;
 
 /* See if in-flight requests overlap and wait for them to complete */
@@ -58,12 +82,18 @@ static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
                                                        int64_t end)
 {
+    IntervalTreeNode *node;
     CowRequest *req;
+    uint64_t last = MAX(end, start + 1) - 1;
     bool retry;
 
     do {
         retry = false;
-        QLIST_FOREACH(req, &job->inflight_reqs, list) {
+        for (node = interval_tree_iter_first(&job->inflight_reqs, start, last);
+             node;
+             node = interval_tree_iter_next(&job->inflight_reqs, node,
+                                            start, last)) {
+            req = container_of(node, CowRequest, node);
             if (end > req->start_byte && start < req->end_byte) {
                 qemu_co_queue_wait(&req->wait_queue, NULL);
                 retry = true;
@@ -79,14 +109,17 @@ static void cow_request_begin(CowRequest *req, BackupBlockJob *job,
 {
     req->start_byte = start;
     req->end_byte = end;
+    req->node.start = start;
+    req->node.last = MAX(end, start + 1) - 1;
+    req->inflight_reqs = &job->inflight_reqs;
     qemu_co_queue_init(&req->wait_queue);
-    QLIST_INSERT_HEAD(&job->inflight_reqs, req, list);
+    interval_tree_insert(&req->node, req->inflight_reqs);
 }
 
 /* Forget about a completed request */
 static void cow_request_end(CowRequest *req)
 {
-    QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->node, req->inflight_reqs);
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
@@ -97,20 +130,23 @@ static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
                                                       int64_t end,
                                                       bool is_write_notifier,
                                                       bool *error_is_read,
-                                                      void **bounce_buffer)
+                                                      void **bounce_buffer,
+                                                      int64_t bounce_size)
 {
     int ret;
     struct iovec iov;
     QEMUIOVector qiov;
     BlockBackend *blk = job->common.blk;
     int nbytes;
+    int nr_clusters;
     int read_flags = is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0;
     int write_flags = job->serialize_target_writes ? BDRV_REQ_SERIALISING : 0;
 
-    hbitmap_reset(job->copy_bitmap, start / job->cluster_size, 1);
-    nbytes = MIN(job->cluster_size, job->len - start);
+    nbytes = MIN(MIN(end, job->len) - start, bounce_size);
+    nr_clusters = DIV_ROUND_UP(nbytes, job->cluster_size);
+    hbitmap_reset(job->copy_bitmap, start / job->cluster_size, nr_clusters);
     if (!*bounce_buffer) {
-        *bounce_buffer = blk_blockalign(blk, job->cluster_size);
+        *bounce_buffer = blk_blockalign(blk, bounce_size);
     }
     iov.iov_base = *bounce_buffer;
     iov.iov_len = nbytes;
@@ -143,7 +179,7 @@ static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
 
     return nbytes;
 fail:
-    hbitmap_set(job->copy_bitmap, start / job->cluster_size, 1);
+    hbitmap_set(job->copy_bitmap, start / job->cluster_size, nr_clusters);
     return ret;
 
 }
@@ -163,7 +199,7 @@ static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
     int write_flags = job->serialize_target_writes ? BDRV_REQ_SERIALISING : 0;
 
     assert(QEMU_IS_ALIGNED(job->copy_range_size, job->cluster_size));
-    nbytes = MIN(job->copy_range_size, end - start);
+    nbytes = MIN(job->copy_range_size, MIN(end, job->len) - start);
     nr_clusters = DIV_ROUND_UP(nbytes, job->cluster_size);
     hbitmap_reset(job->copy_bitmap, start / job->cluster_size,
                   nr_clusters);
@@ -179,20 +215,104 @@ static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
     return nbytes;
 }
 
+/* Returns the end of the run of clusters to copy at @start, at most @end */
+static int64_t backup_dirty_end(BackupBlockJob *job, int64_t start,
+                                int64_t end)
+{
+    int64_t offset = start + job->cluster_size;
+
+    while (offset < end && hbitmap_get(job->copy_bitmap,
+                                       offset / job->cluster_size)) {
+        offset += job->cluster_size;
+    }
+    return MIN(offset, end);
+}
+
+/*
+ * Skip clusters at @start that are unallocated in the top layer with
+ * sync=top, and write zeroes for clusters that read as zero, without
+ * reading either from the source.  Returns the number of bytes handled,
+ * 0 if the data at @start has to be copied, or a negative error.
+ */
+static int64_t coroutine_fn backup_cow_bulk(BackupBlockJob *job,
+                                            int64_t start, int64_t end,
+                                            bool *error_is_read)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int write_flags = job->serialize_target_writes ? BDRV_REQ_SERIALISING : 0;
+    int64_t bytes = MIN(end, job->len) - start;
+    int64_t pnum;
+    int ret;
+
+    if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+        ret = bdrv_is_allocated(bs, start, bytes, &pnum);
+        if (ret < 0) {
+            goto fail_read;
+        }
+        if (!ret && (pnum == bytes || pnum >= job->cluster_size)) {
+            /* Clusters that are only partially allocated are copied */
+            pnum = pnum == bytes ? pnum
+                                 : QEMU_ALIGN_DOWN(pnum, job->cluster_size);
+            trace_backup_cow_bulk_unallocated(job, start, pnum);
+            /* The target's backing file provides the data, also for CoW */
+            hbitmap_reset(job->copy_bitmap, start / job->cluster_size,
+                          DIV_ROUND_UP(pnum, job->cluster_size));
+            return pnum;
+        }
+    }
+
+    ret = bdrv_block_status_above(bs, NULL, start, bytes, &pnum, NULL, NULL);
+    if (ret < 0) {
+        goto fail_read;
+    }
+    if (!(ret & BDRV_BLOCK_ZERO) ||
+        (pnum < bytes && pnum < job->cluster_size)) {
+        return 0;
+    }
+    if (pnum < bytes) {
+        pnum = QEMU_ALIGN_DOWN(pnum, job->cluster_size);
+    }
+
+    trace_backup_cow_bulk_zero(job, start, pnum);
+    hbitmap_reset(job->copy_bitmap, start / job->cluster_size,
+                  DIV_ROUND_UP(pnum, job->cluster_size));
+    ret = blk_co_pwrite_zeroes(job->target, start, pnum,
+                               write_flags | BDRV_REQ_MAY_UNMAP);
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job, start, ret);
+        hbitmap_set(job->copy_bitmap, start / job->cluster_size,
+                    DIV_ROUND_UP(pnum, job->cluster_size));
+        if (error_is_read) {
+            *error_is_read = false;
+        }
+        return ret;
+    }
+    return pnum;
+
+fail_read:
+    trace_backup_do_cow_read_fail(job, start, ret);
+    if (error_is_read) {
+        *error_is_read = true;
+    }
+    return ret;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t offset, uint64_t bytes,
                                       bool *error_is_read,
                                       bool is_write_notifier)
 {
     CowRequest cow_request;
-    int ret = 0;
+    int64_t ret = 0;
     int64_t start, end; /* bytes */
+    int64_t dirty_end, bounce_size;
     void *bounce_buffer = NULL;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
     start = QEMU_ALIGN_DOWN(offset, job->cluster_size);
     end = QEMU_ALIGN_UP(bytes + offset, job->cluster_size);
+    bounce_size = MIN(end - start, job->max_chunk);
 
     trace_backup_do_cow_enter(job, start, offset, bytes);
 
@@ -207,16 +327,33 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
         }
 
         trace_backup_do_cow_process(job, start);
+        dirty_end = backup_dirty_end(job, start, end);
+
+        /* Guest writes are waiting, don't spend time on block status */
+        if (!is_write_notifier) {
+            ret = backup_cow_bulk(job, start, dirty_end, error_is_read);
+            if (ret < 0) {
+                break;
+            } else if (ret > 0) {
+                start += ret;
+                job_progress_update(&job->common.job, ret);
+                ret = 0;
+                continue;
+            }
+        }
 
         if (job->use_copy_range) {
-            ret = backup_cow_with_offload(job, start, end, is_write_notifier);
+            ret = backup_cow_with_offload(job, start, dirty_end,
+                                          is_write_notifier);
             if (ret < 0) {
                 job->use_copy_range = false;
             }
         }
         if (!job->use_copy_range) {
-            ret = backup_cow_with_bounce_buffer(job, start, end, is_write_notifier,
-                                                error_is_read, &bounce_buffer);
+            ret = backup_cow_with_bounce_buffer(job, start, dirty_end,
+                                                is_write_notifier,
+                                                error_is_read, &bounce_buffer,
+                                                bounce_size);
         }
         if (ret < 0) {
             break;
@@ -413,30 +550,113 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+static void coroutine_fn backup_worker(void *opaque)
 {
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    bool error_is_read = false;
     int ret;
-    bool error_is_read;
-    int64_t cluster;
+
+    ret = backup_do_cow(job, w->offset, w->bytes, &error_is_read, false);
+    if (ret < 0) {
+        if (!job->worker_ret) {
+            job->worker_ret = ret;
+            job->worker_error_is_read = error_is_read;
+        }
+        job->chunk_size = job->cluster_size;
+    } else {
+        job->chunk_size = MIN(job->chunk_size * 2, job->max_chunk);
+    }
+
+    job->in_flight--;
+    g_free(w);
+    qemu_co_queue_restart_all(&job->worker_queue);
+}
+
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job,
+                                                 int max_in_flight)
+{
+    while (job->in_flight > max_in_flight) {
+        qemu_co_queue_wait(&job->worker_queue, NULL);
+    }
+}
+
+/*
+ * Copy everything in copy_bitmap.  Runs of clusters to copy are handed to
+ * worker coroutines, so that copying isn't bound by the latency of single
+ * requests.
+ */
+static int coroutine_fn backup_loop(BackupBlockJob *job)
+{
+    int64_t cluster = 0;
+    int64_t nb_clusters = DIV_ROUND_UP(job->len, job->cluster_size);
     HBitmapIter hbi;
+    int ret = 0;
 
-    hbitmap_iter_init(&hbi, job->copy_bitmap, 0);
-    while ((cluster = hbitmap_iter_next(&hbi, true)) != -1) {
-        do {
-            if (yield_and_check(job)) {
-                return 0;
-            }
-            ret = backup_do_cow(job, cluster * job->cluster_size,
-                                job->cluster_size, &error_is_read, false);
-            if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
-                           BLOCK_ERROR_ACTION_REPORT)
+    job->chunk_size = job->cluster_size;
+    qemu_co_queue_init(&job->worker_queue);
+
+    for (;;) {
+        BackupWorker *w;
+        Coroutine *co;
+        int64_t n, max_clusters;
+
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        backup_wait_for_workers(job, job->max_workers - 1);
+
+        if (job->worker_ret < 0) {
+            /* Let the others finish so that the error action sees them */
+            backup_wait_for_workers(job, 0);
+            ret = job->worker_ret;
+            job->worker_ret = 0;
+            if (backup_error_action(job, job->worker_error_is_read, -ret) ==
+                BLOCK_ERROR_ACTION_REPORT)
             {
                 return ret;
             }
-        } while (ret < 0);
+            /* Failed chunks were marked for copying again */
+            ret = 0;
+            cluster = 0;
+            continue;
+        }
+
+        hbitmap_iter_init(&hbi, job->copy_bitmap, cluster);
+        cluster = hbitmap_iter_next(&hbi, true);
+        if (cluster < 0) {
+            backup_wait_for_workers(job, 0);
+            if (job->worker_ret < 0) {
+                continue;
+            }
+            break;
+        }
+
+        max_clusters = MIN(job->chunk_size / job->cluster_size,
+                           nb_clusters - cluster);
+        for (n = 1; n < max_clusters; n++) {
+            if (!hbitmap_get(job->copy_bitmap, cluster + n)) {
+                break;
+            }
+        }
+
+        w = g_new(BackupWorker, 1);
+        *w = (BackupWorker) {
+            .job    = job,
+            .offset = cluster * job->cluster_size,
+            .bytes  = n * job->cluster_size,
+        };
+        cluster += n;
+
+        trace_backup_worker_start(job, w->offset, w->bytes, job->in_flight);
+        job->in_flight++;
+        co = qemu_coroutine_create(backup_worker, w);
+        qemu_coroutine_enter(co);
     }
 
-    return 0;
+    backup_wait_for_workers(job, 0);
+    return ret;
 }
 
 /* init copy_bitmap from sync_bitmap */
@@ -485,10 +705,9 @@ static void coroutine_fn backup_run(void *opaque)
     BackupBlockJob *job = opaque;
     BackupCompleteData *data;
     BlockDriverState *bs = blk_bs(job->common.blk);
-    int64_t offset, nb_clusters;
+    int64_t nb_clusters;
     int ret = 0;
 
-    QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
     nb_clusters = DIV_ROUND_UP(job->len, job->cluster_size);
@@ -513,68 +732,9 @@ static void coroutine_fn backup_run(void *opaque)
              * notify callback service CoW requests. */
             job_yield(&job->common.job);
         }
-    } else if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
-        ret = backup_run_incremental(job);
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (offset = 0; offset < job->len;
-             offset += job->cluster_size) {
-            bool error_is_read;
-            int alloced = 0;
-
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i;
-                int64_t n;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < job->cluster_size;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs, offset + i,
-                                          job->cluster_size - i, &n);
-                    i += n;
-
-                    if (alloced || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            if (alloced < 0) {
-                ret = alloced;
-            } else {
-                ret = backup_do_cow(job, offset, job->cluster_size,
-                                    &error_is_read, false);
-            }
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    offset -= job->cluster_size;
-                    continue;
-                }
-            }
-        }
+        /* FULL, TOP and INCREMENTAL copy what copy_bitmap says */
+        ret = backup_loop(job);
     }
 
     notifier_with_return_remove(&job->before_write);
@@ -608,7 +768,7 @@ static const BlockJobDriver backup_job_driver = {
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
-                  bool compress,
+                  bool compress, int max_workers, int64_t max_chunk,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -646,6 +806,19 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (max_workers < 0 || max_workers > BACKUP_MAX_WORKERS_LIMIT) {
+        error_setg(errp, "max-workers must be between 1 and %d, "
+                   "or 0 for the default",
+                   BACKUP_MAX_WORKERS_LIMIT);
+        return NULL;
+    }
+
+    if (max_chunk < 0 || max_chunk > BACKUP_MAX_CHUNK_LIMIT) {
+        error_setg(errp, "max-chunk must be at most %d bytes",
+                   BACKUP_MAX_CHUNK_LIMIT);
+        return NULL;
+    }
+
     if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
         return NULL;
     }
@@ -742,6 +915,17 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                                QEMU_ALIGN_UP(job->copy_range_size,
                                              job->cluster_size));
 
+    job->max_workers = max_workers ?: BACKUP_MAX_WORKERS_DEFAULT;
+    /* Compressed writes must be exactly one cluster */
+    if (compress) {
+        job->max_chunk = job->cluster_size;
+    } else {
+        job->max_chunk = max_chunk ?: BACKUP_MAX_CHUNK_DEFAULT;
+        job->max_chunk = MAX(job->cluster_size,
+                             QEMU_ALIGN_DOWN(job->max_chunk,
+                                             job->cluster_size));
+    }
+
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
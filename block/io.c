@@ -591,11 +591,22 @@ static void tracked_request_end(BdrvTrackedRequest *req)
     }
 
     qemu_co_mutex_lock(&req->bs->reqs_lock);
-    QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->node, &req->bs->tracked_requests);
     qemu_co_queue_restart_all(&req->wait_queue);
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
 }
 
+/*
+ * Tracked requests are indexed by their overlap range, widened to a single
+ * byte for empty requests so that they still have a place in the tree.
+ * tracked_request_overlaps() remains the exact check.
+ */
+static void tracked_request_set_node(BdrvTrackedRequest *req)
+{
+    req->node.start = req->overlap_offset;
+    req->node.last = req->overlap_offset + MAX(req->overlap_bytes, 1) - 1;
+}
+
 /**
  * Add an active request to the tracked requests list
  */
@@ -619,25 +630,38 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     };
 
     qemu_co_queue_init(&req->wait_queue);
+    tracked_request_set_node(req);
 
     qemu_co_mutex_lock(&bs->reqs_lock);
-    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    interval_tree_insert(&req->node, &bs->tracked_requests);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 {
+    BlockDriverState *bs = req->bs;
     int64_t overlap_offset = req->offset & ~(align - 1);
     uint64_t overlap_bytes = ROUND_UP(req->offset + req->bytes, align)
                                - overlap_offset;
 
     if (!req->serialising) {
-        atomic_inc(&req->bs->serialising_in_flight);
+        atomic_inc(&bs->serialising_in_flight);
         req->serialising = true;
     }
 
+    if (overlap_offset >= req->overlap_offset &&
+        overlap_bytes <= req->overlap_bytes) {
+        return;
+    }
+
+    /* The tree is keyed by the overlap range, so re-index the request */
+    qemu_co_mutex_lock(&bs->reqs_lock);
+    interval_tree_remove(&req->node, &bs->tracked_requests);
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    tracked_request_set_node(req);
+    interval_tree_insert(&req->node, &bs->tracked_requests);
+    qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
 static bool is_request_serialising_and_aligned(BdrvTrackedRequest *req)
@@ -720,6 +744,8 @@ static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
     BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
+    uint64_t start, last;
     bool retry;
     bool waited = false;
 
@@ -730,7 +756,14 @@ static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
     do {
         retry = false;
         qemu_co_mutex_lock(&bs->reqs_lock);
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        start = self->node.start;
+        last = self->node.last;
+        for (node = interval_tree_iter_first(&bs->tracked_requests,
+                                             start, last);
+             node;
+             node = interval_tree_iter_next(&bs->tracked_requests, node,
+                                            start, last)) {
+            req = container_of(node, BdrvTrackedRequest, node);
             if (req == self || (!req->serialising && !self->serialising)) {
                 continue;
             }
@@ -1632,6 +1665,7 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, uint64_t bytes,
     BlockDriverState *bs = child->bs;
 
     atomic_inc(&bs->write_gen);
+    bdrv_bsc_invalidate(bs);
 
     /*
      * Discard cannot extend the image, but in error handling cases, such as
@@ -2052,6 +2086,106 @@ int coroutine_fn bdrv_co_block_status_from_backing(BlockDriverState *bs,
     return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
 }
 
+/*
+ * Block status cache
+ *
+ * Clients like mirror, stream or NBD block status queries tend to ask for the
+ * same unchanged regions over and over again, and every query costs metadata
+ * lookups in the driver.  For drivers that set
+ * block_status_cacheable, the most recent results are therefore kept per
+ * node.  Any change of the node (a write, discard or truncate, or a graph
+ * change) starts a new generation, and entries from older generations are
+ * ignored.  A query that races with such a change fills the cache with the
+ * generation it started in, so its result is never used.
+ */
+void bdrv_bsc_invalidate(BlockDriverState *bs)
+{
+    qemu_mutex_lock(&bs->bsc_lock);
+    bs->bsc_gen++;
+    qemu_mutex_unlock(&bs->bsc_lock);
+}
+
+static bool bdrv_bsc_lookup(BlockDriverState *bs, bool want_zero,
+                            int64_t offset, int64_t bytes, int *ret,
+                            int64_t *pnum, int64_t *map,
+                            BlockDriverState **file, uint64_t *gen)
+{
+    BdrvBlockStatusCacheEntry *e;
+    bool found = false;
+    int i;
+
+    qemu_mutex_lock(&bs->bsc_lock);
+    *gen = bs->bsc_gen;
+    for (i = 0; i < BDRV_BSC_ENTRIES; i++) {
+        e = &bs->bsc_entries[i];
+        /* A result for want_zero=true is at least as good */
+        if (e->gen != *gen || (want_zero && !e->want_zero) ||
+            offset < e->offset || offset - e->offset >= e->bytes) {
+            continue;
+        }
+        *ret = e->ret;
+        *pnum = MIN(e->offset + e->bytes - offset, bytes);
+        *map = e->map + (offset - e->offset);
+        *file = e->file;
+        found = true;
+        break;
+    }
+    qemu_mutex_unlock(&bs->bsc_lock);
+
+    return found;
+}
+
+static void bdrv_bsc_fill(BlockDriverState *bs, bool want_zero,
+                          int64_t offset, int64_t bytes, int ret,
+                          int64_t map, BlockDriverState *file, uint64_t gen)
+{
+    qemu_mutex_lock(&bs->bsc_lock);
+    if (bs->bsc_gen == gen) {
+        bs->bsc_entries[bs->bsc_next] = (BdrvBlockStatusCacheEntry) {
+            .gen        = gen,
+            .offset     = offset,
+            .bytes      = bytes,
+            .map        = map,
+            .file       = file,
+            .ret        = ret,
+            .want_zero  = want_zero,
+        };
+        bs->bsc_next = (bs->bsc_next + 1) % BDRV_BSC_ENTRIES;
+    }
+    qemu_mutex_unlock(&bs->bsc_lock);
+}
+
+/* Calls the driver's bdrv_co_block_status(), unless the result is cached */
+static int coroutine_fn bdrv_co_block_status_cached(BlockDriverState *bs,
+                                                    bool want_zero,
+                                                    int64_t offset,
+                                                    int64_t bytes,
+                                                    int64_t *pnum,
+                                                    int64_t *map,
+                                                    BlockDriverState **file)
+{
+    uint64_t gen;
+    int ret;
+
+    if (!bs->drv->block_status_cacheable) {
+        return bs->drv->bdrv_co_block_status(bs, want_zero, offset, bytes,
+                                             pnum, map, file);
+    }
+
+    if (bdrv_bsc_lookup(bs, want_zero, offset, bytes, &ret, pnum, map, file,
+                        &gen)) {
+        trace_bdrv_block_status_cache_hit(bs, offset, *pnum, ret);
+        return ret;
+    }
+
+    ret = bs->drv->bdrv_co_block_status(bs, want_zero, offset, bytes,
+                                        pnum, map, file);
+    if (ret >= 0 && !(ret & BDRV_BLOCK_EOF)) {
+        bdrv_bsc_fill(bs, want_zero, offset, *pnum, ret, *map, *file, gen);
+    }
+    return ret;
+}
+
 /*
  * Returns the allocation status of the specified sectors.
  * Drivers not implementing the functionality are assumed to not support
@@ -2138,9 +2272,9 @@ static int coroutine_fn bdrv_co_block_status(BlockDriverState *bs,
     aligned_offset = QEMU_ALIGN_DOWN(offset, align);
     aligned_bytes = ROUND_UP(offset + bytes, align) - aligned_offset;
 
-    ret = bs->drv->bdrv_co_block_status(bs, want_zero, aligned_offset,
-                                        aligned_bytes, pnum, &local_map,
-                                        &local_file);
+    ret = bdrv_co_block_status_cached(bs, want_zero, aligned_offset,
+                                      aligned_bytes, pnum, &local_map,
+                                      &local_file);
     if (ret < 0) {
         *pnum = 0;
         goto out;
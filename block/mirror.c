@@ -995,7 +995,7 @@ static void coroutine_fn mirror_run(void *opaque)
             /* The two disks are in sync.  Exit and report successful
              * completion.
              */
-            assert(QLIST_EMPTY(&bs->tracked_requests));
+            assert(interval_tree_is_empty(&bs->tracked_requests));
             s->common.job.cancelled = false;
             need_drain = false;
             break;
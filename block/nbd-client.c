@@ -47,10 +47,9 @@ static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(BlockDriverState *bs,
+                                    NBDClientSession *client)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-
     if (!client->ioc) { /* Already closed */
         return;
     }
@@ -61,7 +60,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
                          NULL);
     BDRV_POLL_WHILE(bs, client->read_reply_co);
 
-    nbd_client_detach_aio_context(bs);
+    nbd_client_detach_aio_context(client);
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -118,11 +117,10 @@ static coroutine_fn void nbd_read_reply_entry(void *opaque)
     s->read_reply_co = NULL;
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NBDClientSession *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int rc, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -750,12 +748,11 @@ static int nbd_co_receive_blockstatus_reply(NBDClientSession *s,
     return iter.ret;
 }
 
-static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
+static int nbd_co_request(NBDClientSession *client, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -764,7 +761,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(client, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
@@ -781,7 +778,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -794,7 +791,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -810,7 +807,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
         .from = offset,
@@ -828,13 +825,13 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    return nbd_co_request(client, &request, qiov);
 }
 
 int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int bytes, BdrvRequestFlags flags)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
         .from = offset,
@@ -857,12 +854,12 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_FLUSH };
 
     if (!(client->info.flags & NBD_FLAG_SEND_FLUSH)) {
@@ -872,12 +869,12 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
         .from = offset,
@@ -889,7 +886,7 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    return nbd_co_request(client, &request, NULL);
 }
 
 int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
@@ -900,7 +897,7 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
 {
     int64_t ret;
     NBDExtent extent = { 0 };
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_client_session(bs);
     Error *local_err = NULL;
 
     NBDRequest request = {
@@ -917,7 +914,7 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
         return BDRV_BLOCK_DATA;
     }
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -937,23 +934,20 @@ int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
            (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
 }
 
-void nbd_client_detach_aio_context(BlockDriverState *bs)
+void nbd_client_detach_aio_context(NBDClientSession *client)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
 }
 
-void nbd_client_attach_aio_context(BlockDriverState *bs,
+void nbd_client_attach_aio_context(NBDClientSession *client,
                                    AioContext *new_context)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
     aio_co_schedule(new_context, client->read_reply_co);
 }
 
-void nbd_client_close(BlockDriverState *bs)
+void nbd_client_close(BlockDriverState *bs, NBDClientSession *client)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     NBDRequest request = { .type = NBD_CMD_DISC };
 
     if (client->ioc == NULL) {
@@ -962,10 +956,11 @@ void nbd_client_close(BlockDriverState *bs)
 
     nbd_send_request(client->ioc, &request);
 
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(bs, client);
 }
 
 int nbd_client_init(BlockDriverState *bs,
+                    NBDClientSession *client,
                     QIOChannelSocket *sioc,
                     const char *export,
                     QCryptoTLSCreds *tlscreds,
@@ -973,7 +968,6 @@ int nbd_client_init(BlockDriverState *bs,
                     const char *x_dirty_bitmap,
                     Error **errp)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
     int ret;
 
     /* NBD handshake */
@@ -1020,7 +1014,7 @@ int nbd_client_init(BlockDriverState *bs,
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     client->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, client);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    nbd_client_attach_aio_context(client, bdrv_get_aio_context(bs));
 
     logout("Established connection with NBD server\n");
     return 0;
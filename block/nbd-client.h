@@ -16,6 +16,7 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 typedef struct {
     Coroutine *coroutine;
@@ -23,6 +24,7 @@ typedef struct {
     bool receiving;         /* waiting for read_reply_co? */
 } NBDClientRequest;
 
+/* One connection to the server */
 typedef struct NBDClientSession {
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
@@ -38,16 +40,20 @@ typedef struct NBDClientSession {
     bool quit;
 } NBDClientSession;
 
+/* Returns the first connection, which has the export information */
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
+/* Returns the connection a new request should be sent on */
+NBDClientSession *nbd_pick_client_session(BlockDriverState *bs);
 
 int nbd_client_init(BlockDriverState *bs,
+                    NBDClientSession *client,
                     QIOChannelSocket *sock,
                     const char *export_name,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     const char *x_dirty_bitmap,
                     Error **errp);
-void nbd_client_close(BlockDriverState *bs);
+void nbd_client_close(BlockDriverState *bs, NBDClientSession *client);
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes);
 int nbd_client_co_flush(BlockDriverState *bs);
@@ -58,8 +64,8 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
 
-void nbd_client_detach_aio_context(BlockDriverState *bs);
-void nbd_client_attach_aio_context(BlockDriverState *bs,
+void nbd_client_detach_aio_context(NBDClientSession *client);
+void nbd_client_attach_aio_context(NBDClientSession *client,
                                    AioContext *new_context);
 
 int coroutine_fn nbd_client_co_block_status(BlockDriverState *bs,
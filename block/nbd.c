@@ -40,11 +40,15 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
+#include "qemu/error-report.h"
 
 #define EN_OPTSTR ":exportname="
 
 typedef struct BDRVNBDState {
-    NBDClientSession client;
+    NBDClientSession client[MAX_NBD_CONNECTIONS];
+    int num_clients;
+    int next_client;
+    int connections;        /* as requested by the user */
 
     /* For nbd_refresh_filename() */
     SocketAddress *saddr;
@@ -292,7 +296,35 @@ done:
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
-    return &s->client;
+    return &s->client[0];
+}
+
+/*
+ * Spread requests over the connections: take the one with the fewest
+ * requests in flight, searching from the one after the last choice.
+ */
+NBDClientSession *nbd_pick_client_session(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+    int i, best = -1;
+
+    for (i = 0; i < s->num_clients; i++) {
+        int n = (s->next_client + i) % s->num_clients;
+
+        if (s->client[n].quit) {
+            continue;
+        }
+        if (best < 0 || s->client[n].in_flight < s->client[best].in_flight) {
+            best = n;
+        }
+    }
+
+    if (best < 0) {
+        /* All connections are dead, requests will fail on any of them */
+        return &s->client[0];
+    }
+    s->next_client = (best + 1) % s->num_clients;
+    return &s->client[best];
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -384,6 +416,11 @@ static QemuOptsList nbd_runtime_opts = {
             .help = "experimental: expose named dirty bitmap in place of "
                     "block status",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open to the server",
+        },
         { /* end of list */ }
     },
 };
@@ -397,7 +434,9 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     QIOChannelSocket *sioc = NULL;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
-    int ret = -EINVAL;
+    NBDClientSession *first = &s->client[0];
+    int64_t connections;
+    int i, ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
@@ -434,18 +473,60 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = s->saddr->u.inet.host;
     }
 
-    /* establish TCP connection, return error if it fails
-     * TODO: Configurable retry-until-timeout behaviour.
-     */
-    sioc = nbd_establish_connection(s->saddr, errp);
-    if (!sioc) {
-        ret = -ECONNREFUSED;
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "'connections' must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
         goto error;
     }
+    s->connections = connections;
+
+    for (i = 0; i < connections; i++) {
+        NBDClientSession *client = &s->client[i];
+
+        /* establish TCP connection, return error if it fails
+         * TODO: Configurable retry-until-timeout behaviour.
+         */
+        sioc = nbd_establish_connection(s->saddr, errp);
+        if (!sioc) {
+            ret = -ECONNREFUSED;
+            goto error;
+        }
+
+        /* NBD handshake */
+        ret = nbd_client_init(bs, client, sioc, s->export, tlscreds, hostname,
+                              qemu_opt_get(opts, "x-dirty-bitmap"), errp);
+        object_unref(OBJECT(sioc));
+        sioc = NULL;
+        if (ret < 0) {
+            goto error;
+        }
+        s->num_clients++;
+
+        /*
+         * Without NBD_FLAG_CAN_MULTI_CONN, a flush on one connection need
+         * not cover writes that were completed on another one, and reads
+         * need not see them either.
+         */
+        if (i == 0 && connections > 1 &&
+            !(first->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+            warn_report("NBD server does not support multiple connections "
+                        "to export '%s', using only one", s->export ?: "");
+            break;
+        }
+
+        if (client->info.size != first->info.size ||
+            client->info.flags != first->info.flags ||
+            client->info.structured_reply != first->info.structured_reply ||
+            client->info.base_allocation != first->info.base_allocation) {
+            error_setg(errp, "NBD server sent inconsistent export information "
+                       "on connection %d", i);
+            ret = -EINVAL;
+            goto error;
+        }
+    }
+    ret = 0;
 
-    /* NBD handshake */
-    ret = nbd_client_init(bs, sioc, s->export, tlscreds, hostname,
-                          qemu_opt_get(opts, "x-dirty-bitmap"), errp);
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -454,6 +535,10 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         object_unref(OBJECT(tlscreds));
     }
     if (ret < 0) {
+        for (i = 0; i < s->num_clients; i++) {
+            nbd_client_close(bs, &s->client[i]);
+        }
+        s->num_clients = 0;
         qapi_free_SocketAddress(s->saddr);
         g_free(s->export);
         g_free(s->tlscredsid);
@@ -487,8 +572,11 @@ static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    int i;
 
-    nbd_client_close(bs);
+    for (i = 0; i < s->num_clients; i++) {
+        nbd_client_close(bs, &s->client[i]);
+    }
 
     qapi_free_SocketAddress(s->saddr);
     g_free(s->export);
@@ -499,18 +587,28 @@ static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.info.size;
+    return s->client[0].info.size;
 }
 
 static void nbd_detach_aio_context(BlockDriverState *bs)
 {
-    nbd_client_detach_aio_context(bs);
+    BDRVNBDState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->num_clients; i++) {
+        nbd_client_detach_aio_context(&s->client[i]);
+    }
 }
 
 static void nbd_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    nbd_client_attach_aio_context(bs, new_context);
+    BDRVNBDState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->num_clients; i++) {
+        nbd_client_attach_aio_context(&s->client[i], new_context);
+    }
 }
 
 static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
@@ -559,6 +657,9 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (s->tlscredsid) {
         qdict_put_str(opts, "tls-creds", s->tlscredsid);
     }
+    if (s->connections > 1) {
+        qdict_put_int(opts, "connections", s->connections);
+    }
 
     qdict_flatten(opts);
     bs->full_open_options = opts;
@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include <linux/vfio.h>
 #include "qapi/error.h"
+#include "qapi/qapi-types-block-core.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/error-report.h"
@@ -29,6 +30,8 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_BAR_SIZE 8192
+#define NVME_DEFAULT_IO_QUEUES 4
+#define NVME_MAX_IO_QUEUES 64
 
 typedef struct {
     int32_t  head, tail;
@@ -41,6 +44,8 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    /* Receives dword 0 of the completion entry if not NULL */
+    uint32_t *result;
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -53,8 +58,12 @@ typedef struct {
 
     /* Fields protected by BQL */
     int         index;
+    int         vector;
     uint8_t     *prp_list_pages;
 
+    /* AioContext that submits to this queue, set under s->queue_lock */
+    AioContext  *ctx;
+
     /* Fields protected by @lock */
     NVMeQueue   sq, cq;
     int         cq_phase;
@@ -62,6 +71,12 @@ typedef struct {
     bool        busy;
     int         need_kick;
     int         inflight;
+
+    /* Statistics, protected by @lock */
+    uint64_t    submitted;
+    uint64_t    completed;
+    uint64_t    polled;
+    uint64_t    full_waits;
 } NVMeQueuePair;
 
 /* Memory mapped registers */
@@ -86,21 +101,37 @@ typedef volatile struct {
 
 QEMU_BUILD_BUG_ON(offsetof(NVMeRegs, doorbells) != 0x1000);
 
+typedef struct BDRVNVMeState BDRVNVMeState;
+
+/* An MSI-X vector of the device */
 typedef struct {
+    EventNotifier notifier;
+    BDRVNVMeState *s;
+    int index;
+} NVMeVector;
+
+struct BDRVNVMeState {
     AioContext *aio_context;
     QEMUVFIOState *vfio;
     NVMeRegs *regs;
     /* The submission/completion queue pairs.
      * [0]: admin queue.
-     * [1..]: io queues.
+     * [1..]: io queues, used by one AioContext each as long as there are
+     *        enough of them.
      */
     NVMeQueuePair **queues;
     int nr_queues;
+    /* Protects the assignment of io queues to AioContexts */
+    QemuMutex queue_lock;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
     bool write_cache_supported;
-    EventNotifier irq_notifier;
+    /* Vector 0 signals the admin queue and all io queues that didn't get a
+     * vector of their own, vector i signals io queue i.
+     */
+    NVMeVector *vectors;
+    int nr_vectors;
     uint64_t nsze; /* Namespace size reported by identify command */
     int nsid;      /* The namespace id to read/write data. */
     uint64_t max_transfer;
@@ -111,10 +142,11 @@ typedef struct {
 
     /* Total size of mapped qiov, accessed under dma_map_lock */
     int dma_map_count;
-} BDRVNVMeState;
+};
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_QUEUES "queues"
 
 static QemuOptsList runtime_opts = {
     .name = "nvme",
@@ -130,6 +162,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs to create (default: 4)",
+        },
         { /* end of list */ }
     },
 };
@@ -251,6 +288,7 @@ static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
          * == tail + 1). */
         if (qemu_in_coroutine()) {
             trace_nvme_free_req_queue_wait(q);
+            q->full_waits++;
             qemu_co_queue_wait(&q->free_req_queue, &q->lock);
         } else {
             qemu_mutex_unlock(&q->lock);
@@ -293,10 +331,10 @@ static inline int nvme_translate_error(const NvmeCqe *c)
     }
 }
 
-/* With q->lock */
-static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
+/* With q->lock, returns the number of completed requests */
+static int nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
 {
-    bool progress = false;
+    int completed = 0;
     NVMeRequest *preq;
     NVMeRequest req;
     NvmeCqe *c;
@@ -304,7 +342,7 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
     trace_nvme_process_completion(s, q->index, q->inflight);
     if (q->busy || s->plugged) {
         trace_nvme_process_completion_queue_busy(s, q->index);
-        return false;
+        return 0;
     }
     q->busy = true;
     assert(q->inflight >= 0);
@@ -332,6 +370,10 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         assert(req.cb);
         preq->busy = false;
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, nvme_translate_error(c));
         qemu_mutex_lock(&q->lock);
@@ -339,9 +381,10 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         q->inflight--;
         /* Flip Phase Tag bit. */
         c->status = cpu_to_le16(le16_to_cpu(c->status) ^ 0x1);
-        progress = true;
+        completed++;
     }
-    if (progress) {
+    if (completed) {
+        q->completed += completed;
         /* Notify the device so it can post more completions. */
         smp_mb_release();
         *q->cq.doorbell = cpu_to_le32(q->cq.head);
@@ -350,7 +393,7 @@ static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
         }
     }
     q->busy = false;
-    return progress;
+    return completed;
 }
 
 static void nvme_trace_command(const NvmeCmd *cmd)
@@ -381,6 +424,7 @@ static void nvme_submit_command(BDRVNVMeState *s, NVMeQueuePair *q,
            q->sq.tail * NVME_SQ_ENTRY_BYTES, cmd, sizeof(*cmd));
     q->sq.tail = (q->sq.tail + 1) % NVME_QUEUE_SIZE;
     q->need_kick++;
+    q->submitted++;
     nvme_kick(s, q);
     nvme_process_completion(s, q);
     qemu_mutex_unlock(&q->lock);
@@ -392,8 +436,9 @@ static void nvme_cmd_sync_cb(void *opaque, int ret)
     *pret = ret;
 }
 
-static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
-                         NvmeCmd *cmd)
+/* Like nvme_cmd_sync(), but also returns dword 0 of the completion */
+static int nvme_cmd_sync_result(BlockDriverState *bs, NVMeQueuePair *q,
+                                NvmeCmd *cmd, uint32_t *result)
 {
     NVMeRequest *req;
     BDRVNVMeState *s = bs->opaque;
@@ -402,12 +447,19 @@ static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
 
     BDRV_POLL_WHILE(bs, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
+                         NvmeCmd *cmd)
+{
+    return nvme_cmd_sync_result(bs, q, cmd, NULL);
+}
+
 static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -467,31 +519,72 @@ out:
     qemu_vfree(resp);
 }
 
-static bool nvme_poll_queues(BDRVNVMeState *s)
+/* Ask the device for @count io queues.  Returns how many to try creating. */
+static int nvme_set_queue_count(BlockDriverState *bs, int count)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((count - 1) << 16) | (count - 1)),
+    };
+    uint32_t granted;
+
+    if (count == 1) {
+        return 1;
+    }
+    if (nvme_cmd_sync_result(bs, s->queues[0], &cmd, &granted)) {
+        trace_nvme_set_queue_count_failed(s, count);
+        return 1;
+    }
+    /* Zero-based numbers of submission and completion queues allocated */
+    return MIN(count, MIN(granted & 0xffff, granted >> 16) + 1);
+}
+
+static bool nvme_poll_queue(BDRVNVMeState *s, NVMeQueuePair *q, bool polled)
 {
+    bool progress = false;
+    int n;
+
+    qemu_mutex_lock(&q->lock);
+    while ((n = nvme_process_completion(s, q))) {
+        /* Keep polling */
+        if (polled) {
+            q->polled += n;
+        }
+        progress = true;
+    }
+    qemu_mutex_unlock(&q->lock);
+    return progress;
+}
+
+/* Process completions on the queues signalled by @v */
+static bool nvme_poll_vector(NVMeVector *v, bool polled)
+{
+    BDRVNVMeState *s = v->s;
     bool progress = false;
     int i;
 
+    if (v->index) {
+        return nvme_poll_queue(s, s->queues[v->index], polled);
+    }
     for (i = 0; i < s->nr_queues; i++) {
-        NVMeQueuePair *q = s->queues[i];
-        qemu_mutex_lock(&q->lock);
-        while (nvme_process_completion(s, q)) {
-            /* Keep polling */
-            progress = true;
+        if (s->queues[i]->vector == 0) {
+            progress |= nvme_poll_queue(s, s->queues[i], polled);
         }
-        qemu_mutex_unlock(&q->lock);
     }
     return progress;
 }
 
 static void nvme_handle_event(EventNotifier *n)
 {
-    BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+    NVMeVector *v = container_of(n, NVMeVector, notifier);
+    BDRVNVMeState *s = v->s;
 
-    trace_nvme_handle_event(s);
+    trace_nvme_handle_event(s, v->index);
     aio_context_acquire(s->aio_context);
     event_notifier_test_and_clear(n);
-    nvme_poll_queues(s);
+    nvme_poll_vector(v, false);
     aio_context_release(s->aio_context);
 }
 
@@ -507,11 +600,12 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     if (!q) {
         return false;
     }
+    q->vector = n < s->nr_vectors ? n : 0;
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
-        .cdw11 = cpu_to_le32(0x3),
+        .cdw11 = cpu_to_le32(0x3 | (q->vector << 16)),
     };
     if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
         error_setg(errp, "Failed to create io queue [%d]", n);
@@ -538,19 +632,108 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
-    BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
-    bool progress = false;
+    NVMeVector *v = container_of(e, NVMeVector, notifier);
 
-    trace_nvme_poll_cb(s);
-    progress = nvme_poll_queues(s);
-    return progress;
+    trace_nvme_poll_cb(v->s, v->index);
+    return nvme_poll_vector(v, true);
+}
+
+/* Register the vectors that have a queue to signal in @ctx */
+static void nvme_attach_vectors(BDRVNVMeState *s, AioContext *ctx)
+{
+    int i;
+
+    for (i = 0; i < MIN(s->nr_vectors, s->nr_queues); i++) {
+        aio_set_event_notifier(ctx, &s->vectors[i].notifier,
+                               false, nvme_handle_event, nvme_poll_cb);
+    }
+}
+
+static void nvme_detach_vectors(BDRVNVMeState *s, AioContext *ctx)
+{
+    int i;
+
+    for (i = 0; i < s->nr_vectors; i++) {
+        aio_set_event_notifier(ctx, &s->vectors[i].notifier,
+                               false, NULL, NULL);
+    }
+}
+
+/* Set up one MSI-X vector for the admin queue and one for each of @count io
+ * queues, or as many as the device has. */
+static int nvme_init_vectors(BDRVNVMeState *s, int count, Error **errp)
+{
+    EventNotifier **notifiers = g_new(EventNotifier *, count);
+    int i, ret;
+
+    s->vectors = g_new0(NVMeVector, count);
+    for (i = 0; i < count; i++) {
+        NVMeVector *v = &s->vectors[i];
+
+        ret = event_notifier_init(&v->notifier, 0);
+        if (ret) {
+            error_setg(errp, "Failed to init event notifier");
+            goto out;
+        }
+        v->s = s;
+        v->index = i;
+        notifiers[i] = &v->notifier;
+        s->nr_vectors++;
+    }
+
+    ret = qemu_vfio_pci_init_irqs(s->vfio, notifiers, count,
+                                  VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (ret < 0) {
+        goto out;
+    }
+    while (s->nr_vectors > ret) {
+        event_notifier_cleanup(&s->vectors[--s->nr_vectors].notifier);
+    }
+    ret = 0;
+out:
+    g_free(notifiers);
+    return ret;
+}
+
+/* Returns the io queue to use for requests from the current AioContext */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q = NULL;
+    int i;
+
+    assert(s->nr_queues > 1);
+    for (i = 1; i < s->nr_queues; i++) {
+        if (atomic_read(&s->queues[i]->ctx) == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    qemu_mutex_lock(&s->queue_lock);
+    for (i = 1; i < s->nr_queues; i++) {
+        if (!s->queues[i]->ctx || s->queues[i]->ctx == ctx) {
+            q = s->queues[i];
+            if (!q->ctx) {
+                trace_nvme_assign_queue(s, q->index, ctx);
+                atomic_set(&q->ctx, ctx);
+            }
+            break;
+        }
+    }
+    qemu_mutex_unlock(&s->queue_lock);
+
+    if (!q) {
+        /* More AioContexts than queues, share them */
+        q = s->queues[1 + ((uintptr_t)ctx >> 6) % (s->nr_queues - 1)];
+    }
+    return q;
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     int queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
-    int ret;
+    int i, ret;
     uint64_t cap;
     uint64_t timeout_ms;
     uint64_t deadline, now;
@@ -558,13 +741,9 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->queue_lock);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
-    ret = event_notifier_init(&s->irq_notifier, 0);
-    if (ret) {
-        error_setg(errp, "Failed to init event notifier");
-        return ret;
-    }
 
     s->vfio = qemu_vfio_open_pci(device, errp);
     if (!s->vfio) {
@@ -637,13 +816,11 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, &s->irq_notifier,
-                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    ret = nvme_init_vectors(s, queues + 1, errp);
     if (ret) {
         goto out;
     }
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, nvme_handle_event, nvme_poll_cb);
+    nvme_attach_vectors(s, s->aio_context);
 
     nvme_identify(bs, namespace, &local_err);
     if (local_err) {
@@ -652,10 +829,23 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
-    /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
-        ret = -EIO;
+    /* Set up command queues.  The device may give us fewer than we asked
+     * for, so settle with what we get once the first one exists. */
+    queues = nvme_set_queue_count(bs, queues);
+    for (i = 0; i < queues; i++) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            if (!i) {
+                error_propagate(errp, local_err);
+                ret = -EIO;
+                goto out;
+            }
+            trace_nvme_add_io_queue_failed(s, s->nr_queues);
+            error_free(local_err);
+            local_err = NULL;
+            break;
+        }
     }
+    nvme_attach_vectors(s, s->aio_context);
 out:
     /* Cleaning up is done in nvme_file_open() upon error. */
     return ret;
@@ -725,9 +915,12 @@ static void nvme_close(BlockDriverState *bs)
         nvme_free_queue_pair(bs, s->queues[i]);
     }
     g_free(s->queues);
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, NULL, NULL);
-    event_notifier_cleanup(&s->irq_notifier);
+    nvme_detach_vectors(s, bdrv_get_aio_context(bs));
+    for (i = 0; i < s->nr_vectors; i++) {
+        event_notifier_cleanup(&s->vectors[i].notifier);
+    }
+    g_free(s->vectors);
+    qemu_mutex_destroy(&s->queue_lock);
     qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0, NVME_BAR_SIZE);
     qemu_vfio_close(s->vfio);
 }
@@ -738,6 +931,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    int64_t queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -751,7 +945,15 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_QUEUES,
+                                 NVME_DEFAULT_IO_QUEUES);
+    if (queues < 1 || queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_QUEUES "' must be between 1 and %d",
+                   NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -913,7 +1115,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     uint32_t cdw12 = (((bytes >> BDRV_SECTOR_BITS) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -930,7 +1132,6 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     };
 
     trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
 
@@ -1027,7 +1228,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[1];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1038,7 +1239,6 @@ static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
         .ret = -EINPROGRESS,
     };
 
-    assert(s->nr_queues > 1);
     req = nvme_get_free_req(ioq);
     assert(req);
     nvme_submit_command(s, ioq, req, &cmd, nvme_rw_cb, &data);
@@ -1080,12 +1280,57 @@ static void nvme_refresh_limits(BlockDriverState *bs, Error **errp)
     bs->bl.max_transfer = s->max_transfer;
 }
 
+static ImageInfoSpecific *nvme_get_specific_info(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    ImageInfoSpecific *spec_info = g_new0(ImageInfoSpecific, 1);
+    NVMeQueueStatsList **next;
+    int i;
+
+    *spec_info = (ImageInfoSpecific){
+        .type = IMAGE_INFO_SPECIFIC_KIND_NVME,
+        .u = {
+            .nvme.data = g_new0(ImageInfoSpecificNVMe, 1),
+        },
+    };
+
+    next = &spec_info->u.nvme.data->queues;
+    for (i = 1; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        NVMeQueueStats *stats = g_new0(NVMeQueueStats, 1);
+
+        qemu_mutex_lock(&q->lock);
+        *stats = (NVMeQueueStats) {
+            .index = q->index,
+            .vector = q->vector,
+            .submitted = q->submitted,
+            .completed = q->completed,
+            .polled = q->polled,
+            .full_waits = q->full_waits,
+        };
+        qemu_mutex_unlock(&q->lock);
+
+        *next = g_new0(NVMeQueueStatsList, 1);
+        (*next)->value = stats;
+        next = &(*next)->next;
+    }
+
+    return spec_info;
+}
+
 static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    nvme_detach_vectors(s, bdrv_get_aio_context(bs));
 
-    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
-                           false, NULL, NULL);
+    /* AioContexts pick their queue again once they submit requests */
+    qemu_mutex_lock(&s->queue_lock);
+    for (i = 1; i < s->nr_queues; i++) {
+        atomic_set(&s->queues[i]->ctx, NULL);
+    }
+    qemu_mutex_unlock(&s->queue_lock);
 }
 
 static void nvme_attach_aio_context(BlockDriverState *bs,
@@ -1094,8 +1339,7 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     BDRVNVMeState *s = bs->opaque;
 
     s->aio_context = new_context;
-    aio_set_event_notifier(new_context, &s->irq_notifier,
-                           false, nvme_handle_event, nvme_poll_cb);
+    nvme_attach_vectors(s, new_context);
 }
 
 static void nvme_aio_plug(BlockDriverState *bs)
@@ -1158,6 +1402,7 @@ static BlockDriver bdrv_nvme = {
 
     .bdrv_refresh_filename    = nvme_refresh_filename,
     .bdrv_refresh_limits      = nvme_refresh_limits,
+    .bdrv_get_specific_info   = nvme_get_specific_info,
 
     .bdrv_detach_aio_context  = nvme_detach_aio_context,
     .bdrv_attach_aio_context  = nvme_attach_aio_context,
@@ -0,0 +1,1202 @@
+/*
+ * Persistent read cache filter
+ *
+ * Keeps copies of clusters read from a slow child (e.g. an image on NFS or
+ * a remote NBD export) on a local, fast cache image, so that repeated reads
+ * of the same data (like many VMs booting from one golden image) only hit
+ * the slow child once.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/option.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+/*
+ * Cache image layout
+ *
+ * The cache image starts with a header, followed by a table with one entry
+ * per slot, followed by the slots themselves, each of which can hold one
+ * cluster of the base image.  All fields are little-endian.
+ *
+ * Every table entry carries a checksum of the data in its slot, which is
+ * verified whenever the slot is read.  Slots are filled by first clearing
+ * the entry, then writing the data and then the new entry, so torn updates
+ * after a crash are detected and treated as misses without any journalling.
+ * The only thing that must never become stale is an entry for a cluster
+ * that was overwritten in the base, so invalidations are made durable
+ * before base writes are issued.
+ *
+ * Each entry also has a generation that is incremented whenever its slot
+ * is filled, and kept when the entry is cleared.  Shared readers re-read
+ * the entry after reading the data of a slot: if the entry is unchanged,
+ * the populating process cannot have started to reuse the slot before the
+ * data was read.
+ *
+ * The header records the inode and modification time of the file that
+ * holds the base, if it is a local file, so that a cache is not used for a
+ * base that was replaced or modified behind its back.
+ */
+
+#define READ_CACHE_MAGIC        0x484341434452514dULL  /* "MQRDCACH" */
+#define READ_CACHE_VERSION      2
+#define READ_CACHE_HEADER_SIZE  4096
+#define READ_CACHE_TAG_SIZE     256
+
+#define READ_CACHE_MIN_CLUSTER_SIZE     4096
+#define READ_CACHE_MAX_CLUSTER_SIZE     (2 * 1024 * 1024)
+#define READ_CACHE_DEFAULT_CLUSTER_SIZE (64 * 1024)
+#define READ_CACHE_MAX_SLOTS            (1 << 24)
+#define READ_CACHE_MAX_TRANSFER         (1024 * 1024)
+
+/* Missed data waiting to be stored; reads beyond that are not cached */
+#define READ_CACHE_MAX_FILL_BYTES       (16 * 1024 * 1024)
+
+/* Minimum time between two table reloads in shared mode */
+#define READ_CACHE_RELOAD_INTERVAL_NS   (3 * NANOSECONDS_PER_SECOND)
+
+typedef struct ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t nb_slots;
+    uint64_t table_offset;
+    uint64_t data_offset;
+    uint64_t base_size;
+    /* 0 if the base is not a local file */
+    uint64_t base_ino;
+    int64_t base_mtime;
+    char base_tag[READ_CACHE_TAG_SIZE];
+} QEMU_PACKED ReadCacheHeader;
+
+typedef struct ReadCacheEntry {
+    /* Cluster index in the base image plus one, 0 for an empty slot */
+    uint64_t key;
+    /* crc32c of the cached data */
+    uint32_t crc;
+    /* Only smaller than the cluster size for the last cluster */
+    uint32_t length;
+    /* Incremented whenever the slot is filled */
+    uint64_t generation;
+} QEMU_PACKED ReadCacheEntry;
+
+/* End of disk format structures. */
+
+typedef enum ReadCacheSlotState {
+    READ_CACHE_SLOT_FREE,
+    READ_CACHE_SLOT_FILLING,
+    READ_CACHE_SLOT_VALID,
+} ReadCacheSlotState;
+
+typedef struct ReadCacheSlot {
+    /* Key in BDRVReadCacheState.map while the slot is valid */
+    int64_t cluster;
+    uint32_t crc;
+    uint32_t length;
+    uint64_t generation;
+    ReadCacheSlotState state;
+    /* Second chance for the eviction clock */
+    bool referenced;
+    /* Requests currently reading the slot, which keep it from eviction */
+    unsigned int readers;
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache_file;
+    uint32_t cluster_size;
+    char *base_tag;
+    uint64_t base_size;
+    uint64_t base_ino;
+    int64_t base_mtime;
+    bool shared;
+
+    /* Cleared for good after cache I/O errors */
+    bool enabled;
+    /* The cache image does not match and is formatted on the first fill */
+    bool needs_format;
+
+    uint64_t nb_slots;
+    uint64_t data_offset;
+    ReadCacheSlot *slots;
+    /* Cluster index -> valid slot */
+    GHashTable *map;
+    uint64_t clock_hand;
+
+    /* Serializes table updates and protects write_gen */
+    CoMutex lock;
+    /* Incremented by every write to the base */
+    uint64_t write_gen;
+    /* Entries were cleared since the cache image was last flushed */
+    bool entries_dirty;
+    /* The base was written, so its modification time changed */
+    bool base_written;
+    int64_t last_reload;
+
+    /* Bytes of missed data that are still being stored in the cache */
+    uint64_t fill_bytes;
+} BDRVReadCacheState;
+
+typedef struct ReadCacheFill {
+    BlockDriverState *bs;
+    int64_t cluster;
+    int64_t nb_clusters;
+    uint8_t *buf;
+    uint64_t bytes;
+    uint64_t gen;
+} ReadCacheFill;
+
+static QemuOptsList runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "cluster-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "Cache granularity",
+        },
+        {
+            .name = "base-tag",
+            .type = QEMU_OPT_STRING,
+            .help = "String identifying the cached image (default: its "
+                    "filename)",
+        },
+        {
+            .name = "shared",
+            .type = QEMU_OPT_BOOL,
+            .help = "Use the cache read-only, so that other processes can "
+                    "share it",
+        },
+        { /* end of list */ }
+    },
+};
+
+static uint64_t read_cache_table_offset(uint64_t index)
+{
+    return READ_CACHE_HEADER_SIZE + index * sizeof(ReadCacheEntry);
+}
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s, uint64_t index)
+{
+    return s->data_offset + index * s->cluster_size;
+}
+
+static uint32_t read_cache_cluster_length(BDRVReadCacheState *s,
+                                          int64_t cluster)
+{
+    return MIN(s->cluster_size, s->base_size - cluster * s->cluster_size);
+}
+
+/* Derive the number of slots and their location from the cache size */
+static int read_cache_compute_layout(BDRVReadCacheState *s, int64_t length,
+                                     Error **errp)
+{
+    uint64_t max_slots = length / s->cluster_size;
+    uint64_t table_size = ROUND_UP(max_slots * sizeof(ReadCacheEntry),
+                                   READ_CACHE_HEADER_SIZE);
+
+    s->data_offset = ROUND_UP(READ_CACHE_HEADER_SIZE + table_size,
+                              s->cluster_size);
+    if (s->data_offset >= length) {
+        error_setg(errp, "Cache image is too small for cluster size %" PRIu32,
+                   s->cluster_size);
+        return -ENOSPC;
+    }
+
+    s->nb_slots = (length - s->data_offset) / s->cluster_size;
+    if (s->nb_slots > READ_CACHE_MAX_SLOTS) {
+        error_setg(errp, "Cache image is too large for cluster size %" PRIu32
+                   " (at most %d clusters are supported)", s->cluster_size,
+                   READ_CACHE_MAX_SLOTS);
+        return -EFBIG;
+    }
+
+    return 0;
+}
+
+static void read_cache_make_header(BDRVReadCacheState *s, ReadCacheHeader *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic        = cpu_to_le64(READ_CACHE_MAGIC);
+    h->version      = cpu_to_le32(READ_CACHE_VERSION);
+    h->cluster_size = cpu_to_le32(s->cluster_size);
+    h->nb_slots     = cpu_to_le64(s->nb_slots);
+    h->table_offset = cpu_to_le64(read_cache_table_offset(0));
+    h->data_offset  = cpu_to_le64(s->data_offset);
+    h->base_size    = cpu_to_le64(s->base_size);
+    h->base_ino     = cpu_to_le64(s->base_ino);
+    h->base_mtime   = cpu_to_le64(s->base_mtime);
+    pstrcpy(h->base_tag, sizeof(h->base_tag), s->base_tag);
+}
+
+/*
+ * Identify the local file that holds the base, if any, by its inode and
+ * modification time.
+ */
+static void read_cache_get_base_identity(BDRVReadCacheState *s,
+                                         BlockDriverState *base)
+{
+    struct stat st;
+
+    while (base->file) {
+        base = base->file->bs;
+    }
+
+    s->base_ino = 0;
+    s->base_mtime = 0;
+    if (strcmp(base->drv->format_name, "file") ||
+        stat(base->filename, &st) < 0) {
+        return;
+    }
+    s->base_ino = st.st_ino;
+    s->base_mtime = st.st_mtime;
+}
+
+static void read_cache_clear_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    if (slot->state == READ_CACHE_SLOT_VALID) {
+        g_hash_table_remove(s->map, &slot->cluster);
+    }
+    slot->state = READ_CACHE_SLOT_FREE;
+    slot->referenced = false;
+}
+
+static void read_cache_publish_slot(BDRVReadCacheState *s,
+                                    ReadCacheSlot *slot, int64_t cluster,
+                                    uint32_t crc, uint32_t length)
+{
+    slot->cluster = cluster;
+    slot->crc = crc;
+    slot->length = length;
+    slot->state = READ_CACHE_SLOT_VALID;
+    g_hash_table_insert(s->map, &slot->cluster, slot);
+}
+
+/*
+ * Read the header and table of the cache image into memory.  If the cache
+ * image has not been formatted for this base (or with this layout), the
+ * header is left alone and needs_format is set instead.
+ *
+ * Slots that are currently being read or filled are left untouched, which
+ * only matters for reloads in shared mode.
+ */
+static int read_cache_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader h, expected;
+    ReadCacheEntry *table;
+    uint64_t i;
+    int ret;
+
+    ret = bdrv_pread(s->cache_file, 0, &h, sizeof(h));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read cache header");
+        return ret;
+    }
+
+    read_cache_make_header(s, &expected);
+    if (memcmp(&h, &expected, sizeof(h))) {
+        for (i = 0; i < s->nb_slots; i++) {
+            if (s->slots[i].state == READ_CACHE_SLOT_VALID) {
+                read_cache_clear_slot(s, &s->slots[i]);
+            }
+        }
+        s->needs_format = true;
+        return 0;
+    }
+
+    table = g_try_new(ReadCacheEntry, s->nb_slots);
+    if (!table) {
+        error_setg(errp, "Could not allocate cache table");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache_file, read_cache_table_offset(0), table,
+                     s->nb_slots * sizeof(ReadCacheEntry));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read cache table");
+        goto out;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        ReadCacheSlot *slot = &s->slots[i];
+        uint64_t key = le64_to_cpu(table[i].key);
+        uint32_t length = le32_to_cpu(table[i].length);
+        int64_t cluster = key - 1;
+
+        if (slot->readers || slot->state == READ_CACHE_SLOT_FILLING) {
+            continue;
+        }
+        read_cache_clear_slot(s, slot);
+        slot->generation = le64_to_cpu(table[i].generation);
+
+        /* Duplicates and garbage are simply ignored */
+        if (!key || key > DIV_ROUND_UP(s->base_size, s->cluster_size) ||
+            length != read_cache_cluster_length(s, cluster) ||
+            g_hash_table_contains(s->map, &cluster))
+        {
+            continue;
+        }
+        read_cache_publish_slot(s, slot, cluster, le32_to_cpu(table[i].crc),
+                                length);
+    }
+
+    s->needs_format = false;
+    ret = 0;
+out:
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Stop using the cache after an I/O error on the cache image.  Entries on
+ * the cache image may not have been invalidated properly, so unless the
+ * cache image is shared, destroy the header so that nobody picks them up
+ * later.  Returns an error if that is not possible either.
+ */
+static int coroutine_fn read_cache_disable(BlockDriverState *bs, int error)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t i;
+    int ret = 0;
+
+    if (!s->enabled) {
+        return 0;
+    }
+
+    warn_report("read-cache: Disabling the cache of '%s' after an error: %s",
+                bdrv_get_device_or_node_name(bs), strerror(-error));
+    trace_read_cache_disable(bs, error);
+
+    s->enabled = false;
+    s->write_gen++;
+    for (i = 0; i < s->nb_slots; i++) {
+        read_cache_clear_slot(s, &s->slots[i]);
+    }
+
+    if (!s->shared && !s->needs_format) {
+        ret = bdrv_co_pwrite_zeroes(s->cache_file, 0, READ_CACHE_HEADER_SIZE,
+                                    0);
+        if (ret == 0) {
+            ret = bdrv_co_flush(s->cache_file->bs);
+        }
+    }
+    return ret;
+}
+
+/* Called with s->lock held */
+static int coroutine_fn read_cache_co_format(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader h;
+    int ret;
+
+    trace_read_cache_format(bs, s->nb_slots);
+
+    /*
+     * Whatever the old header says, the entries are only ever valid for
+     * that header, so clearing them before writing the new header is safe.
+     */
+    ret = bdrv_co_pwrite_zeroes(s->cache_file, read_cache_table_offset(0),
+                                s->data_offset - read_cache_table_offset(0),
+                                0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_flush(s->cache_file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    read_cache_make_header(s, &h);
+    ret = bdrv_pwrite(s->cache_file, 0, &h, sizeof(h));
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_flush(s->cache_file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->needs_format = false;
+    return 0;
+}
+
+/* Called with s->lock held */
+static int coroutine_fn read_cache_co_write_entry(BlockDriverState *bs,
+                                                  uint64_t index,
+                                                  ReadCacheSlot *slot)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheEntry entry = {
+        .generation = cpu_to_le64(s->slots[index].generation),
+    };
+
+    if (slot) {
+        entry.key = cpu_to_le64(slot->cluster + 1);
+        entry.crc = cpu_to_le32(slot->crc);
+        entry.length = cpu_to_le32(slot->length);
+    } else {
+        s->entries_dirty = true;
+    }
+
+    return bdrv_pwrite(s->cache_file, read_cache_table_offset(index), &entry,
+                       sizeof(entry));
+}
+
+/*
+ * Pick a slot to fill with the CLOCK algorithm: recently used slots get a
+ * second chance, slots that are being read or filled are skipped.  Returns
+ * the slot index, or -1 if there is no slot that can be evicted right now.
+ */
+static int64_t read_cache_pick_slot(BDRVReadCacheState *s)
+{
+    uint64_t i;
+
+    for (i = 0; i < 2 * s->nb_slots; i++) {
+        uint64_t index = s->clock_hand;
+        ReadCacheSlot *slot = &s->slots[index];
+
+        s->clock_hand = (s->clock_hand + 1) % s->nb_slots;
+
+        if (slot->state == READ_CACHE_SLOT_FILLING || slot->readers) {
+            continue;
+        }
+        if (slot->state == READ_CACHE_SLOT_VALID && slot->referenced) {
+            slot->referenced = false;
+            continue;
+        }
+        return index;
+    }
+
+    return -1;
+}
+
+/*
+ * Store one cluster that was read from the base before the write generation
+ * @gen.  Errors only disable the cache; the guest request is satisfied from
+ * @buf either way.
+ */
+static void coroutine_fn read_cache_co_fill(BlockDriverState *bs,
+                                            int64_t cluster, void *buf,
+                                            uint32_t length, uint64_t gen)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheSlot *slot;
+    int64_t index;
+    uint32_t crc;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (!s->enabled || gen != s->write_gen) {
+        goto out_unlock;
+    }
+
+    if (s->needs_format) {
+        ret = read_cache_co_format(bs);
+        if (ret < 0) {
+            goto fail_unlock;
+        }
+    }
+
+    index = read_cache_pick_slot(s);
+    if (index < 0) {
+        goto out_unlock;
+    }
+    slot = &s->slots[index];
+
+    /*
+     * The entry must not point to the slot anymore while its data changes,
+     * or a later invalidation of the old cluster could miss it, and shared
+     * readers could accept the new data for the old cluster.  Slots that
+     * failed their checksum may still have an entry, so always clear it.
+     */
+    read_cache_clear_slot(s, slot);
+    ret = read_cache_co_write_entry(bs, index, NULL);
+    if (ret < 0) {
+        goto fail_unlock;
+    }
+    slot->state = READ_CACHE_SLOT_FILLING;
+    qemu_co_mutex_unlock(&s->lock);
+
+    crc = crc32c(0xffffffff, buf, length);
+    ret = bdrv_pwrite(s->cache_file, read_cache_slot_offset(s, index), buf,
+                      length);
+
+    qemu_co_mutex_lock(&s->lock);
+    slot->state = READ_CACHE_SLOT_FREE;
+    if (ret < 0) {
+        goto fail_unlock;
+    }
+
+    /* Don't publish data that was overwritten meanwhile, or cached twice */
+    if (!s->enabled || gen != s->write_gen ||
+        g_hash_table_contains(s->map, &cluster))
+    {
+        goto out_unlock;
+    }
+
+    slot->generation++;
+    read_cache_publish_slot(s, slot, cluster, crc, length);
+    ret = read_cache_co_write_entry(bs, index, slot);
+    if (ret < 0) {
+        goto fail_unlock;
+    }
+    trace_read_cache_fill(bs, cluster, index);
+
+out_unlock:
+    qemu_co_mutex_unlock(&s->lock);
+    return;
+
+fail_unlock:
+    read_cache_disable(bs, ret);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static void coroutine_fn read_cache_co_fill_entry(void *opaque)
+{
+    ReadCacheFill *fill = opaque;
+    BlockDriverState *bs = fill->bs;
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t i;
+
+    for (i = 0; i < fill->nb_clusters; i++) {
+        int64_t cluster = fill->cluster + i;
+
+        read_cache_co_fill(bs, cluster, fill->buf + i * s->cluster_size,
+                           read_cache_cluster_length(s, cluster), fill->gen);
+    }
+
+    s->fill_bytes -= fill->bytes;
+    qemu_vfree(fill->buf);
+    g_free(fill);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Store @nb_clusters clusters read from the base before the write generation
+ * @gen in the background, so that the guest request does not wait for the
+ * cache image.  The data is dropped if too much is waiting already.
+ */
+static void read_cache_start_fill(BlockDriverState *bs, int64_t cluster,
+                                  int64_t nb_clusters, const uint8_t *data,
+                                  uint64_t bytes, uint64_t gen)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheFill *fill;
+    Coroutine *co;
+    uint8_t *buf;
+
+    if (s->fill_bytes + bytes > READ_CACHE_MAX_FILL_BYTES) {
+        trace_read_cache_fill_skip(bs, cluster, nb_clusters);
+        return;
+    }
+
+    buf = qemu_try_blockalign(s->cache_file->bs, bytes);
+    if (!buf) {
+        return;
+    }
+    memcpy(buf, data, bytes);
+
+    fill = g_new(ReadCacheFill, 1);
+    *fill = (ReadCacheFill) {
+        .bs             = bs,
+        .cluster        = cluster,
+        .nb_clusters    = nb_clusters,
+        .buf            = buf,
+        .bytes          = bytes,
+        .gen            = gen,
+    };
+    s->fill_bytes += bytes;
+
+    /* Drains wait for the fill */
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(read_cache_co_fill_entry, fill);
+    aio_co_schedule(bdrv_get_aio_context(bs), co);
+}
+
+/*
+ * Drop all cached clusters overlapping [@offset, @offset + @bytes) and make
+ * sure that the cache image does not refer to them anymore.
+ */
+static int coroutine_fn read_cache_co_invalidate(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t first = offset / s->cluster_size;
+    int64_t last = (offset + MAX(bytes, 1) - 1) / s->cluster_size;
+    bool flush = false;
+    uint64_t i;
+    int ret = 0;
+
+    if (!s->enabled) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    s->write_gen++;
+    s->base_written = true;
+
+    for (i = 0; i < s->nb_slots; i++) {
+        ReadCacheSlot *slot;
+        uint64_t index;
+
+        /* Look up the clusters or scan the slots, whatever is less work */
+        if (last - first < s->nb_slots) {
+            int64_t cluster = first + i;
+
+            if (cluster > last) {
+                break;
+            }
+            slot = g_hash_table_lookup(s->map, &cluster);
+            if (!slot) {
+                continue;
+            }
+        } else {
+            slot = &s->slots[i];
+            if (slot->state != READ_CACHE_SLOT_VALID ||
+                slot->cluster < first || slot->cluster > last) {
+                continue;
+            }
+        }
+
+        index = slot - s->slots;
+        read_cache_clear_slot(s, slot);
+        flush = true;
+        if (!s->shared) {
+            ret = read_cache_co_write_entry(bs, index, NULL);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+    }
+
+    if (!s->shared && (flush || s->entries_dirty)) {
+        ret = bdrv_co_flush(s->cache_file->bs);
+        if (ret < 0) {
+            goto fail;
+        }
+        s->entries_dirty = false;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    return 0;
+
+fail:
+    ret = read_cache_disable(bs, ret);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+/*
+ * Returns true if the data of @slot was read into @buf, false if it has to
+ * be fetched from the base.
+ */
+static bool coroutine_fn read_cache_co_read_slot(BlockDriverState *bs,
+                                                 ReadCacheSlot *slot,
+                                                 void *buf)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t index = slot - s->slots;
+    int64_t cluster = slot->cluster;
+    uint32_t crc = slot->crc;
+    uint32_t length = slot->length;
+    uint64_t generation = slot->generation;
+    ReadCacheEntry entry;
+    bool unchanged = true;
+    int ret;
+
+    slot->readers++;
+    slot->referenced = true;
+    ret = bdrv_pread(s->cache_file, read_cache_slot_offset(s, index), buf,
+                     length);
+    if (ret >= 0 && s->shared) {
+        /* Did the populating process start to reuse the slot meanwhile? */
+        ret = bdrv_pread(s->cache_file, read_cache_table_offset(index),
+                         &entry, sizeof(entry));
+        unchanged = le64_to_cpu(entry.key) == cluster + 1 &&
+                    le32_to_cpu(entry.crc) == crc &&
+                    le64_to_cpu(entry.generation) == generation;
+    }
+    slot->readers--;
+
+    if (ret < 0) {
+        qemu_co_mutex_lock(&s->lock);
+        read_cache_disable(bs, ret);
+        qemu_co_mutex_unlock(&s->lock);
+        return false;
+    }
+
+    if (!unchanged || crc32c(0xffffffff, buf, length) != crc) {
+        trace_read_cache_checksum_mismatch(bs, cluster, index);
+        if (slot->state == READ_CACHE_SLOT_VALID && slot->cluster == cluster &&
+            slot->crc == crc)
+        {
+            read_cache_clear_slot(s, slot);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+/* Pick up what other processes added to a shared cache meanwhile */
+static void coroutine_fn read_cache_co_maybe_reload(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    Error *local_err = NULL;
+    int ret;
+
+    if (!s->shared || now - s->last_reload < READ_CACHE_RELOAD_INTERVAL_NS) {
+        return;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    s->last_reload = now;
+    ret = read_cache_load(bs, &local_err);
+    if (ret < 0) {
+        error_free(local_err);
+        read_cache_disable(bs, ret);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static int coroutine_fn
+read_cache_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                     QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t start, end;
+    int64_t cluster, first, last;
+    uint8_t *buf;
+    int ret = 0;
+
+    if (s->enabled && s->shared && s->needs_format) {
+        read_cache_co_maybe_reload(bs);
+    }
+    if (!s->enabled || (s->shared && s->needs_format) ||
+        offset + bytes > s->base_size)
+    {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+
+    start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    end = MIN(ROUND_UP(offset + bytes, s->cluster_size), s->base_size);
+    first = start / s->cluster_size;
+    last = (end - 1) / s->cluster_size;
+
+    buf = qemu_try_blockalign(bs->file->bs, end - start);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    cluster = first;
+    while (cluster <= last) {
+        uint8_t *cluster_buf = buf + (cluster - first) * s->cluster_size;
+        ReadCacheSlot *slot;
+        QEMUIOVector miss_qiov;
+        struct iovec iov;
+        int64_t miss_end;
+        uint64_t gen;
+
+        slot = s->enabled ? g_hash_table_lookup(s->map, &cluster) : NULL;
+        if (slot && read_cache_co_read_slot(bs, slot, cluster_buf)) {
+            trace_read_cache_hit(bs, cluster);
+            cluster++;
+            continue;
+        }
+
+        if (s->shared) {
+            read_cache_co_maybe_reload(bs);
+        }
+
+        /* Fetch all consecutive misses from the base with one request */
+        miss_end = cluster + 1;
+        while (miss_end <= last && s->enabled &&
+               !g_hash_table_contains(s->map, &miss_end)) {
+            miss_end++;
+        }
+        iov = (struct iovec) {
+            .iov_base   = cluster_buf,
+            .iov_len    = MIN(miss_end * s->cluster_size, end) -
+                          cluster * s->cluster_size,
+        };
+        qemu_iovec_init_external(&miss_qiov, &iov, 1);
+        trace_read_cache_miss(bs, cluster, miss_end - cluster);
+
+        gen = s->write_gen;
+        ret = bdrv_co_preadv(bs->file, cluster * s->cluster_size, iov.iov_len,
+                             &miss_qiov, flags);
+        if (ret < 0) {
+            goto out;
+        }
+
+        if (!s->shared && s->enabled) {
+            read_cache_start_fill(bs, cluster, miss_end - cluster, cluster_buf,
+                                  iov.iov_len, gen);
+        }
+        cluster = miss_end;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, buf + (offset - start), bytes);
+    ret = 0;
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn
+read_cache_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                      QEMUIOVector *qiov, int flags)
+{
+    int ret;
+
+    ret = read_cache_co_invalidate(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+
+    /* Drop what concurrent reads may have cached while the write ran */
+    read_cache_co_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn
+read_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
+                            BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = read_cache_co_invalidate(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_co_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn
+read_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = read_cache_co_invalidate(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_co_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    const char *base_tag;
+    uint64_t cluster_size;
+    int64_t length;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    s->shared = qemu_opt_get_bool(opts, "shared", false);
+    if (s->shared && (flags & BDRV_O_RDWR)) {
+        ret = -EINVAL;
+        error_setg(errp, "A shared read cache can only be used read-only");
+        goto fail;
+    }
+
+    cluster_size = qemu_opt_get_size(opts, "cluster-size",
+                                     READ_CACHE_DEFAULT_CLUSTER_SIZE);
+    if (!is_power_of_2(cluster_size) ||
+        cluster_size < READ_CACHE_MIN_CLUSTER_SIZE ||
+        cluster_size > READ_CACHE_MAX_CLUSTER_SIZE)
+    {
+        ret = -EINVAL;
+        error_setg(errp, "Cluster size must be a power of two between %d "
+                   "and %dk", READ_CACHE_MIN_CLUSTER_SIZE,
+                   READ_CACHE_MAX_CLUSTER_SIZE / 1024);
+        goto fail;
+    }
+    s->cluster_size = cluster_size;
+
+    /* Open the base */
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file, false,
+                               &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    /*
+     * The cache is written even if the guest only reads, unless it is
+     * shared with other processes.
+     */
+    if (!qdict_haskey(options, "cache-file") ||
+        qobject_type(qdict_get(options, "cache-file")) != QTYPE_QSTRING) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY,
+                              s->shared ? "on" : "off");
+    }
+
+    /* Open the cache image */
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_file, false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+
+    base_tag = qemu_opt_get(opts, "base-tag");
+    if (!base_tag) {
+        base_tag = bs->file->bs->filename;
+    }
+    if (strlen(base_tag) >= READ_CACHE_TAG_SIZE) {
+        ret = -EINVAL;
+        error_setg(errp, "The base tag must be shorter than %d characters, "
+                   "please specify a shorter base-tag", READ_CACHE_TAG_SIZE);
+        goto fail;
+    }
+    s->base_tag = g_strdup(base_tag);
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        ret = length;
+        error_setg_errno(errp, -ret, "Could not get the size of the image");
+        goto fail;
+    }
+    s->base_size = length;
+    read_cache_get_base_identity(s, bs->file->bs);
+
+    length = bdrv_getlength(s->cache_file->bs);
+    if (length < 0) {
+        ret = length;
+        error_setg_errno(errp, -ret, "Could not get the size of the cache");
+        goto fail;
+    }
+    ret = read_cache_compute_layout(s, length, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->slots = g_try_new0(ReadCacheSlot, s->nb_slots);
+    if (!s->slots) {
+        ret = -ENOMEM;
+        error_setg(errp, "Could not allocate cache slots");
+        goto fail;
+    }
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    qemu_co_mutex_init(&s->lock);
+
+    ret = read_cache_load(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->enabled = true;
+    s->last_reload = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (s->needs_format && s->shared) {
+        /* Keep trying in case the owner of the cache formats it later */
+        warn_report("read-cache: '%s' has not been formatted for '%s' yet",
+                    s->cache_file->bs->filename, s->base_tag);
+    }
+
+    ret = 0;
+fail:
+    if (ret < 0) {
+        if (s->map) {
+            g_hash_table_destroy(s->map);
+            s->map = NULL;
+        }
+        g_free(s->slots);
+        s->slots = NULL;
+        g_free(s->base_tag);
+        s->base_tag = NULL;
+        bdrv_unref_child(bs, s->cache_file);
+        s->cache_file = NULL;
+        bdrv_unref_child(bs, bs->file);
+        bs->file = NULL;
+    }
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /* Only for persistence; crash consistency never depends on this flush */
+    if (s->enabled && !s->shared && !s->needs_format) {
+        /*
+         * Our own writes to the base changed its modification time, but
+         * the entries for them were invalidated, so keep the cache.
+         */
+        if (s->base_written) {
+            ReadCacheHeader h;
+
+            read_cache_get_base_identity(s, bs->file->bs);
+            read_cache_make_header(s, &h);
+            bdrv_pwrite(s->cache_file, 0, &h, sizeof(h));
+        }
+        bdrv_flush(s->cache_file->bs);
+    }
+
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+    g_free(s->base_tag);
+    bdrv_unref_child(bs, s->cache_file);
+    s->cache_file = NULL;
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    BDRVReadCacheState *s = reopen_state->bs->opaque;
+
+    if (s->shared && (reopen_state->flags & BDRV_O_RDWR)) {
+        error_setg(errp, "A shared read cache can only be used read-only");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static bool read_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                   BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void read_cache_refresh_filename(BlockDriverState *bs, QDict *options)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /* bs->file->bs has already been refreshed */
+    bdrv_refresh_filename(s->cache_file->bs);
+
+    if (bs->file->bs->full_open_options
+        && s->cache_file->bs->full_open_options)
+    {
+        QDict *opts = qdict_new();
+        qdict_put_str(opts, "driver", "read-cache");
+
+        qobject_ref(bs->file->bs->full_open_options);
+        qdict_put_obj(opts, "file", QOBJECT(bs->file->bs->full_open_options));
+        qobject_ref(s->cache_file->bs->full_open_options);
+        qdict_put_obj(opts, "cache-file",
+                      QOBJECT(s->cache_file->bs->full_open_options));
+        qdict_put_int(opts, "cluster-size", s->cluster_size);
+        qdict_put_str(opts, "base-tag", s->base_tag);
+        qdict_put_bool(opts, "shared", s->shared);
+
+        bs->full_open_options = opts;
+    }
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *ro_q,
+                                  uint64_t perm, uint64_t shrd,
+                                  uint64_t *nperm, uint64_t *nshrd)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (!c) {
+        *nperm = perm & DEFAULT_PERM_PASSTHROUGH;
+        *nshrd = (shrd & DEFAULT_PERM_PASSTHROUGH) | DEFAULT_PERM_UNCHANGED;
+        return;
+    }
+
+    if (!strcmp(c->name, "cache-file")) {
+        /*
+         * The cache image has a single writer, which may share it with any
+         * number of readers.  The checksums protect readers from the
+         * writer's updates.
+         */
+        *nperm = 0;
+        if (!(bs->open_flags & BDRV_O_NO_IO)) {
+            *nperm |= BLK_PERM_CONSISTENT_READ;
+        }
+        if (s->shared) {
+            *nshrd = BLK_PERM_ALL;
+        } else {
+            *nperm |= BLK_PERM_WRITE;
+            *nshrd = BLK_PERM_ALL & ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+        }
+    } else {
+        bdrv_filter_default_perms(bs, c, role, ro_q, perm, shrd, nperm, nshrd);
+
+        /* Nobody but us must change the data behind the cache's back */
+        *nshrd &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+    }
+}
+
+static void read_cache_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    /* Requests are bounced through a buffer of this size */
+    bs->bl.max_transfer = MIN_NON_ZERO(bs->bl.max_transfer,
+                                       READ_CACHE_MAX_TRANSFER);
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name            = "read-cache",
+    .instance_size          = sizeof(BDRVReadCacheState),
+
+    .bdrv_open              = read_cache_open,
+    .bdrv_close             = read_cache_close,
+    .bdrv_reopen_prepare    = read_cache_reopen_prepare,
+    .bdrv_getlength         = read_cache_getlength,
+    .bdrv_refresh_filename  = read_cache_refresh_filename,
+    .bdrv_child_perm        = read_cache_child_perm,
+    .bdrv_refresh_limits    = read_cache_refresh_limits,
+
+    .bdrv_co_preadv         = read_cache_co_preadv,
+    .bdrv_co_pwritev        = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = read_cache_co_pdiscard,
+    .bdrv_co_block_status   = bdrv_co_block_status_from_file,
+
+    .is_filter              = true,
+    .bdrv_recurse_is_first_non_filter = read_cache_recurse_is_first_non_filter,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -353,6 +353,7 @@ static void secondary_do_checkpoint(BDRVReplicationState *s, Error **errp)
     }
 
     ret = s->active_disk->bs->drv->bdrv_make_empty(s->active_disk->bs);
+    bdrv_bsc_invalidate(s->active_disk->bs);
     if (ret < 0) {
         error_setg(errp, "Cannot make active disk empty");
         return;
@@ -365,6 +366,7 @@ static void secondary_do_checkpoint(BDRVReplicationState *s, Error **errp)
     }
 
     ret = s->hidden_disk->bs->drv->bdrv_make_empty(s->hidden_disk->bs);
+    bdrv_bsc_invalidate(s->hidden_disk->bs);
     if (ret < 0) {
         error_setg(errp, "Cannot make hidden disk empty");
         return;
@@ -568,7 +570,7 @@ static void replication_start(ReplicationState *rs, ReplicationMode mode,
         bdrv_op_unblock(top_bs, BLOCK_OP_TYPE_DATAPLANE, s->blocker);
 
         job = backup_job_create(NULL, s->secondary_disk->bs, s->hidden_disk->bs,
-                                0, MIRROR_SYNC_MODE_NONE, NULL, false,
+                                0, MIRROR_SYNC_MODE_NONE, NULL, false, 0, 0,
                                 BLOCKDEV_ON_ERROR_REPORT,
                                 BLOCKDEV_ON_ERROR_REPORT, JOB_INTERNAL,
                                 backup_job_completed, bs, NULL, &local_err);
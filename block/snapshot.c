@@ -198,6 +198,7 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
 
     if (drv->bdrv_snapshot_goto) {
         ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        bdrv_bsc_invalidate(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Failed to load snapshot");
         }
@@ -377,7 +378,9 @@ int bdrv_snapshot_load_tmp(BlockDriverState *bs,
         return -EINVAL;
     }
     if (drv->bdrv_snapshot_load_tmp) {
-        return drv->bdrv_snapshot_load_tmp(bs, snapshot_id, name, errp);
+        int ret = drv->bdrv_snapshot_load_tmp(bs, snapshot_id, name, errp);
+        bdrv_bsc_invalidate(bs);
+        return ret;
     }
     error_setg(errp, "Block format '%s' used by device '%s' "
                "does not support temporarily loading internal snapshots",
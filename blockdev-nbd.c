@@ -175,7 +175,14 @@ void qmp_nbd_server_add(const char *device, bool has_name, const char *name,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
+    /*
+     * All clients of an export share its BlockBackend, so a flush from any
+     * of them covers the writes of all, and there is no limit on the number
+     * of clients.
+     */
+    exp = nbd_export_new(bs, 0, -1,
+                         NBD_FLAG_CAN_MULTI_CONN |
+                         (writable ? 0 : NBD_FLAG_READ_ONLY),
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
@@ -40,6 +40,9 @@
 #ifdef CONFIG_SNAPPY
 #include <snappy-c.h>
 #endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #ifndef ELF_MACHINE_UNAME
 #define ELF_MACHINE_UNAME "Unknown"
 #endif
@@ -844,6 +847,11 @@ static void create_header32(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -956,6 +964,11 @@ static void create_header64(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -1286,6 +1299,11 @@ static size_t get_len_buf_out(size_t page_size, uint32_t flag_compress)
     case DUMP_DH_COMPRESSED_SNAPPY:
         return snappy_max_compressed_length(page_size);
 #endif
+
+#ifdef CONFIG_ZSTD
+    case DUMP_DH_COMPRESSED_ZSTD:
+        return ZSTD_compressBound(page_size);
+#endif
     }
     return 0;
 }
@@ -1298,20 +1316,323 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/*
+ * Pages are compressed by a pool of worker threads.  The dump thread
+ * hands out batches of pages to the workers round-robin, and writes the
+ * results back in the same order, so the page descriptors and the page
+ * data end up exactly where a single-threaded dump would put them.
+ *
+ * There are two batches per worker, so that a worker can start on its
+ * next batch while the dump thread is writing out the previous one.
+ */
+#define DUMP_COMPRESS_BATCH_PAGES   256
+#define DUMP_COMPRESS_MAX_THREADS   16
+
+typedef struct DumpCompressJob {
+    /* Set up by the dump thread; no pages tells the worker to exit */
+    uint8_t *pages[DUMP_COMPRESS_BATCH_PAGES];
+    int npages;
+    bool busy;                  /* submitted but not written out yet */
+
+    /* Filled in by the worker, one len_buf_out slot per page in buf_out */
+    uint8_t *buf_out;
+    uint32_t flags[DUMP_COMPRESS_BATCH_PAGES];
+    size_t size[DUMP_COMPRESS_BATCH_PAGES];   /* 0 for a zero page */
+
+    QemuSemaphore todo;
+    QemuSemaphore done;
+} DumpCompressJob;
+
+typedef struct DumpCompressPool DumpCompressPool;
+
+typedef struct DumpCompressThread {
+    DumpCompressPool *pool;
+    QemuThread thread;
+    int id;
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+#endif
+} DumpCompressThread;
+
+struct DumpCompressPool {
+    size_t page_size;
+    size_t len_buf_out;
+    uint32_t flag_compress;
+
+    int num_threads;
+    DumpCompressThread *threads;
+    int num_jobs;
+    DumpCompressJob *jobs;
+    int next_job;               /* next job to be submitted */
+};
+
+static int dump_compress_threads(void)
+{
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (host_procs <= 0) {
+        return 1;
+    }
+    return MIN(host_procs, DUMP_COMPRESS_MAX_THREADS);
+}
+
+/*
+ * Compress one page into @buf_out and return the flag to store in its page
+ * descriptor, or 0 if the page has to be saved in plaintext.
+ *
+ * Only one compression format is used, for pool->flag_compress is set.
+ * But when compression fails to work, or does not make the page smaller,
+ * we fall back to save in plaintext.
+ */
+static uint32_t dump_compress_page(DumpCompressThread *t, const uint8_t *buf,
+                                   uint8_t *buf_out, size_t *size_out)
+{
+    DumpCompressPool *pool = t->pool;
+    size_t page_size = pool->page_size;
+    size_t size = pool->len_buf_out;
+
+    switch (pool->flag_compress) {
+    case DUMP_DH_COMPRESSED_ZLIB:
+        if (compress2(buf_out, (uLongf *)&size, buf, page_size,
+                      Z_BEST_SPEED) != Z_OK) {
+            return 0;
+        }
+        break;
+#ifdef CONFIG_LZO
+    case DUMP_DH_COMPRESSED_LZO:
+        if (lzo1x_1_compress(buf, page_size, buf_out, (lzo_uint *)&size,
+                             t->wrkmem) != LZO_E_OK) {
+            return 0;
+        }
+        break;
+#endif
+#ifdef CONFIG_SNAPPY
+    case DUMP_DH_COMPRESSED_SNAPPY:
+        if (snappy_compress((char *)buf, page_size, (char *)buf_out,
+                            &size) != SNAPPY_OK) {
+            return 0;
+        }
+        break;
+#endif
+#ifdef CONFIG_ZSTD
+    case DUMP_DH_COMPRESSED_ZSTD:
+        size = ZSTD_compressCCtx(t->zstd_cctx, buf_out, size, buf, page_size,
+                                 1);
+        if (ZSTD_isError(size)) {
+            return 0;
+        }
+        break;
+#endif
+    default:
+        return 0;
+    }
+
+    if (size >= page_size) {
+        return 0;
+    }
+    *size_out = size;
+    return pool->flag_compress;
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressThread *t = opaque;
+    DumpCompressPool *pool = t->pool;
+    int i, j;
+
+    for (j = t->id; ; j = (j + pool->num_threads) % pool->num_jobs) {
+        DumpCompressJob *job = &pool->jobs[j];
+
+        qemu_sem_wait(&job->todo);
+        if (!job->npages) {
+            break;
+        }
+
+        for (i = 0; i < job->npages; i++) {
+            uint8_t *buf_out = job->buf_out + i * pool->len_buf_out;
+
+            if (is_zero_page(job->pages[i], pool->page_size)) {
+                job->flags[i] = 0;
+                job->size[i] = 0;
+                continue;
+            }
+            job->flags[i] = dump_compress_page(t, job->pages[i], buf_out,
+                                               &job->size[i]);
+            if (!job->flags[i]) {
+                job->size[i] = pool->page_size;
+            }
+        }
+        qemu_sem_post(&job->done);
+    }
+
+    return NULL;
+}
+
+static void dump_compress_pool_init(DumpCompressPool *pool, DumpState *s)
+{
+    int i;
+
+    pool->page_size = s->dump_info.page_size;
+    pool->len_buf_out = get_len_buf_out(pool->page_size, s->flag_compress);
+    assert(pool->len_buf_out != 0);
+    pool->flag_compress = s->flag_compress;
+    pool->num_threads = dump_compress_threads();
+    pool->num_jobs = pool->num_threads * 2;
+    pool->next_job = 0;
+
+    pool->jobs = g_new0(DumpCompressJob, pool->num_jobs);
+    for (i = 0; i < pool->num_jobs; i++) {
+        DumpCompressJob *job = &pool->jobs[i];
+
+        job->buf_out = g_malloc(DUMP_COMPRESS_BATCH_PAGES * pool->len_buf_out);
+        qemu_sem_init(&job->todo, 0);
+        qemu_sem_init(&job->done, 0);
+    }
+
+    pool->threads = g_new0(DumpCompressThread, pool->num_threads);
+    for (i = 0; i < pool->num_threads; i++) {
+        DumpCompressThread *t = &pool->threads[i];
+
+        t->pool = pool;
+        t->id = i;
+#ifdef CONFIG_LZO
+        t->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+#ifdef CONFIG_ZSTD
+        t->zstd_cctx = ZSTD_createCCtx();
+#endif
+        qemu_thread_create(&t->thread, "dump/compress", dump_compress_thread,
+                           t, QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Wait for the outstanding jobs, then stop the workers */
+static void dump_compress_pool_cleanup(DumpCompressPool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->num_jobs; i++) {
+        DumpCompressJob *job = &pool->jobs[(pool->next_job + i) %
+                                           pool->num_jobs];
+
+        if (job->busy) {
+            qemu_sem_wait(&job->done);
+            job->busy = false;
+        }
+    }
+
+    /* These are the jobs each of the workers is waiting for */
+    for (i = 0; i < pool->num_threads; i++) {
+        DumpCompressJob *job = &pool->jobs[(pool->next_job + i) %
+                                           pool->num_jobs];
+
+        job->npages = 0;
+        qemu_sem_post(&job->todo);
+    }
+
+    for (i = 0; i < pool->num_threads; i++) {
+        DumpCompressThread *t = &pool->threads[i];
+
+        qemu_thread_join(&t->thread);
+#ifdef CONFIG_LZO
+        g_free(t->wrkmem);
+#endif
+#ifdef CONFIG_ZSTD
+        ZSTD_freeCCtx(t->zstd_cctx);
+#endif
+    }
+
+    for (i = 0; i < pool->num_jobs; i++) {
+        DumpCompressJob *job = &pool->jobs[i];
+
+        g_free(job->buf_out);
+        qemu_sem_destroy(&job->todo);
+        qemu_sem_destroy(&job->done);
+    }
+    g_free(pool->threads);
+    g_free(pool->jobs);
+}
+
+static void dump_compress_submit(DumpCompressPool *pool, DumpCompressJob *job)
+{
+    job->busy = true;
+    qemu_sem_post(&job->todo);
+    pool->next_job = (pool->next_job + 1) % pool->num_jobs;
+}
+
+/*
+ * Write the page descriptors and the page data of a batch compressed by
+ * the workers.  Zero pages all share the page data at pd_zero.
+ */
+static int write_compressed_pages(DumpState *s, DumpCompressPool *pool,
+                                  DumpCompressJob *job, DataCache *page_desc,
+                                  DataCache *page_data,
+                                  const PageDescriptor *pd_zero,
+                                  off_t *offset_data, Error **errp)
+{
+    PageDescriptor pd;
+    int i, ret;
+
+    qemu_sem_wait(&job->done);
+    job->busy = false;
+
+    for (i = 0; i < job->npages; i++) {
+        if (!job->size[i]) {
+            ret = write_cache(page_desc, pd_zero, sizeof(PageDescriptor),
+                              false);
+            if (ret < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return ret;
+            }
+            s->written_size += s->dump_info.page_size;
+            continue;
+        }
+
+        if (job->flags[i]) {
+            ret = write_cache(page_data, job->buf_out + i * pool->len_buf_out,
+                              job->size[i], false);
+        } else {
+            ret = write_cache(page_data, job->pages[i], job->size[i], false);
+        }
+        if (ret < 0) {
+            error_setg(errp, "dump: failed to write page data");
+            return ret;
+        }
+
+        /* get and write page desc here */
+        pd.flags = cpu_to_dump32(s, job->flags[i]);
+        pd.size = cpu_to_dump32(s, job->size[i]);
+        pd.page_flags = cpu_to_dump64(s, 0);
+        pd.offset = cpu_to_dump64(s, *offset_data);
+        *offset_data += job->size[i];
+
+        ret = write_cache(page_desc, &pd, sizeof(PageDescriptor), false);
+        if (ret < 0) {
+            error_setg(errp, "dump: failed to write page desc");
+            return ret;
+        }
+        s->written_size += s->dump_info.page_size;
+    }
+
+    job->npages = 0;
+    return 0;
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpCompressPool pool;
+    DumpCompressJob *job;
     off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+    PageDescriptor pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    int i;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1320,15 +1641,7 @@ static void write_dump_pages(DumpState *s, Error **errp)
     prepare_data_cache(&page_desc, s, offset_desc);
     prepare_data_cache(&page_data, s, offset_data);
 
-    /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
-    assert(len_buf_out != 0);
-
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    dump_compress_pool_init(&pool, s);
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1352,97 +1665,39 @@ static void write_dump_pages(DumpState *s, Error **errp)
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
+    job = &pool.jobs[pool.next_job];
     while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
+        job->pages[job->npages++] = buf;
+        if (job->npages < DUMP_COMPRESS_BATCH_PAGES) {
+            continue;
+        }
+
+        dump_compress_submit(&pool, job);
+        job = &pool.jobs[pool.next_job];
+        if (job->busy) {
+            ret = write_compressed_pages(s, &pool, job, &page_desc,
+                                         &page_data, &pd_zero, &offset_data,
+                                         errp);
             if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
                 goto out;
             }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-            }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+        }
+    }
+    if (job->npages) {
+        dump_compress_submit(&pool, job);
+    }
 
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
+    /* write out the remaining batches, oldest first */
+    for (i = 0; i < pool.num_jobs; i++) {
+        job = &pool.jobs[(pool.next_job + i) % pool.num_jobs];
+        if (job->busy) {
+            ret = write_compressed_pages(s, &pool, job, &page_desc,
+                                         &page_data, &pd_zero, &offset_data,
+                                         errp);
             if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
                 goto out;
             }
         }
-        s->written_size += s->dump_info.page_size;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1457,14 +1712,9 @@ static void write_dump_pages(DumpState *s, Error **errp)
     }
 
 out:
+    dump_compress_pool_cleanup(&pool);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1805,6 +2055,10 @@ static void dump_init(DumpState *s, int fd, bool has_format,
             s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
             break;
 
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD:
+            s->flag_compress = DUMP_DH_COMPRESSED_ZSTD;
+            break;
+
         default:
             s->flag_compress = 0;
         }
@@ -1963,7 +2217,7 @@ void qmp_dump_guest_memory(bool paging, const char *file,
         detach_p = detach;
     }
 
-    /* check whether lzo/snappy is supported */
+    /* check whether lzo/snappy/zstd is supported */
 #ifndef CONFIG_LZO
     if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO) {
         error_setg(errp, "kdump-lzo is not available now");
@@ -1978,6 +2232,13 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     }
 #endif
 
+#ifndef CONFIG_ZSTD
+    if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD) {
+        error_setg(errp, "kdump-zstd is not available now");
+        return;
+    }
+#endif
+
 #ifndef TARGET_X86_64
     if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_WIN_DMP) {
         error_setg(errp, "Windows dump is only available for x86-64");
@@ -2059,6 +2320,13 @@ DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
     item->value = DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY;
 #endif
 
+    /* add new item if kdump-zstd is available */
+#ifdef CONFIG_ZSTD
+    item->next = g_malloc0(sizeof(DumpGuestMemoryFormatList));
+    item = item->next;
+    item->value = DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD;
+#endif
+
     /* Windows dump is available only if target is x86_64 */
 #ifdef TARGET_X86_64
     item->next = g_malloc0(sizeof(DumpGuestMemoryFormatList));
@@ -1377,6 +1377,55 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
     return dirty;
 }
 
+/* Note: start and end must be within the same ram block.  */
+uint64_t cpu_physical_memory_count_and_clear_dirty(ram_addr_t start,
+                                                   ram_addr_t length,
+                                                   unsigned client)
+{
+    DirtyMemoryBlocks *blocks;
+    unsigned long end, page;
+    uint64_t num_dirty = 0;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    page = start >> TARGET_PAGE_BITS;
+
+    rcu_read_lock();
+
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+
+    while (page < end) {
+        unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long *word = &blocks->blocks[idx][BIT_WORD(offset)];
+
+        /* Whole words can be swapped out at once; DIRTY_MEMORY_BLOCK_SIZE
+         * is a multiple of BITS_PER_LONG so a word never straddles blocks.
+         */
+        if (!(offset % BITS_PER_LONG) && end - page >= BITS_PER_LONG) {
+            if (atomic_read(word)) {
+                num_dirty += ctpopl(atomic_xchg(word, 0));
+            }
+            page += BITS_PER_LONG;
+        } else {
+            num_dirty += bitmap_test_and_clear_atomic(blocks->blocks[idx],
+                                                      offset, 1);
+            page++;
+        }
+    }
+
+    rcu_read_unlock();
+
+    if (num_dirty && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, length);
+    }
+
+    return num_dirty;
+}
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
      (ram_addr_t start, ram_addr_t length, unsigned client)
 {
@@ -3194,6 +3243,7 @@ static bool prepare_mmio_access(MemoryRegion *mr)
 
     if (unlocked && mr->global_locking) {
         qemu_mutex_lock_iothread();
+        mr->bql_dispatch_count++;
         unlocked = false;
         release_lock = true;
     }
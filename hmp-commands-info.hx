@@ -265,6 +265,21 @@ STEXI
 @item info mtree
 @findex info mtree
 Show memory tree.
+ETEXI
+
+    {
+        .name       = "mtree-bql",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show memory regions whose accesses took the global lock",
+        .cmd        = hmp_info_mtree_bql,
+    },
+
+STEXI
+@item info mtree-bql
+@findex info mtree-bql
+Show how many MMIO and PIO accesses to each memory region had to take
+the QEMU global mutex, busiest regions first.
 ETEXI
 
 #if defined(CONFIG_TCG)
@@ -518,6 +518,7 @@ static void acpi_pm_tmr_timer(void *opaque)
     ar->tmr.update_sci(ar);
 }
 
+/* Called without the BQL; only reads QEMU_CLOCK_VIRTUAL */
 static uint64_t acpi_pm_tmr_read(void *opaque, hwaddr addr, unsigned width)
 {
     return acpi_pm_tmr_get(opaque);
@@ -544,6 +545,8 @@ void acpi_pm_tmr_init(ACPIREGS *ar, acpi_update_sci_fn update_sci,
     ar->tmr.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, acpi_pm_tmr_timer, ar);
     memory_region_init_io(&ar->tmr.io, memory_region_owner(parent),
                           &acpi_pm_tmr_ops, ar, "acpi-tmr", 4);
+    /* Guests poll the timer a lot, e.g. for clocksource calibration */
+    memory_region_clear_global_locking(&ar->tmr.io);
     memory_region_add_subregion(parent, 8, &ar->tmr.io);
 }
 
@@ -19,14 +19,21 @@
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>, \
  *              cmb_size_mb=<cmb_size_mb[optional]>, \
- *              num_queues=<N[optional]>
+ *              num_queues=<N[optional]>, \
+ *              ioeventfd=<on|off[optional]>
  *
  * Note cmb_size_mb denotes size of CMB in MB. CMB is assumed to be at
  * offset 0 in BAR2 and supports only WDS, RDS and SQS for now.
+ *
+ * ioeventfd (default on) lets doorbell writes to I/O submission queues
+ * signal an eventfd instead of exiting to QEMU, once the guest has set up
+ * shadow doorbells with the Doorbell Buffer Config command.
  */
 
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
 #include "hw/block/block.h"
 #include "hw/hw.h"
 #include "hw/pci/msix.h"
@@ -94,6 +101,69 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+/*
+ * With the Doorbell Buffer Config command, the guest writes new tails and
+ * heads to a shadow doorbell buffer in memory, and only rings the MMIO
+ * doorbell when the value crosses the EventIdx that we publish.
+ */
+static void nvme_update_sq_tail(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    pci_dma_read(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (unlikely(v >= sq->size)) {
+        NVME_GUEST_ERR(nvme_ub_db_shadow_invalid_sqtail,
+                       "shadow submission queue doorbell value"
+                       " beyond queue size, sqid=%"PRIu16","
+                       " new_tail=%"PRIu32", ignoring",
+                       sq->sqid, v);
+        return;
+    }
+    sq->tail = v;
+}
+
+static void nvme_update_sq_eventidx(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&n->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq);
+
+/*
+ * The guest does not ring the MMIO doorbell for every head update, so
+ * this is also where a pin interrupt is deasserted once the queue is
+ * empty.
+ */
+static void nvme_update_cq_head(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    pci_dma_read(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (unlikely(v >= cq->size)) {
+        NVME_GUEST_ERR(nvme_ub_db_shadow_invalid_cqhead,
+                       "shadow completion queue doorbell value"
+                       " beyond queue size, cqid=%"PRIu16","
+                       " new_head=%"PRIu32", ignoring",
+                       cq->cqid, v);
+        return;
+    }
+    cq->head = v;
+    if (cq->head == cq->tail) {
+        nvme_irq_deassert(n, cq);
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&n->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
 static void nvme_irq_check(NvmeCtrl *n)
 {
     if (msix_enabled(&(n->parent_obj))) {
@@ -123,6 +193,45 @@ static void nvme_irq_assert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static bool nvme_cq_coalesced(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    /* Interrupt coalescing never applies to the admin queue */
+    return cq->cqid && NVME_INTC_TIME(n->int_coalescing) &&
+           !test_bit(cq->vector, n->int_coalescing_disabled);
+}
+
+static void nvme_coalesce_timer_cb(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    cq->coalesced = 0;
+    nvme_irq_assert(cq->ctrl, cq);
+}
+
+/*
+ * Signal @posted new completion queue entries, unless they can wait for
+ * the aggregation threshold or time of the Interrupt Coalescing feature.
+ * The threshold is counted per completion queue rather than per vector.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    if (!nvme_cq_coalesced(n, cq)) {
+        nvme_irq_assert(n, cq);
+        return;
+    }
+
+    cq->coalesced += posted;
+    if (cq->coalesced > NVME_INTC_THR(n->int_coalescing)) {
+        timer_del(cq->coalesce_timer);
+        cq->coalesced = 0;
+        nvme_irq_assert(n, cq);
+    } else if (cq->coalesced && !timer_pending(cq->coalesce_timer)) {
+        /* Aggregation time is in 100 microsecond units */
+        timer_mod(cq->coalesce_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  NVME_INTC_TIME(n->int_coalescing) * 100 * SCALE_US);
+    }
+}
+
 static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
@@ -219,6 +328,174 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, QEMUIOVector *iov, uint64_t prp1,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+static bool nvme_addr_is_cmb(NvmeCtrl *n, uint64_t addr, uint32_t len)
+{
+    uint64_t lo = n->ctrl_mem.addr;
+    uint64_t hi = lo + int128_get64(n->ctrl_mem.size);
+
+    return n->cmbsz && addr >= lo && addr < hi && len <= hi - addr;
+}
+
+/* Data has to be either in the CMB or in guest memory, not in both */
+static uint16_t nvme_map_sgl_data(NvmeCtrl *n, QEMUSGList *qsg,
+                                  QEMUIOVector *iov, NvmeSglDescriptor *desc,
+                                  uint32_t *remaining)
+{
+    uint64_t addr = le64_to_cpu(desc->addr);
+    uint32_t len = MIN(le32_to_cpu(desc->len), *remaining);
+
+    if (unlikely(desc->type & 0xf)) {
+        /* Only the Address subtype makes sense for PCIe */
+        trace_nvme_err_invalid_sgl();
+        return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+    }
+    if (!len) {
+        return NVME_SUCCESS;
+    }
+
+    if (nvme_addr_is_cmb(n, addr, len)) {
+        if (unlikely(qsg->nsg)) {
+            trace_nvme_err_invalid_sgl();
+            return NVME_INVALID_USE_OF_CMB | NVME_DNR;
+        }
+        qemu_iovec_add(iov, &n->cmbuf[addr - n->ctrl_mem.addr], len);
+    } else {
+        if (unlikely(iov->niov)) {
+            trace_nvme_err_invalid_sgl();
+            return NVME_INVALID_USE_OF_CMB | NVME_DNR;
+        }
+        qemu_sglist_add(qsg, addr, len);
+    }
+    *remaining -= len;
+    return NVME_SUCCESS;
+}
+
+/* Number of SGL descriptors read from guest memory at once */
+#define NVME_SGL_SEGMENT_CHUNK 256
+
+/* Maximum number of descriptors in the segments of one command */
+#define NVME_SGL_MAX_DESCRS 1024
+
+/*
+ * Map the data described by the SGL whose first descriptor is @sgl to @qsg,
+ * or to @iov if it is in the CMB.  Data in excess of @len is ignored; bit
+ * bucket descriptors are not supported.
+ */
+static uint16_t nvme_map_sgl(NvmeCtrl *n, QEMUSGList *qsg, QEMUIOVector *iov,
+                             NvmeSglDescriptor sgl, uint32_t len)
+{
+    NvmeSglDescriptor segment[NVME_SGL_SEGMENT_CHUNK];
+    uint32_t remaining = len;
+    unsigned int ndescs = 0;
+    uint16_t status;
+
+    pci_dma_sglist_init(qsg, &n->parent_obj, 1);
+    qemu_iovec_init(iov, 1);
+
+    switch (NVME_SGL_TYPE(sgl.type)) {
+    case NVME_SGL_DESCR_TYPE_DATA_BLOCK:
+        status = nvme_map_sgl_data(n, qsg, iov, &sgl, &remaining);
+        if (status) {
+            goto unmap;
+        }
+        break;
+    case NVME_SGL_DESCR_TYPE_SEGMENT:
+    case NVME_SGL_DESCR_TYPE_LAST_SEGMENT:
+        break;
+    default:
+        trace_nvme_err_invalid_sgl();
+        status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+        goto unmap;
+    }
+
+    while (remaining) {
+        uint64_t addr = le64_to_cpu(sgl.addr);
+        uint32_t seg_len = le32_to_cpu(sgl.len);
+        bool last = NVME_SGL_TYPE(sgl.type) == NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+        bool chained = false;
+        uint32_t nents, chunk, before = remaining;
+        int i, j;
+
+        if (NVME_SGL_TYPE(sgl.type) == NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+            /* A single data block in the command was too short */
+            trace_nvme_err_invalid_sgl();
+            status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+            goto unmap;
+        }
+        if (unlikely(!seg_len || seg_len % sizeof(NvmeSglDescriptor) ||
+                     (sgl.type & 0xf))) {
+            trace_nvme_err_invalid_sgl();
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto unmap;
+        }
+
+        nents = seg_len / sizeof(NvmeSglDescriptor);
+        for (i = 0; i < nents && remaining && !chained; i += chunk) {
+            chunk = MIN(nents - i, NVME_SGL_SEGMENT_CHUNK);
+            nvme_addr_read(n, addr + i * sizeof(NvmeSglDescriptor),
+                           segment, chunk * sizeof(NvmeSglDescriptor));
+
+            for (j = 0; j < chunk && remaining; j++) {
+                NvmeSglDescriptor *desc = &segment[j];
+
+                if (unlikely(++ndescs > NVME_SGL_MAX_DESCRS)) {
+                    trace_nvme_err_invalid_sgl();
+                    status = NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR;
+                    goto unmap;
+                }
+
+                switch (NVME_SGL_TYPE(desc->type)) {
+                case NVME_SGL_DESCR_TYPE_DATA_BLOCK:
+                    status = nvme_map_sgl_data(n, qsg, iov, desc, &remaining);
+                    if (status) {
+                        goto unmap;
+                    }
+                    break;
+                case NVME_SGL_DESCR_TYPE_SEGMENT:
+                case NVME_SGL_DESCR_TYPE_LAST_SEGMENT:
+                    /* Only the last descriptor of a segment may chain */
+                    if (unlikely(last || i + j != nents - 1)) {
+                        trace_nvme_err_invalid_sgl();
+                        status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+                        goto unmap;
+                    }
+                    sgl = *desc;
+                    chained = true;
+                    break;
+                default:
+                    trace_nvme_err_invalid_sgl();
+                    status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+                    goto unmap;
+                }
+            }
+        }
+
+        if (remaining && (!chained || remaining == before)) {
+            /*
+             * Either the SGL ended before the transfer did, or a segment
+             * only pointed to the next one, which could loop forever.
+             */
+            trace_nvme_err_invalid_sgl();
+            status = chained ? NVME_INVALID_SGL_SEG_DESCR | NVME_DNR :
+                               NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+            goto unmap;
+        }
+    }
+
+    /* nvme_rw() uses the iovec if the scatter/gather list is empty */
+    if (qsg->nsg) {
+        qemu_iovec_destroy(iov);
+    } else {
+        qemu_sglist_destroy(qsg);
+    }
+    return NVME_SUCCESS;
+
+ unmap:
+    qemu_sglist_destroy(qsg);
+    qemu_iovec_destroy(iov);
+    return status;
+}
+
 static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
@@ -252,11 +529,22 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    uint32_t posted = 0;
+
+    if (cq->db_addr) {
+        nvme_update_cq_head(n, cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
+        if (nvme_cq_full(cq) && cq->db_addr) {
+            /* Have the guest ring the doorbell once it makes room */
+            nvme_update_cq_eventidx(n, cq);
+            smp_mb();
+            nvme_update_cq_head(n, cq);
+        }
         if (nvme_cq_full(cq)) {
             break;
         }
@@ -270,9 +558,21 @@ static void nvme_post_cqes(void *opaque)
         nvme_inc_cq_tail(cq);
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
+        if (QTAILQ_EMPTY(&sq->req_list)) {
+            /* The queue ran out of requests, resume fetching commands */
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted++;
+    }
+    if (posted && cq->db_addr && !msix_enabled(&n->parent_obj)) {
+        /*
+         * A pin interrupt stays asserted until we see the guest consume
+         * the entries, so ask for a doorbell write on the next head update
+         */
+        nvme_update_cq_eventidx(n, cq);
     }
-    nvme_irq_assert(n, cq);
+    nvme_cq_notify(n, cq, posted);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -346,6 +646,8 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     uint64_t slba = le64_to_cpu(rw->slba);
     uint64_t prp1 = le64_to_cpu(rw->prp1);
     uint64_t prp2 = le64_to_cpu(rw->prp2);
+    NvmeSglDescriptor sgl;
+    uint16_t status;
 
     uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
@@ -362,9 +664,25 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
-    if (nvme_map_prp(&req->qsg, &req->iov, prp1, prp2, data_size, n)) {
+    switch (NVME_CMD_FLAGS_PSDT(rw->flags)) {
+    case NVME_PSDT_PRP:
+        status = nvme_map_prp(&req->qsg, &req->iov, prp1, prp2, data_size, n);
+        break;
+    case NVME_PSDT_SGL_MPTR_CONTIGUOUS:
+    case NVME_PSDT_SGL_MPTR_SGL:
+        /* The SGL descriptor takes the place of PRP1 and PRP2 */
+        memcpy(&sgl, &rw->prp1, sizeof(sgl));
+        QEMU_BUILD_BUG_ON(offsetof(NvmeRwCmd, prp2) !=
+                          offsetof(NvmeRwCmd, prp1) + sizeof(uint64_t));
+        status = nvme_map_sgl(n, &req->qsg, &req->iov, sgl, data_size);
+        break;
+    default:
+        status = NVME_INVALID_FIELD | NVME_DNR;
+        break;
+    }
+    if (status) {
         block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+        return status;
     }
 
     dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
@@ -412,9 +730,74 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     }
 }
 
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/*
+ * The value written to the doorbell is lost on the way through the eventfd,
+ * so this only works once the tail can be read from the shadow doorbell.
+ */
+static void nvme_init_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (sq->ioeventfd_enabled || event_notifier_init(&sq->notifier, 0)) {
+        return;
+    }
+    event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_free_sq_ioeventfd(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    if (!sq->ioeventfd_enabled) {
+        return;
+    }
+    memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    event_notifier_set_handler(&sq->notifier, NULL);
+    event_notifier_cleanup(&sq->notifier);
+    sq->ioeventfd_enabled = false;
+}
+
+/*
+ * Like Linux, only the I/O queues use shadow doorbells; the admin queues
+ * keep using their MMIO doorbells.  CAP.DSTRD is 0, so the entries of queue
+ * pair i are at offset i * 8 in either buffer.
+ */
+static void nvme_sq_enable_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+    nvme_update_sq_eventidx(n, sq);
+    if (n->ioeventfd) {
+        nvme_init_sq_ioeventfd(n, sq);
+    }
+}
+
+static void nvme_cq_enable_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+    nvme_update_cq_eventidx(n, cq);
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
+    nvme_free_sq_ioeventfd(n, sq);
     timer_del(sq->timer);
     timer_free(sq->timer);
     g_free(sq->io_req);
@@ -487,6 +870,10 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (sqid && n->dbbuf_enabled) {
+        nvme_sq_enable_dbbuf(n, sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -532,6 +919,8 @@ static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
     n->cq[cq->cqid] = NULL;
     timer_del(cq->timer);
     timer_free(cq->timer);
+    timer_del(cq->coalesce_timer);
+    timer_free(cq->coalesce_timer);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -570,11 +959,18 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->coalesced = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
     cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->coalesce_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                      nvme_coalesce_timer_cb, cq);
+
+    if (cqid && n->dbbuf_enabled) {
+        nvme_cq_enable_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -696,7 +1092,9 @@ static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
 static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
     uint32_t result;
+    uint16_t iv;
 
     switch (dw10) {
     case NVME_VOLATILE_WRITE_CACHE:
@@ -707,6 +1105,18 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         result = cpu_to_le32((n->num_queues - 2) | ((n->num_queues - 2) << 16));
         trace_nvme_getfeat_numq(result);
         break;
+    case NVME_INTERRUPT_COALESCING:
+        result = cpu_to_le32(n->int_coalescing);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        iv = NVME_INTVC_IV(dw11);
+        if (unlikely(iv >= n->num_queues)) {
+            trace_nvme_err_invalid_intvc(iv);
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = cpu_to_le32(iv |
+                             test_bit(iv, n->int_coalescing_disabled) << 16);
+        break;
     default:
         trace_nvme_err_invalid_getfeat(dw10);
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -720,6 +1130,7 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
     uint32_t dw11 = le32_to_cpu(cmd->cdw11);
+    uint16_t iv;
 
     switch (dw10) {
     case NVME_VOLATILE_WRITE_CACHE:
@@ -732,6 +1143,23 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         req->cqe.result =
             cpu_to_le32((n->num_queues - 2) | ((n->num_queues - 2) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        trace_nvme_setfeat_intc(NVME_INTC_THR(dw11), NVME_INTC_TIME(dw11));
+        n->int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        iv = NVME_INTVC_IV(dw11);
+        if (unlikely(iv >= n->num_queues)) {
+            trace_nvme_err_invalid_intvc(iv);
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        trace_nvme_setfeat_intvc(iv, NVME_INTVC_CD(dw11));
+        if (NVME_INTVC_CD(dw11)) {
+            set_bit(iv, n->int_coalescing_disabled);
+        } else {
+            clear_bit(iv, n->int_coalescing_disabled);
+        }
+        break;
     default:
         trace_nvme_err_invalid_setfeat(dw10);
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -739,6 +1167,34 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    trace_nvme_dbbuf_config(dbs_addr, eis_addr);
+
+    if (unlikely(!dbs_addr || !eis_addr ||
+                 (dbs_addr | eis_addr) & (n->page_size - 1))) {
+        trace_nvme_err_invalid_dbbuf_config(dbs_addr, eis_addr);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_sq_enable_dbbuf(n, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_cq_enable_dbbuf(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -756,6 +1212,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         trace_nvme_err_invalid_admin_opc(cmd->opcode);
         return NVME_INVALID_OPCODE | NVME_DNR;
@@ -773,6 +1231,13 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(n, sq);
+    }
+    if (cq->db_addr) {
+        nvme_update_cq_head(n, cq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
@@ -790,6 +1255,16 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr && nvme_sq_empty(sq)) {
+            /*
+             * Ask for a doorbell write on the next submission, then look
+             * for entries that were added before the guest could see it.
+             */
+            nvme_update_sq_eventidx(n, sq);
+            smp_mb();
+            nvme_update_sq_tail(n, sq);
+        }
     }
 }
 
@@ -808,6 +1283,11 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
         }
     }
 
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    n->dbbuf_enabled = false;
+    n->int_coalescing = 0;
+    bitmap_zero(n->int_coalescing_disabled, n->num_queues);
+
     blk_flush(n->conf.blk);
     n->bar.cc = 0;
 }
@@ -1240,6 +1720,7 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    n->int_coalescing_disabled = bitmap_new(n->num_queues);
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
@@ -1257,13 +1738,14 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
     id->oncs = cpu_to_le16(NVME_ONCS_WRITE_ZEROS);
+    id->sgls = cpu_to_le32(NVME_CTRL_SGLS_SUPPORTED_NO_ALIGN);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -1331,6 +1813,7 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
+    g_free(n->int_coalescing_disabled);
     if (n->cmbsz) {
         memory_region_unref(&n->ctrl_mem);
     }
@@ -1343,6 +1826,7 @@ static Property nvme_props[] = {
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
     DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
     DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, ioeventfd, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
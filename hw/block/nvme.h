@@ -27,7 +27,12 @@ typedef struct NvmeSQueue {
     uint32_t    tail;
     uint32_t    size;
     uint64_t    dma_addr;
+    /* Shadow doorbell and EventIdx entries, zero if not in use */
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
     QEMUTimer   *timer;
+    EventNotifier notifier;
+    bool        ioeventfd_enabled;
     NvmeRequest *io_req;
     QTAILQ_HEAD(sq_req_list, NvmeRequest) req_list;
     QTAILQ_HEAD(out_req_list, NvmeRequest) out_req_list;
@@ -44,7 +49,13 @@ typedef struct NvmeCQueue {
     uint32_t    vector;
     uint32_t    size;
     uint64_t    dma_addr;
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
     QEMUTimer   *timer;
+    /* Completions posted since the last interrupt, and the aggregation
+     * timer that raises it when the threshold is not reached in time */
+    uint32_t    coalesced;
+    QEMUTimer   *coalesce_timer;
     QTAILQ_HEAD(sq_list, NvmeSQueue) sq_list;
     QTAILQ_HEAD(cq_req_list, NvmeRequest) req_list;
 } NvmeCQueue;
@@ -79,6 +90,16 @@ typedef struct NvmeCtrl {
     uint32_t    cmbloc;
     uint8_t     *cmbuf;
     uint64_t    irq_status;
+    bool        ioeventfd;
+
+    /* Doorbell Buffer Config, zero until set by the guest */
+    uint64_t    dbbuf_dbs;
+    uint64_t    dbbuf_eis;
+    bool        dbbuf_enabled;
+
+    /* Interrupt Coalescing feature, and vectors that opted out of it */
+    uint32_t        int_coalescing;
+    unsigned long   *int_coalescing_disabled;
 
     char            *serial;
     NvmeNamespace   *namespaces;
@@ -34,6 +34,7 @@
 #include "sysemu/kvm.h"
 #include "virtio-pci.h"
 #include "qemu/range.h"
+#include "qemu/main-loop.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qapi/visitor.h"
 
@@ -1375,14 +1376,36 @@ static void virtio_pci_notify_write_pio(void *opaque, hwaddr addr,
     }
 }
 
+/* Dispatched without the BQL.  INTx guests read the ISR on every
+ * interrupt, including interrupts shared with other devices; only
+ * lowering the interrupt line needs the lock.
+ */
 static uint64_t virtio_pci_isr_read(void *opaque, hwaddr addr,
                                     unsigned size)
 {
     VirtIOPCIProxy *proxy = opaque;
     VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
-    uint64_t val = atomic_xchg(&vdev->isr, 0);
+    bool take_bql;
+    uint64_t val;
+
+    /* Nothing pending means that virtio_pci_notify() has not raised the
+     * line, or that the reader which cleared the ISR will lower it.
+     */
+    if (!vdev || !atomic_read(&vdev->isr)) {
+        return 0;
+    }
+
+    take_bql = !qemu_mutex_iothread_locked();
+    if (take_bql) {
+        qemu_mutex_lock_iothread();
+    }
+
+    val = atomic_xchg(&vdev->isr, 0);
     pci_irq_deassert(&proxy->pci_dev);
 
+    if (take_bql) {
+        qemu_mutex_unlock_iothread();
+    }
     return val;
 }
 
@@ -1488,6 +1511,7 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy)
                           proxy,
                           "virtio-pci-isr",
                           proxy->isr.size);
+    memory_region_clear_global_locking(&proxy->isr.mr);
 
     memory_region_init_io(&proxy->device.mr, OBJECT(proxy),
                           &device_ops,
@@ -19,6 +19,9 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#ifdef CONFIG_LINUX_IO_URING
+#include <liburing.h>
+#endif
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -51,6 +54,38 @@ struct Coroutine;
 struct ThreadPool;
 struct LinuxAioState;
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct AioUringRequest AioUringRequest;
+typedef void AioUringCompletionFunc(AioUringRequest *req);
+
+/* A request submitted through the io_uring of an AioContext */
+struct AioUringRequest {
+    AioUringCompletionFunc *cb;
+    int res;                    /* result of the request, valid in cb */
+    QSIMPLEQ_ENTRY(AioUringRequest) next;
+};
+#endif
+
+typedef QSLIST_HEAD(, QEMUBH) BHList;
+
+/* Bottom halves that are being processed by aio_bh_poll().  Slices live
+ * on the stack and are linked into a thread-local list.
+ */
+typedef struct BHListSlice BHListSlice;
+struct BHListSlice {
+    AioContext *ctx;
+    BHList bh_list;
+    QSIMPLEQ_ENTRY(BHListSlice) next;
+};
+
+/* Bottom halves deferred with qemu_bh_schedule_batched() */
+typedef struct AioBHBatch AioBHBatch;
+struct AioBHBatch {
+    AioContext *ctx;
+    BHList bh_list;
+    AioBHBatch *prev;
+};
+
 struct AioContext {
     GSource source;
 
@@ -91,8 +126,11 @@ struct AioContext {
      */
     QemuLockCnt list_lock;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* Bottom halves pending for aio_bh_poll(); lock-free for adders.
+     * Each aio_bh_poll() atomically takes the whole list, so that every
+     * scheduled BH is run by exactly one thread.
+     */
+    BHList bh_list;
 
     /* Used by aio_notify.
      *
@@ -147,6 +185,23 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Set once a GSource drives the context instead of aio_poll() */
+    bool use_g_source;
+
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring(7) state used when built with CONFIG_LINUX_IO_URING.  The
+     * ring is only used by the home thread, from aio_poll().  Other
+     * threads queue fd handler changes on io_uring_submit_list.
+     */
+    struct io_uring io_uring;
+    bool io_uring_enabled;
+    bool io_uring_failed;
+    unsigned io_uring_inflight;     /* AioUringRequests not reaped yet */
+    int io_uring_nr_parked;         /* handlers waiting for external clients */
+    QSLIST_HEAD(, AioHandler) io_uring_submit_list;
+    QSIMPLEQ_HEAD(, AioUringRequest) io_uring_completed;
+#endif
 };
 
 /**
@@ -186,7 +241,14 @@ void aio_context_unref(AioContext *ctx);
  * Bottom halves, timers and callbacks can be created or removed without
  * acquiring the AioContext.
  */
-void aio_context_acquire(AioContext *ctx);
+#define aio_context_acquire(ctx) \
+    aio_context_acquire_impl(ctx, __FILE__, __LINE__)
+void aio_context_acquire_impl(AioContext *ctx, const char *file, int line);
+
+static inline void (aio_context_acquire)(AioContext *ctx)
+{
+    aio_context_acquire(ctx);
+}
 
 /* Relinquish ownership of the AioContext. */
 void aio_context_release(AioContext *ctx);
@@ -248,11 +310,35 @@ void aio_bh_call(QEMUBH *bh);
  * aio_bh_poll: Poll bottom halves for an AioContext.
  *
  * These are internal functions used by the QEMU main loop.
- * And notice that multiple occurrences of aio_bh_poll cannot
- * be called concurrently
+ * A non-blocking aio_poll() outside the home thread can run it
+ * concurrently with the home thread; deleted and oneshot BHs are
+ * therefore freed only after an RCU grace period.
  */
 int aio_bh_poll(AioContext *ctx);
 
+/**
+ * aio_bh_batch_begin: Start an event loop iteration for @ctx.
+ * @ctx: the AioContext that is being polled.
+ * @batch: caller-allocated batch, usually on the stack.
+ *
+ * Until the matching aio_bh_batch_end(), qemu_bh_schedule_batched() calls
+ * from the current thread for bottom halves of @ctx are collected in
+ * @batch.  Batches can nest.
+ *
+ * These are internal functions used by aio_poll() and aio_dispatch().
+ */
+void aio_bh_batch_begin(AioContext *ctx, AioBHBatch *batch);
+
+/**
+ * aio_bh_batch_end: Finish an event loop iteration started with
+ * aio_bh_batch_begin().
+ * @batch: the batch passed to aio_bh_batch_begin().
+ *
+ * Runs the bottom halves collected in @batch, once each.
+ * Returns true if any of them was called.
+ */
+bool aio_bh_batch_end(AioBHBatch *batch);
+
 /**
  * qemu_bh_schedule: Schedule a bottom half.
  *
@@ -267,6 +353,23 @@ int aio_bh_poll(AioContext *ctx);
  */
 void qemu_bh_schedule(QEMUBH *bh);
 
+/**
+ * qemu_bh_schedule_batched: Schedule a bottom half at the end of the
+ * current event loop iteration.
+ *
+ * If called from a handler, bottom half or timer that is running in an
+ * aio_poll() or aio_dispatch() of the bottom half's AioContext, the callback
+ * runs once after all other events of that iteration have been processed,
+ * no matter how many times it was scheduled.  Otherwise this is the same as
+ * qemu_bh_schedule().
+ *
+ * This is meant for work that can be coalesced, such as notifying the
+ * guest about many request completions with a single interrupt.
+ *
+ * @bh: The bottom half to be scheduled.
+ */
+void qemu_bh_schedule_batched(QEMUBH *bh);
+
 /**
  * qemu_bh_cancel: Cancel execution of a bottom half.
  *
@@ -374,7 +477,8 @@ void aio_set_event_notifier_poll(AioContext *ctx,
                                  EventNotifierHandler *io_poll_end);
 
 /* Return a GSource that lets the main loop poll the file descriptors attached
- * to this AioContext.
+ * to this AioContext.  This disables io_uring file descriptor monitoring,
+ * which relies on aio_poll() being called regularly.
  */
 GSource *aio_get_g_source(AioContext *ctx);
 
@@ -565,6 +669,29 @@ void aio_context_setup(AioContext *ctx);
  */
 void aio_context_destroy(AioContext *ctx);
 
+#ifdef CONFIG_LINUX_IO_URING
+/**
+ * aio_add_sqe:
+ * @ctx: the aio context
+ * @prep_sqe: fills in the submission queue entry
+ * @opaque: data for @prep_sqe
+ * @req: the request the entry belongs to
+ *
+ * Queue a submission queue entry on the io_uring that @ctx uses to monitor
+ * file descriptors.  It is submitted by the same io_uring_enter(2) call
+ * that aio_poll() uses to wait for events, and @req->cb is called from
+ * aio_poll() once the request completes.  @prep_sqe must not set the
+ * user_data of the entry.
+ *
+ * Must be called from the home thread of @ctx.
+ *
+ * Returns: false if @ctx does not use io_uring, true otherwise.
+ */
+bool aio_add_sqe(AioContext *ctx,
+                 void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, AioUringRequest *req);
+#endif
+
 /**
  * aio_context_set_poll_params:
  * @ctx: the aio context
@@ -23,7 +23,8 @@
 typedef struct CowRequest {
     int64_t start_byte;
     int64_t end_byte;
-    QLIST_ENTRY(CowRequest) list;
+    IntervalTreeNode node;
+    IntervalTreeRoot *inflight_reqs;
     CoQueue wait_queue; /* coroutines blocked on this request */
 } CowRequest;
 
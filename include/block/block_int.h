@@ -32,6 +32,7 @@
 #include "qemu/stats64.h"
 #include "qemu/timer.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
@@ -56,6 +57,7 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -76,13 +78,31 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_offset;
     uint64_t overlap_bytes;
 
-    QLIST_ENTRY(BdrvTrackedRequest) list;
+    /* Covers the overlap range, in bs->tracked_requests */
+    IntervalTreeNode node;
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+/* Number of block status results remembered per node */
+#define BDRV_BSC_ENTRIES 16
+
+/*
+ * A result of BlockDriver.bdrv_co_block_status() for [offset, offset + bytes),
+ * valid as long as the node's block status cache generation is @gen.
+ */
+typedef struct BdrvBlockStatusCacheEntry {
+    uint64_t gen;
+    int64_t offset;
+    int64_t bytes;
+    int64_t map;
+    BlockDriverState *file;
+    int ret;
+    bool want_zero;
+} BdrvBlockStatusCacheEntry;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -118,6 +138,15 @@ struct BlockDriver {
     /* Set if a driver can support backing files */
     bool supports_backing;
 
+    /*
+     * Set if the results of bdrv_co_block_status() only change through
+     * requests and graph changes that go through the generic block layer,
+     * so that they may be cached (see bdrv_bsc_invalidate()).  Not for
+     * protocol drivers whose data may be changed by other processes without
+     * them noticing, like a file that is shared with other programs.
+     */
+    bool block_status_cacheable;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -813,12 +842,18 @@ struct BlockDriverState {
 
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
-    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTreeRoot tracked_requests;    /* BdrvTrackedRequest.node */
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
     /* Only read/written by whoever has set active_flush_req to true.  */
     unsigned int flushed_gen;             /* Flushed write generation */
+
+    /* Recent block status results.  Protected by bsc_lock.  */
+    QemuMutex bsc_lock;
+    uint64_t bsc_gen;
+    unsigned int bsc_next;
+    BdrvBlockStatusCacheEntry bsc_entries[BDRV_BSC_ENTRIES];
 };
 
 struct BlockBackendRootState {
@@ -1063,6 +1098,10 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @compress: Whether to compress the data written to @target.
+ * @max_workers: The maximum number of chunks copied in parallel, or 0 for
+ *               the default.
+ * @max_chunk: The maximum size of a chunk in bytes, or 0 for the default.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -1078,7 +1117,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             BlockDriverState *target, int64_t speed,
                             MirrorSyncMode sync_mode,
                             BdrvDirtyBitmap *sync_bitmap,
-                            bool compress,
+                            bool compress, int max_workers,
+                            int64_t max_chunk,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
                             int creation_flags,
@@ -1154,6 +1194,13 @@ void bdrv_undo_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *in);
 void bdrv_inc_in_flight(BlockDriverState *bs);
 void bdrv_dec_in_flight(BlockDriverState *bs);
 
+/*
+ * Forget all cached block status results of @bs.  Must be called after
+ * anything changes the block status of a node outside of requests, e.g.
+ * when a driver modifies its metadata on its own.
+ */
+void bdrv_bsc_invalidate(BlockDriverState *bs);
+
 void blockdev_close_all_bdrv_states(void);
 
 int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
@@ -389,6 +389,10 @@ struct MemoryRegion {
     const char *name;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+    /* Accesses that took the global lock on behalf of the region; only
+     * updated with the lock held.
+     */
+    uint64_t bql_dispatch_count;
 };
 
 struct IOMMUMemoryRegion {
@@ -1685,6 +1689,15 @@ void memory_global_dirty_log_stop(void);
 void mtree_info(fprintf_function mon_printf, void *f, bool flatview,
                 bool dispatch_tree, bool owner);
 
+/**
+ * mtree_info_bql: list the memory regions whose accesses had to take the
+ * QEMU global lock, busiest first.
+ *
+ * Regions that show up at the top are candidates for
+ * memory_region_clear_global_locking().
+ */
+void mtree_info_bql(fprintf_function mon_printf, void *f);
+
 /**
  * memory_region_dispatch_read: perform a read directly to the specified
  * MemoryRegion.
@@ -390,6 +390,10 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client);
 
+uint64_t cpu_physical_memory_count_and_clear_dirty(ram_addr_t start,
+                                                   ram_addr_t length,
+                                                   unsigned client);
+
 DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
     (ram_addr_t start, ram_addr_t length, unsigned client);
 
@@ -181,6 +181,13 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /* The state may be saved from a worker thread, concurrently with other
+     * devices, and sent on a multifd channel at the end of precopy
+     * migration.  pre_save and the field accessors must then not rely on
+     * the iothread lock, and no other device's pre_save may modify the
+     * state.  Loading still happens in stream order.
+     */
+    bool parallel_save;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
@@ -15,6 +15,7 @@
 #ifndef QEMU_COROUTINE_H
 #define QEMU_COROUTINE_H
 
+#include "qemu/atomic.h"
 #include "qemu/queue.h"
 #include "qemu/timer.h"
 
@@ -150,11 +151,25 @@ struct CoMutex {
  */
 void qemu_co_mutex_init(CoMutex *mutex);
 
+void coroutine_fn qemu_co_mutex_lock_impl(CoMutex *mutex,
+                                          const char *file, int line);
+
+typedef void (*QemuCoMutexLockFunc)(CoMutex *m, const char *f, int l);
+extern QemuCoMutexLockFunc qemu_co_mutex_lock_func;
+
 /**
  * Locks the mutex. If the lock cannot be taken immediately, control is
  * transferred to the caller of the current coroutine.
  */
-void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex);
+#define qemu_co_mutex_lock(m) ({                                        \
+            QemuCoMutexLockFunc _f = atomic_read(&qemu_co_mutex_lock_func); \
+            _f(m, __FILE__, __LINE__);                                  \
+        })
+
+static inline void coroutine_fn (qemu_co_mutex_lock)(CoMutex *mutex)
+{
+    qemu_co_mutex_lock(mutex);
+}
 
 /**
  * Unlocks the mutex and schedules the next coroutine that was waiting for this
@@ -178,14 +193,22 @@ typedef struct CoQueue {
  */
 void qemu_co_queue_init(CoQueue *queue);
 
+void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock,
+                                          const char *file, int line);
+
+typedef void (*QemuCoQueueWaitFunc)(CoQueue *q, QemuLockable *lock,
+                                    const char *f, int l);
+extern QemuCoQueueWaitFunc qemu_co_queue_wait_func;
+
 /**
  * Adds the current coroutine to the CoQueue and transfers control to the
  * caller of the coroutine.  The mutex is unlocked during the wait and
  * locked again afterwards.
  */
-#define qemu_co_queue_wait(queue, lock) \
-    qemu_co_queue_wait_impl(queue, QEMU_MAKE_LOCKABLE(lock))
-void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock);
+#define qemu_co_queue_wait(queue, lock) ({                              \
+            QemuCoQueueWaitFunc _f = atomic_read(&qemu_co_queue_wait_func); \
+            _f(queue, QEMU_MAKE_LOCKABLE(lock), __FILE__, __LINE__);    \
+        })
 
 /**
  * Removes the next coroutine from the CoQueue, and wake it up.
@@ -230,12 +253,25 @@ typedef struct CoRwlock {
  */
 void qemu_co_rwlock_init(CoRwlock *lock);
 
+void qemu_co_rwlock_rdlock_impl(CoRwlock *lock, const char *file, int line);
+void qemu_co_rwlock_upgrade_impl(CoRwlock *lock, const char *file, int line);
+void qemu_co_rwlock_wrlock_impl(CoRwlock *lock, const char *file, int line);
+
+typedef void (*QemuCoRwlockLockFunc)(CoRwlock *l, const char *f, int line);
+extern QemuCoRwlockLockFunc qemu_co_rwlock_rdlock_func;
+extern QemuCoRwlockLockFunc qemu_co_rwlock_upgrade_func;
+extern QemuCoRwlockLockFunc qemu_co_rwlock_wrlock_func;
+
 /**
  * Read locks the CoRwlock. If the lock cannot be taken immediately because
  * of a parallel writer, control is transferred to the caller of the current
  * coroutine.
  */
-void qemu_co_rwlock_rdlock(CoRwlock *lock);
+#define qemu_co_rwlock_rdlock(l) ({                                     \
+            QemuCoRwlockLockFunc _f;                                    \
+            _f = atomic_read(&qemu_co_rwlock_rdlock_func);              \
+            _f(l, __FILE__, __LINE__);                                  \
+        })
 
 /**
  * Write Locks the CoRwlock from a reader.  This is a bit more efficient than
@@ -245,7 +281,11 @@ void qemu_co_rwlock_rdlock(CoRwlock *lock);
  * only overrides CoRwlock fairness if there are no concurrent readers, so
  * another writer might run while @qemu_co_rwlock_upgrade blocks.
  */
-void qemu_co_rwlock_upgrade(CoRwlock *lock);
+#define qemu_co_rwlock_upgrade(l) ({                                    \
+            QemuCoRwlockLockFunc _f;                                    \
+            _f = atomic_read(&qemu_co_rwlock_upgrade_func);             \
+            _f(l, __FILE__, __LINE__);                                  \
+        })
 
 /**
  * Downgrades a write-side critical section to a reader.  Downgrading with
@@ -260,7 +300,11 @@ void qemu_co_rwlock_downgrade(CoRwlock *lock);
  * of a parallel reader, control is transferred to the caller of the current
  * coroutine.
  */
-void qemu_co_rwlock_wrlock(CoRwlock *lock);
+#define qemu_co_rwlock_wrlock(l) ({                                     \
+            QemuCoRwlockLockFunc _f;                                    \
+            _f = atomic_read(&qemu_co_rwlock_wrlock_func);              \
+            _f(l, __FILE__, __LINE__);                                  \
+        })
 
 /**
  * Unlocks the read/write lock and schedules the next coroutine that was
@@ -69,4 +69,41 @@ void qemu_coroutine_delete(Coroutine *co);
 CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
                                       CoroutineAction action);
 
+typedef struct CoroutineStackStats {
+    uint64_t mapped;            /* stacks currently mapped */
+    uint64_t mapped_peak;       /* high-water mark of @mapped */
+    uint64_t in_use_peak;       /* most stacks of a size used by a thread */
+    uint64_t nr_maps;           /* stacks mapped since startup */
+    uint64_t nr_unmaps;         /* stacks unmapped since startup */
+    uint64_t nr_decommits;      /* idle stacks given back to the kernel */
+} CoroutineStackStats;
+
+typedef struct CoroutineStackClass CoroutineStackClass;
+
+/**
+ * qemu_coroutine_stack_alloc:
+ * @sz: pointer to a size_t holding the requested usable stack size
+ * @owner: receives the cache class that the stack is accounted to
+ *
+ * Like qemu_alloc_stack(), but reuse a stack from the per-thread cache if
+ * possible.  On return @sz and @owner hold the values that have to be
+ * passed to qemu_coroutine_stack_free().
+ */
+void *qemu_coroutine_stack_alloc(size_t *sz, CoroutineStackClass **owner);
+
+/**
+ * qemu_coroutine_stack_free:
+ * @stack: stack to free
+ * @sz: size of stack in bytes, as returned by qemu_coroutine_stack_alloc()
+ * @owner: as returned by qemu_coroutine_stack_alloc()
+ *
+ * Return a stack to the per-thread cache, or unmap it if the cache
+ * already holds as many stacks as recent demand requires.  May be called
+ * from any thread.
+ */
+void qemu_coroutine_stack_free(void *stack, size_t sz,
+                               CoroutineStackClass *owner);
+
+void qemu_coroutine_stack_get_stats(CoroutineStackStats *stats);
+
 #endif
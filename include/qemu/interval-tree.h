@@ -0,0 +1,75 @@
+/*
+ * Intrusive interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * An AVL tree of closed intervals [start, last], ordered by start and
+ * augmented with the largest end point of every subtree, so that the
+ * intervals overlapping a given range can be found in logarithmic time.
+ *
+ * The nodes are embedded into the caller's structures and several nodes
+ * may cover the same interval.  There is no locking; callers have to
+ * serialize accesses to a tree.
+ */
+
+typedef struct IntervalTreeNode {
+    uint64_t start;
+    uint64_t last;
+
+    /* private */
+    uint64_t subtree_last;
+    struct IntervalTreeNode *left;
+    struct IntervalTreeNode *right;
+    int height;
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+static inline bool interval_tree_is_empty(const IntervalTreeRoot *root)
+{
+    return root->root == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ *
+ * Add @node to the tree.  node->start and node->last must be set and must
+ * not change until the node is removed again.
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ *
+ * Remove @node, which must be in the tree, from the tree.
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ *
+ * Returns: the node with the lowest start that overlaps [@start, @last],
+ * or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_iter_next:
+ *
+ * Returns: the node following @node in the tree that overlaps
+ * [@start, @last], or NULL if there is none.  @node must still be in the
+ * tree.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeRoot *root,
+                                          IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last);
+
+#endif
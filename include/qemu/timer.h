@@ -4,6 +4,7 @@
 #include "qemu-common.h"
 #include "qemu/notify.h"
 #include "qemu/host-utils.h"
+#include "qemu/atomic.h"
 
 #define NANOSECONDS_PER_SECOND 1000000000LL
 
@@ -66,7 +67,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;               /* orders timers with the same expire_time */
+    int heap_index;             /* position in the timer list while pending */
     int scale;
 };
 
@@ -861,8 +863,65 @@ static inline int64_t get_clock(void)
 
 extern int use_rt_clock;
 
+#ifdef CONFIG_TSC_CLOCK
+/*
+ * TSC clock source, see util/qemu-timer-common.c.  The time in nanoseconds
+ * is base_ns + (tsc - base_tsc) * mult / 2^32; the parameters are updated
+ * under the sequence counter whenever the TSC has gone resync_ticks past
+ * base_tsc.  resync_ticks is zero until the TSC has been calibrated.
+ */
+typedef struct QemuTscClock {
+    unsigned sequence;
+    uint64_t base_tsc;
+    int64_t base_ns;
+    uint64_t mult;
+    uint64_t resync_ticks;
+} QemuTscClock;
+
+extern int use_tsc_clock;
+extern QemuTscClock tsc_clock;
+
+int64_t get_clock_tsc_resync(void);
+
+static inline uint64_t get_tsc_ordered(void)
+{
+    uint32_t low, high;
+
+    /* Do not let rdtsc execute ahead of earlier loads */
+    asm volatile("lfence; rdtsc" : "=a" (low), "=d" (high) : : "memory");
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline int64_t get_clock_tsc(void)
+{
+    unsigned start;
+    uint64_t delta, lo, hi;
+    int64_t ns;
+
+    do {
+        start = atomic_read(&tsc_clock.sequence) & ~1;
+        smp_rmb();
+        delta = get_tsc_ordered() - tsc_clock.base_tsc;
+        if (unlikely(delta >= tsc_clock.resync_ticks)) {
+            /* Also taken if another CPU's TSC is slightly behind */
+            return get_clock_tsc_resync();
+        }
+        mulu64(&lo, &hi, delta, tsc_clock.mult);
+        ns = tsc_clock.base_ns + (int64_t)((lo >> 32) | (hi << 32));
+        smp_rmb();
+    } while (unlikely(atomic_read(&tsc_clock.sequence) != start));
+
+    return ns;
+}
+#endif
+
 static inline int64_t get_clock(void)
 {
+#ifdef CONFIG_TSC_CLOCK
+    if (likely(atomic_read(&use_tsc_clock))) {
+        return get_clock_tsc();
+    }
+#endif
 #ifdef CLOCK_MONOTONIC
     if (use_rt_clock) {
         struct timespec ts;
@@ -61,6 +61,8 @@ bool is_daemonized(void);
  * coroutines. If the memory cannot be allocated, this function
  * will abort (like g_malloc()). This function also inserts an
  * additional guard page to catch a potential stack overflow.
+ * Only address space is reserved up front; memory is committed by
+ * the kernel as the stack grows into it.
  * Note that the memory required for the guard page and alignment
  * and minimal stack size restrictions will increase the value of sz.
  *
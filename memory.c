@@ -3046,6 +3046,69 @@ void mtree_info(fprintf_function mon_printf, void *f, bool flatview,
     }
 }
 
+static void mtree_collect_regions(GHashTable *regions, const MemoryRegion *mr)
+{
+    const MemoryRegion *submr;
+
+    if (!mr || g_hash_table_contains(regions, mr)) {
+        return;
+    }
+
+    g_hash_table_add(regions, (gpointer)mr);
+    mtree_collect_regions(regions, mr->alias);
+    QTAILQ_FOREACH(submr, &mr->subregions, subregions_link) {
+        mtree_collect_regions(regions, submr);
+    }
+}
+
+static gint mtree_bql_compare(gconstpointer a, gconstpointer b)
+{
+    const MemoryRegion *mra = a;
+    const MemoryRegion *mrb = b;
+
+    if (mra->bql_dispatch_count != mrb->bql_dispatch_count) {
+        return mra->bql_dispatch_count > mrb->bql_dispatch_count ? -1 : 1;
+    }
+    return g_strcmp0(memory_region_name(mra), memory_region_name(mrb));
+}
+
+void mtree_info_bql(fprintf_function mon_printf, void *f)
+{
+    GHashTable *regions = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GList *list, *l;
+    AddressSpace *as;
+    bool found = false;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        mtree_collect_regions(regions, as->root);
+    }
+
+    list = g_list_sort(g_hash_table_get_keys(regions), mtree_bql_compare);
+    for (l = list; l; l = l->next) {
+        const MemoryRegion *mr = l->data;
+
+        if (!mr->bql_dispatch_count) {
+            break;
+        }
+        if (!found) {
+            mon_printf(f, "%20s  %s\n", "dispatches", "region");
+            found = true;
+        }
+        mon_printf(f, "%20" PRIu64 "  %s (%s)",
+                   mr->bql_dispatch_count, memory_region_name(mr),
+                   memory_region_type((MemoryRegion *)mr));
+        mtree_print_mr_owner(mon_printf, f, mr);
+        mon_printf(f, "\n");
+    }
+
+    if (!found) {
+        mon_printf(f, "No memory region access took the global lock\n");
+    }
+
+    g_list_free(list);
+    g_hash_table_unref(regions);
+}
+
 void memory_region_init_ram(MemoryRegion *mr,
                             struct Object *owner,
                             const char *name,
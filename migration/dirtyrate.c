@@ -0,0 +1,334 @@
+/*
+ * Guest dirty page rate estimation
+ *
+ * Measures how fast the guest dirties its memory without having to start
+ * a migration, either by sampling and hashing pages of every RAMBlock or
+ * by enabling the global dirty log for a short window.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include <zlib.h>
+#include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "exec/ram_addr.h"
+#include "exec/memory.h"
+#include "migration.h"
+#include "migration/misc.h"
+#include "dirtyrate.h"
+#include "trace.h"
+
+#define DIRTYRATE_DEFAULT_SAMPLE_PAGES  512
+#define DIRTYRATE_MAX_SAMPLE_PAGES      16384
+#define DIRTYRATE_MIN_CALC_TIME         1
+#define DIRTYRATE_MAX_CALC_TIME         60
+
+typedef struct RamblockDirtyInfo {
+    char idstr[256];
+    /* Length of the block when it was sampled */
+    ram_addr_t used_length;
+    uint64_t npages;
+    uint64_t nsamples;
+    /* Page indexes of the samples and the hash of their contents */
+    uint64_t *sample_pages;
+    uint32_t *hashes;
+} RamblockDirtyInfo;
+
+typedef struct DirtyRateConfig {
+    DirtyRateMeasureMode mode;
+    int64_t calc_time;
+    uint64_t sample_pages;
+} DirtyRateConfig;
+
+/* Protected by the iothread lock */
+static struct {
+    DirtyRateStatus status;
+    DirtyRateConfig config;
+    int64_t start_time;
+    int64_t dirty_pages_rate;
+    QemuThread thread;
+} dirtyrate_state;
+
+bool dirtyrate_log_in_progress(void)
+{
+    return dirtyrate_state.status == DIRTY_RATE_STATUS_MEASURING &&
+           dirtyrate_state.config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_LOG;
+}
+
+static uint32_t dirtyrate_hash_page(RAMBlock *block, uint64_t page)
+{
+    return crc32(0, block->host + (page << TARGET_PAGE_BITS),
+                 TARGET_PAGE_SIZE);
+}
+
+/* Called from RCU critical section */
+static RamblockDirtyInfo *dirtyrate_sample_blocks(uint64_t sample_pages,
+                                                  int *nblocks)
+{
+    RamblockDirtyInfo *infos;
+    RAMBlock *block;
+    int n = 0;
+
+    RAMBLOCK_FOREACH(block) {
+        if (qemu_ram_is_migratable(block)) {
+            n++;
+        }
+    }
+
+    infos = g_new0(RamblockDirtyInfo, n);
+    n = 0;
+    RAMBLOCK_FOREACH(block) {
+        RamblockDirtyInfo *info;
+        uint64_t i;
+
+        if (!qemu_ram_is_migratable(block)) {
+            continue;
+        }
+
+        info = &infos[n++];
+        pstrcpy(info->idstr, sizeof(info->idstr), block->idstr);
+        info->used_length = block->used_length;
+        info->npages = block->used_length >> TARGET_PAGE_BITS;
+        if (!info->npages) {
+            /* Nothing to sample; nsamples stays 0 */
+            continue;
+        }
+        info->nsamples = (block->used_length * sample_pages) >> 30;
+        info->nsamples = MIN(MAX(info->nsamples, 1), info->npages);
+        info->sample_pages = g_new(uint64_t, info->nsamples);
+        info->hashes = g_new(uint32_t, info->nsamples);
+
+        for (i = 0; i < info->nsamples; i++) {
+            uint64_t rnd = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+            info->sample_pages[i] = rnd % info->npages;
+            info->hashes[i] = dirtyrate_hash_page(block,
+                                                  info->sample_pages[i]);
+        }
+    }
+
+    *nblocks = n;
+    return infos;
+}
+
+/*
+ * Compare the samples against the current page contents and extrapolate
+ * the number of dirty pages in every block from the dirty samples.
+ *
+ * Called from RCU critical section.
+ */
+static uint64_t dirtyrate_compare_blocks(RamblockDirtyInfo *infos,
+                                         int nblocks)
+{
+    uint64_t dirty_pages = 0;
+    int n;
+
+    for (n = 0; n < nblocks; n++) {
+        RamblockDirtyInfo *info = &infos[n];
+        RAMBlock *block = qemu_ram_block_by_name(info->idstr);
+        uint64_t i, ndirty = 0;
+
+        /*
+         * Skip blocks smaller than a page, and blocks that went away or
+         * were resized meanwhile
+         */
+        if (!info->nsamples || !block ||
+            block->used_length != info->used_length) {
+            continue;
+        }
+
+        for (i = 0; i < info->nsamples; i++) {
+            if (dirtyrate_hash_page(block, info->sample_pages[i]) !=
+                info->hashes[i]) {
+                ndirty++;
+            }
+        }
+
+        trace_dirtyrate_compare_block(info->idstr, info->nsamples, ndirty);
+        dirty_pages += ndirty * info->npages / info->nsamples;
+    }
+
+    return dirty_pages;
+}
+
+static void dirtyrate_free_blocks(RamblockDirtyInfo *infos, int nblocks)
+{
+    int n;
+
+    for (n = 0; n < nblocks; n++) {
+        g_free(infos[n].sample_pages);
+        g_free(infos[n].hashes);
+    }
+    g_free(infos);
+}
+
+static uint64_t dirtyrate_measure_by_sampling(DirtyRateConfig *config,
+                                              int64_t *elapsed_ms)
+{
+    RamblockDirtyInfo *infos;
+    uint64_t dirty_pages;
+    int64_t start_ms;
+    int nblocks;
+
+    rcu_read_lock();
+    infos = dirtyrate_sample_blocks(config->sample_pages, &nblocks);
+    rcu_read_unlock();
+    start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    g_usleep(config->calc_time * G_USEC_PER_SEC);
+
+    rcu_read_lock();
+    *elapsed_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms;
+    dirty_pages = dirtyrate_compare_blocks(infos, nblocks);
+    rcu_read_unlock();
+
+    dirtyrate_free_blocks(infos, nblocks);
+    return dirty_pages;
+}
+
+/* Called with the iothread lock held */
+static uint64_t dirtyrate_count_dirty_log(void)
+{
+    RAMBlock *block;
+    uint64_t dirty_pages = 0;
+
+    memory_global_dirty_log_sync();
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        if (!qemu_ram_is_migratable(block)) {
+            continue;
+        }
+        dirty_pages +=
+            cpu_physical_memory_count_and_clear_dirty(block->offset,
+                                                      block->used_length,
+                                                      DIRTY_MEMORY_MIGRATION);
+    }
+    rcu_read_unlock();
+
+    return dirty_pages;
+}
+
+static uint64_t dirtyrate_measure_by_dirty_log(DirtyRateConfig *config,
+                                               int64_t *elapsed_ms)
+{
+    uint64_t dirty_pages;
+    int64_t start_ms;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    /* Throw away whatever was left in the bitmap before logging started */
+    dirtyrate_count_dirty_log();
+    start_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(config->calc_time * G_USEC_PER_SEC);
+
+    qemu_mutex_lock_iothread();
+    dirty_pages = dirtyrate_count_dirty_log();
+    *elapsed_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_ms;
+    memory_global_dirty_log_stop();
+    qemu_mutex_unlock_iothread();
+
+    return dirty_pages;
+}
+
+static void *dirtyrate_thread(void *opaque)
+{
+    DirtyRateConfig config = dirtyrate_state.config;
+    uint64_t dirty_pages;
+    int64_t elapsed_ms = 0;
+
+    rcu_register_thread();
+
+    if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_LOG) {
+        dirty_pages = dirtyrate_measure_by_dirty_log(&config, &elapsed_ms);
+    } else {
+        dirty_pages = dirtyrate_measure_by_sampling(&config, &elapsed_ms);
+    }
+
+    qemu_mutex_lock_iothread();
+    dirtyrate_state.dirty_pages_rate = dirty_pages * 1000 /
+                                       MAX(elapsed_ms, 1);
+    dirtyrate_state.status = DIRTY_RATE_STATUS_MEASURED;
+    trace_dirtyrate_measured(DirtyRateMeasureMode_str(config.mode),
+                             dirty_pages, elapsed_ms,
+                             dirtyrate_state.dirty_pages_rate);
+    qemu_mutex_unlock_iothread();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
+{
+    if (dirtyrate_state.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "The dirty rate is already being measured");
+        return;
+    }
+
+    if (calc_time < DIRTYRATE_MIN_CALC_TIME ||
+        calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, "Parameter 'calc-time' must be between %d and %d",
+                   DIRTYRATE_MIN_CALC_TIME, DIRTYRATE_MAX_CALC_TIME);
+        return;
+    }
+
+    if (!has_sample_pages) {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < 1 || sample_pages > DIRTYRATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, "Parameter 'sample-pages' must be between 1 and %d",
+                   DIRTYRATE_MAX_SAMPLE_PAGES);
+        return;
+    }
+
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
+    /* The dirty log is shared with migration, which starts and stops it */
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_LOG && !migration_is_idle()) {
+        error_setg(errp, "The dirty log cannot be used to measure the dirty "
+                   "rate while a migration is in progress");
+        return;
+    }
+
+    dirtyrate_state.config.mode = mode;
+    dirtyrate_state.config.calc_time = calc_time;
+    dirtyrate_state.config.sample_pages = sample_pages;
+    dirtyrate_state.start_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirtyrate_state.status = DIRTY_RATE_STATUS_MEASURING;
+
+    qemu_thread_create(&dirtyrate_state.thread, "dirtyrate", dirtyrate_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+
+    info->status = dirtyrate_state.status;
+    info->start_time = dirtyrate_state.start_time;
+    info->calc_time = dirtyrate_state.config.calc_time;
+    info->sample_pages = dirtyrate_state.config.sample_pages;
+    info->mode = dirtyrate_state.config.mode;
+
+    if (info->status == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = (dirtyrate_state.dirty_pages_rate *
+                            TARGET_PAGE_SIZE) >> 20;
+        info->has_dirty_pages_rate = true;
+        info->dirty_pages_rate = dirtyrate_state.dirty_pages_rate;
+    }
+
+    return info;
+}
@@ -0,0 +1,19 @@
+/*
+ * Guest dirty page rate estimation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DIRTYRATE_H
+#define QEMU_MIGRATION_DIRTYRATE_H
+
+/**
+ * dirtyrate_log_in_progress: check whether a dirty rate measurement
+ * currently owns the global dirty log
+ *
+ * Must be called with the iothread lock held.
+ */
+bool dirtyrate_log_in_progress(void);
+
+#endif
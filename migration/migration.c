@@ -45,6 +45,7 @@
 #include "migration/colo.h"
 #include "hw/boards.h"
 #include "monitor/monitor.h"
+#include "dirtyrate.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -755,6 +756,9 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->pages = xbzrle_counters.pages;
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
+        info->xbzrle_cache->cache_hit = xbzrle_counters.cache_hit;
+        info->xbzrle_cache->cache_hit_rate = xbzrle_counters.cache_hit_rate;
+        info->xbzrle_cache->cache_evictions = xbzrle_counters.cache_evictions;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
     }
 
@@ -1693,6 +1697,12 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
         return false;
     }
 
+    if (dirtyrate_log_in_progress()) {
+        error_setg(errp, "The dirty log is in use by a dirty rate "
+                   "measurement, try again later");
+        return false;
+    }
+
     if (migration_is_blocked(errp)) {
         return false;
     }
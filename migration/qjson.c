@@ -88,6 +88,23 @@ void json_prop_str(QJSON *json, const char *name, const char *str)
     qstring_append_chr(json->str, '"');
 }
 
+/*
+ * Append the members written to @src, which must not have been finished
+ * yet, to the current object or array of @json.
+ */
+void json_append(QJSON *json, QJSON *src)
+{
+    const char *str = qstring_get_str(src->str);
+
+    /* omit_comma is only still set if nothing was written after "{ " */
+    if (src->omit_comma) {
+        return;
+    }
+
+    json_emit_element(json, NULL);
+    qstring_append(json->str, str + strlen("{ "));
+}
+
 const char *qjson_get_str(QJSON *json)
 {
     return qstring_get_str(json->str);
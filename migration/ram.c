@@ -57,6 +57,8 @@
 #include "qemu/uuid.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "io/channel-buffer.h"
+#include "qemu-file-channel.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -301,6 +303,8 @@ struct RAMState {
     uint64_t num_dirty_pages_period;
     /* xbzrle misses since the beginning of the period */
     uint64_t xbzrle_cache_miss_prev;
+    /* xbzrle hits since the beginning of the period */
+    uint64_t xbzrle_cache_hit_prev;
     /* number of iterations at the beginning of period */
     uint64_t iterations_prev;
     /* Iterations since start */
@@ -513,9 +517,11 @@ exit:
 /* Multiple fd's */
 
 #define MULTIFD_MAGIC 0x11223344U
-#define MULTIFD_VERSION 1
+#define MULTIFD_VERSION 2
 
 #define MULTIFD_FLAG_SYNC (1 << 0)
+/* The packet is followed by a MultiFDDeviceState_t instead of pages */
+#define MULTIFD_FLAG_DEVICE_STATE (1 << 1)
 
 typedef struct {
     uint32_t magic;
@@ -535,6 +541,21 @@ typedef struct {
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
+typedef struct {
+    /* section of the device in the main migration stream */
+    uint32_t section_id;
+    /* number of bytes of device state that follow */
+    uint32_t size;
+} __attribute__((packed)) MultiFDDeviceState_t;
+
+/* Device state received on a multifd channel, waiting to be loaded */
+typedef struct MultiFDRecvDeviceState {
+    uint32_t section_id;
+    uint32_t size;
+    uint8_t *data;
+    QSIMPLEQ_ENTRY(MultiFDRecvDeviceState) next;
+} MultiFDRecvDeviceState;
+
 typedef struct {
     /* number of used pages */
     uint32_t used;
@@ -571,6 +592,10 @@ typedef struct {
     int pending_job;
     /* array of pages to sent */
     MultiFDPages_t *pages;
+    /* device state to send instead of pages, freed once sent */
+    uint8_t *device_state;
+    uint32_t device_state_size;
+    uint32_t device_state_section_id;
     /* packet allocated len */
     uint32_t packet_len;
     /* pointer to the packet */
@@ -768,6 +793,12 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    if ((p->flags & MULTIFD_FLAG_DEVICE_STATE) && p->pages->used) {
+        error_setg(errp, "multifd: received device state packet "
+                   "with %d pages", p->pages->used);
+        return -1;
+    }
+
     p->packet_num = be64_to_cpu(packet->packet_num);
 
     if (p->pages->used) {
@@ -809,6 +840,8 @@ struct {
     uint64_t packet_num;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /* serializes the threads that call multifd_send_device_state() */
+    QemuMutex device_state_lock;
 } *multifd_send_state;
 
 /*
@@ -829,7 +862,7 @@ struct {
  * false.
  */
 
-static void multifd_send_pages(void)
+static int multifd_send_pages(void)
 {
     int i;
     static int next_channel;
@@ -842,6 +875,14 @@ static void multifd_send_pages(void)
         p = &multifd_send_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            /* The migration has failed, drop the pages */
+            pages->used = 0;
+            pages->block = NULL;
+            return -1;
+        }
         if (!p->pending_job) {
             p->pending_job++;
             next_channel = (i + 1) % migrate_multifd_channels();
@@ -856,10 +897,12 @@ static void multifd_send_pages(void)
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
-    ram_counters.multifd_bytes += transferred;
+    atomic_add(&ram_counters.multifd_bytes, transferred);
     ram_counters.transferred += transferred;;
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
+
+    return 1;
 }
 
 static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
@@ -881,7 +924,9 @@ static void multifd_queue_page(RAMBlock *block, ram_addr_t offset)
         }
     }
 
-    multifd_send_pages();
+    if (multifd_send_pages() < 0) {
+        return;
+    }
 
     if (pages->block != block) {
         multifd_queue_page(block, offset);
@@ -911,6 +956,8 @@ static void multifd_send_terminate_threads(Error *err)
         p->quit = true;
         qemu_sem_post(&p->sem);
         qemu_mutex_unlock(&p->mutex);
+        /* wake up whoever waits for a channel, it will see p->quit */
+        qemu_sem_post(&multifd_send_state->channels_ready);
     }
 }
 
@@ -938,12 +985,15 @@ int multifd_save_cleanup(Error **errp)
         p->name = NULL;
         multifd_pages_clear(p->pages);
         p->pages = NULL;
+        g_free(p->device_state);
+        p->device_state = NULL;
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     qemu_sem_destroy(&multifd_send_state->sem_sync);
+    qemu_mutex_destroy(&multifd_send_state->device_state_lock);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -961,7 +1011,9 @@ static void multifd_send_sync_main(void)
         return;
     }
     if (multifd_send_state->pages->used) {
-        multifd_send_pages();
+        if (multifd_send_pages() < 0) {
+            return;
+        }
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -970,6 +1022,12 @@ static void multifd_send_sync_main(void)
 
         qemu_mutex_lock(&p->mutex);
 
+        if (p->quit) {
+            error_report("%s: channel %d has already quit", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            return;
+        }
+
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
@@ -1008,8 +1066,15 @@ static void *multifd_send_thread(void *opaque)
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
             uint32_t flags = p->flags;
+            uint8_t *device_state = p->device_state;
+            MultiFDDeviceState_t ds;
 
             multifd_send_fill_packet(p);
+            if (device_state) {
+                ds.section_id = cpu_to_be32(p->device_state_section_id);
+                ds.size = cpu_to_be32(p->device_state_size);
+                p->device_state = NULL;
+            }
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
@@ -1021,9 +1086,24 @@ static void *multifd_send_thread(void *opaque)
             ret = qio_channel_write_all(p->c, (void *)p->packet,
                                         p->packet_len, &local_err);
             if (ret != 0) {
+                g_free(device_state);
                 break;
             }
 
+            if (device_state) {
+                ret = qio_channel_write_all(p->c, (void *)&ds, sizeof(ds),
+                                            &local_err);
+                if (ret == 0) {
+                    ret = qio_channel_write_all(p->c, (void *)device_state,
+                                                be32_to_cpu(ds.size),
+                                                &local_err);
+                }
+                g_free(device_state);
+                if (ret != 0) {
+                    break;
+                }
+            }
+
             ret = qio_channel_writev_all(p->c, p->pages->iov, used, &local_err);
             if (ret != 0) {
                 break;
@@ -1049,12 +1129,17 @@ static void *multifd_send_thread(void *opaque)
 out:
     if (local_err) {
         multifd_send_terminate_threads(local_err);
+        /* multifd_send_sync_main() may be waiting for this channel */
+        qemu_sem_post(&p->sem_sync);
     }
 
     qemu_mutex_lock(&p->mutex);
     p->running = false;
     qemu_mutex_unlock(&p->mutex);
 
+    /* Wake up whoever waits for a ready channel, it will see p->quit */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
     rcu_unregister_thread();
     trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
 
@@ -1098,6 +1183,7 @@ int multifd_save_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->sem_sync, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_mutex_init(&multifd_send_state->device_state_lock);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1118,6 +1204,69 @@ int multifd_save_setup(void)
     return 0;
 }
 
+/* Return true if multifd channels are available to send device state */
+bool multifd_send_device_state_ready(void)
+{
+    return migrate_use_multifd() && multifd_send_state;
+}
+
+/**
+ * multifd_send_device_state: send the state of a device on a multifd channel
+ *
+ * Waits for an idle channel and hands @data over to it; @data is freed
+ * once it has been written, or right away if it cannot be sent.  Can be
+ * called from any thread, but only after all RAM pages have been queued,
+ * i.e. while the non-iterable devices are saved at the end of precopy.
+ *
+ * Returns 0 on success, -EIO if the channels have quit or the migration
+ * has failed.
+ *
+ * @section_id: section of the device in the main migration stream
+ * @data: serialized device state
+ * @size: size of @data
+ */
+int multifd_send_device_state(uint32_t section_id, uint8_t *data,
+                              uint32_t size)
+{
+    MigrationState *s = migrate_get_current();
+    MultiFDSendParams *p = NULL;
+    int i;
+
+    qemu_mutex_lock(&multifd_send_state->device_state_lock);
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    for (i = 0;; i = (i + 1) % migrate_multifd_channels()) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit || migration_has_failed(s)) {
+            qemu_mutex_unlock(&p->mutex);
+            qemu_mutex_unlock(&multifd_send_state->device_state_lock);
+            g_free(data);
+            return -EIO;
+        }
+        if (!p->pending_job) {
+            p->pending_job++;
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    p->packet_num = multifd_send_state->packet_num++;
+    p->flags |= MULTIFD_FLAG_DEVICE_STATE;
+    p->device_state = data;
+    p->device_state_size = size;
+    p->device_state_section_id = section_id;
+    atomic_add(&ram_counters.multifd_bytes,
+               p->packet_len + sizeof(MultiFDDeviceState_t) + size);
+    qemu_mutex_unlock(&p->mutex);
+    qemu_mutex_unlock(&multifd_send_state->device_state_lock);
+
+    trace_multifd_send_device_state(p->id, section_id, size);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
 struct {
     MultiFDRecvParams *params;
     /* number of created threads */
@@ -1126,6 +1275,14 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* this mutex protects the following parameters */
+    QemuMutex device_state_lock;
+    /* signalled when device state arrives or the channels fail */
+    QemuCond device_state_cond;
+    /* device state that has not been loaded yet */
+    QSIMPLEQ_HEAD(, MultiFDRecvDeviceState) device_state;
+    /* no more device state will arrive */
+    bool device_state_quit;
 } *multifd_recv_state;
 
 static void multifd_recv_terminate_threads(Error *err)
@@ -1142,6 +1299,11 @@ static void multifd_recv_terminate_threads(Error *err)
         }
     }
 
+    qemu_mutex_lock(&multifd_recv_state->device_state_lock);
+    multifd_recv_state->device_state_quit = true;
+    qemu_cond_broadcast(&multifd_recv_state->device_state_cond);
+    qemu_mutex_unlock(&multifd_recv_state->device_state_lock);
+
     for (i = 0; i < migrate_multifd_channels(); i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
@@ -1182,6 +1344,16 @@ int multifd_load_cleanup(Error **errp)
         g_free(p->packet);
         p->packet = NULL;
     }
+    while (!QSIMPLEQ_EMPTY(&multifd_recv_state->device_state)) {
+        MultiFDRecvDeviceState *ds =
+            QSIMPLEQ_FIRST(&multifd_recv_state->device_state);
+
+        QSIMPLEQ_REMOVE_HEAD(&multifd_recv_state->device_state, next);
+        g_free(ds->data);
+        g_free(ds);
+    }
+    qemu_mutex_destroy(&multifd_recv_state->device_state_lock);
+    qemu_cond_destroy(&multifd_recv_state->device_state_cond);
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
@@ -1218,6 +1390,90 @@ static void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+static int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDDeviceState_t hdr;
+    MultiFDRecvDeviceState *ds;
+
+    if (qio_channel_read_all(p->c, (void *)&hdr, sizeof(hdr), errp)) {
+        return -1;
+    }
+
+    ds = g_new0(MultiFDRecvDeviceState, 1);
+    ds->section_id = be32_to_cpu(hdr.section_id);
+    ds->size = be32_to_cpu(hdr.size);
+    ds->data = g_try_malloc(ds->size);
+    if (ds->size && !ds->data) {
+        error_setg(errp, "multifd: cannot allocate %u bytes of device state "
+                   "for section %u", ds->size, ds->section_id);
+        g_free(ds);
+        return -1;
+    }
+    if (qio_channel_read_all(p->c, (void *)ds->data, ds->size, errp)) {
+        g_free(ds->data);
+        g_free(ds);
+        return -1;
+    }
+    trace_multifd_recv_device_state(p->id, ds->section_id, ds->size);
+
+    qemu_mutex_lock(&multifd_recv_state->device_state_lock);
+    QSIMPLEQ_INSERT_TAIL(&multifd_recv_state->device_state, ds, next);
+    qemu_cond_broadcast(&multifd_recv_state->device_state_cond);
+    qemu_mutex_unlock(&multifd_recv_state->device_state_lock);
+    return 0;
+}
+
+/**
+ * multifd_recv_device_state_wait: wait for the state of a device
+ *
+ * Returns a QEMUFile to load the state sent on a multifd channel for
+ * @section_id, or NULL if multifd is not used or its channels failed
+ * before the state arrived.
+ *
+ * @section_id: section of the device in the main migration stream
+ */
+QEMUFile *multifd_recv_device_state_wait(uint32_t section_id)
+{
+    MultiFDRecvDeviceState *ds = NULL;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+
+    if (!migrate_use_multifd() || !multifd_recv_state) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&multifd_recv_state->device_state_lock);
+    while (true) {
+        QSIMPLEQ_FOREACH(ds, &multifd_recv_state->device_state, next) {
+            if (ds->section_id == section_id) {
+                break;
+            }
+        }
+        if (ds || multifd_recv_state->device_state_quit) {
+            break;
+        }
+        qemu_cond_wait(&multifd_recv_state->device_state_cond,
+                       &multifd_recv_state->device_state_lock);
+    }
+    if (ds) {
+        QSIMPLEQ_REMOVE(&multifd_recv_state->device_state, ds,
+                        MultiFDRecvDeviceState, next);
+    }
+    qemu_mutex_unlock(&multifd_recv_state->device_state_lock);
+
+    if (!ds) {
+        return NULL;
+    }
+
+    bioc = qio_channel_buffer_new(0);
+    bioc->data = ds->data;
+    bioc->capacity = bioc->usage = ds->size;
+    f = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+    g_free(ds);
+    return f;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1259,6 +1515,13 @@ static void *multifd_recv_thread(void *opaque)
             break;
         }
 
+        if (flags & MULTIFD_FLAG_DEVICE_STATE) {
+            ret = multifd_recv_device_state(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1292,6 +1555,9 @@ int multifd_load_setup(void)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_mutex_init(&multifd_recv_state->device_state_lock);
+    qemu_cond_init(&multifd_recv_state->device_state_cond);
+    QSIMPLEQ_INIT(&multifd_recv_state->device_state);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
@@ -1430,8 +1696,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) > 0) {
+        xbzrle_counters.cache_evictions++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -1454,17 +1722,21 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
-    int encoded_len = 0, bytes_xbzrle;
+    int encoded_len = 0, bytes_xbzrle, ret;
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret > 0) {
+                    xbzrle_counters.cache_evictions++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -1472,6 +1744,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         }
         return -1;
     }
+    xbzrle_counters.cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -1603,9 +1876,15 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     }
 
     if (migrate_use_xbzrle()) {
-        xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
-            rs->xbzrle_cache_miss_prev) / iter_count;
+        uint64_t misses = xbzrle_counters.cache_miss -
+                          rs->xbzrle_cache_miss_prev;
+        uint64_t hits = xbzrle_counters.cache_hit - rs->xbzrle_cache_hit_prev;
+
+        xbzrle_counters.cache_miss_rate = (double)misses / iter_count;
+        xbzrle_counters.cache_hit_rate = hits + misses ?
+                                         (double)hits / (hits + misses) : 0;
         rs->xbzrle_cache_miss_prev = xbzrle_counters.cache_miss;
+        rs->xbzrle_cache_hit_prev = xbzrle_counters.cache_hit;
     }
 }
 
@@ -47,6 +47,10 @@ int multifd_load_setup(void);
 int multifd_load_cleanup(Error **errp);
 bool multifd_recv_all_channels_created(void);
 bool multifd_recv_new_channel(QIOChannel *ioc);
+bool multifd_send_device_state_ready(void);
+int multifd_send_device_state(uint32_t section_id, uint8_t *data,
+                              uint32_t size);
+QEMUFile *multifd_recv_device_state_wait(uint32_t section_id);
 
 uint64_t ram_pagesize_summary(void);
 int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len);
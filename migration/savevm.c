@@ -35,6 +35,7 @@
 #include "migration/misc.h"
 #include "migration/register.h"
 #include "migration/global_state.h"
+#include "migration/colo.h"
 #include "ram.h"
 #include "qemu-file-channel.h"
 #include "qemu-file.h"
@@ -787,7 +788,8 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
 }
 
 /*
- * Write the header for device section (QEMU_VM_SECTION START/END/PART/FULL)
+ * Write the header for device section
+ * (QEMU_VM_SECTION START/END/PART/FULL/MULTIFD)
  */
 static void save_section_header(QEMUFile *f, SaveStateEntry *se,
                                 uint8_t section_type)
@@ -796,7 +798,8 @@ static void save_section_header(QEMUFile *f, SaveStateEntry *se,
     qemu_put_be32(f, se->section_id);
 
     if (section_type == QEMU_VM_SECTION_FULL ||
-        section_type == QEMU_VM_SECTION_START) {
+        section_type == QEMU_VM_SECTION_START ||
+        section_type == QEMU_VM_SECTION_MULTIFD) {
         /* ID string */
         size_t len = strlen(se->idstr);
         qemu_put_byte(f, len);
@@ -1164,9 +1167,147 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * Device state that opted into parallel saving is serialized by worker
+ * threads, while the main thread saves the other devices, and sent on the
+ * multifd channels.  The main stream only gets a QEMU_VM_SECTION_MULTIFD
+ * header at the position the device would have had, so the destination
+ * still loads the devices in the same order.
+ */
+typedef struct SaveStateJob {
+    SaveStateEntry *se;
+    QEMUFile *f;
+    QIOChannelBuffer *bioc;
+    QJSON *vmdesc;
+    int ret;
+    QemuEvent done;
+} SaveStateJob;
+
+typedef struct SaveStateJobs {
+    SaveStateJob *jobs;
+    int num_jobs;
+    int next_job;
+    int num_threads;
+    QemuThread *threads;
+} SaveStateJobs;
+
+static bool savevm_parallel_save_needed(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->parallel_save &&
+           vmstate_save_needed(se->vmsd, se->opaque);
+}
+
+static void *savevm_parallel_save_thread(void *opaque)
+{
+    SaveStateJobs *sj = opaque;
+    int i;
+
+    rcu_register_thread();
+
+    while ((i = atomic_fetch_inc(&sj->next_job)) < sj->num_jobs) {
+        SaveStateJob *job = &sj->jobs[i];
+
+        trace_savevm_parallel_save(job->se->idstr, job->se->section_id);
+        job->ret = vmstate_save_state(job->f, job->se->vmsd,
+                                      job->se->opaque, job->vmdesc);
+        qemu_fflush(job->f);
+        if (!job->ret) {
+            job->ret = qemu_file_get_error(job->f);
+        }
+        if (!job->ret) {
+            /* The channel frees the data, so take it from the buffer */
+            job->ret = multifd_send_device_state(job->se->section_id,
+                                                 job->bioc->data,
+                                                 job->bioc->usage);
+            job->bioc->data = NULL;
+            job->bioc->capacity = job->bioc->usage = job->bioc->offset = 0;
+        }
+        qemu_event_set(&job->done);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void savevm_parallel_save_start(SaveStateJobs *sj)
+{
+    SaveStateEntry *se;
+    int i;
+
+    memset(sj, 0, sizeof(*sj));
+    if (!multifd_send_device_state_ready() || migration_in_postcopy() ||
+        migration_in_colo_state()) {
+        return;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (savevm_parallel_save_needed(se)) {
+            sj->num_jobs++;
+        }
+    }
+    if (!sj->num_jobs) {
+        return;
+    }
+
+    sj->jobs = g_new0(SaveStateJob, sj->num_jobs);
+    i = 0;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveStateJob *job;
+
+        if (!savevm_parallel_save_needed(se)) {
+            continue;
+        }
+        job = &sj->jobs[i++];
+        job->se = se;
+        job->bioc = qio_channel_buffer_new(4096);
+        job->f = qemu_fopen_channel_output(QIO_CHANNEL(job->bioc));
+        object_unref(OBJECT(job->bioc));
+        job->vmdesc = qjson_new();
+        qemu_event_init(&job->done, false);
+    }
+
+    sj->num_threads = MIN(migrate_multifd_channels(), sj->num_jobs);
+    sj->threads = g_new0(QemuThread, sj->num_threads);
+    for (i = 0; i < sj->num_threads; i++) {
+        qemu_thread_create(&sj->threads[i], "savevm/parallel",
+                           savevm_parallel_save_thread, sj,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static SaveStateJob *savevm_parallel_save_find(SaveStateJobs *sj,
+                                               SaveStateEntry *se)
+{
+    int i;
+
+    for (i = 0; i < sj->num_jobs; i++) {
+        if (sj->jobs[i].se == se) {
+            return &sj->jobs[i];
+        }
+    }
+    return NULL;
+}
+
+static void savevm_parallel_save_finish(SaveStateJobs *sj)
+{
+    int i;
+
+    for (i = 0; i < sj->num_threads; i++) {
+        qemu_thread_join(&sj->threads[i]);
+    }
+    for (i = 0; i < sj->num_jobs; i++) {
+        qemu_fclose(sj->jobs[i].f);
+        qjson_destroy(sj->jobs[i].vmdesc);
+        qemu_event_destroy(&sj->jobs[i].done);
+    }
+    g_free(sj->threads);
+    g_free(sj->jobs);
+}
+
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
                                        bool inactivate_disks)
 {
+    SaveStateJobs parallel_jobs;
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
@@ -1208,15 +1349,19 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         return 0;
     }
 
+    savevm_parallel_save_start(&parallel_jobs);
+
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", qemu_target_page_size());
     json_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveStateJob *job;
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
-        if (se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
+        job = savevm_parallel_save_find(&parallel_jobs, se);
+        if (!job && se->vmsd && !vmstate_save_needed(se->vmsd, se->opaque)) {
             trace_savevm_section_skip(se->idstr, se->section_id);
             continue;
         }
@@ -1227,10 +1372,19 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
-        save_section_header(f, se, QEMU_VM_SECTION_FULL);
-        ret = vmstate_save(f, se, vmdesc);
+        if (job) {
+            save_section_header(f, se, QEMU_VM_SECTION_MULTIFD);
+            qemu_event_wait(&job->done);
+            ret = job->ret;
+            json_append(vmdesc, job->vmdesc);
+        } else {
+            save_section_header(f, se, QEMU_VM_SECTION_FULL);
+            ret = vmstate_save(f, se, vmdesc);
+        }
         if (ret) {
             qemu_file_set_error(f, ret);
+            savevm_parallel_save_finish(&parallel_jobs);
+            qjson_destroy(vmdesc);
             return ret;
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
@@ -1238,6 +1392,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
 
         json_end_object(vmdesc);
     }
+    savevm_parallel_save_finish(&parallel_jobs);
 
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
@@ -2049,7 +2204,8 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
 }
 
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               uint8_t section_type)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2098,7 +2254,20 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
-    ret = vmstate_load(f, se);
+    if (section_type == QEMU_VM_SECTION_MULTIFD) {
+        /* The state itself was sent on one of the multifd channels */
+        QEMUFile *df = multifd_recv_device_state_wait(section_id);
+
+        if (!df) {
+            error_report("Missing multifd device state for section %u '%s'",
+                         section_id, idstr);
+            return -EINVAL;
+        }
+        ret = vmstate_load(df, se);
+        qemu_fclose(df);
+    } else {
+        ret = vmstate_load(f, se);
+    }
     if (ret < 0) {
         error_report("error while loading state for instance 0x%x of"
                      " device '%s'", instance_id, idstr);
@@ -2245,7 +2414,8 @@ retry:
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+        case QEMU_VM_SECTION_MULTIFD:
+            ret = qemu_loadvm_section_start_full(f, mis, section_type);
             if (ret < 0) {
                 goto out;
             }
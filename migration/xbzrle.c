@@ -12,8 +12,339 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
+/*
+ * Run scanners.  zrun_len_*() returns the number of leading bytes that are
+ * the same in @old_buf and @new_buf, nzrun_len_*() the number of leading
+ * bytes that differ; both look at no more than @len bytes.  The buffers
+ * must be aligned to sizeof(long) at their end, i.e. the caller passes
+ * a suffix of a long-aligned buffer whose size is a multiple of
+ * sizeof(long).
+ */
+static int zrun_lenint(const uint8_t *old_buf, const uint8_t *new_buf,
+                        int len)
+{
+    /* not aligned to sizeof(long) */
+    int res = len % sizeof(long);
+    int i = 0;
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < len &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < len && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+
+    return i;
+}
+
+static int nzrun_lenint(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int len)
+{
+    /* not aligned to sizeof(long) */
+    int res = len % sizeof(long);
+    int i = 0;
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < len) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+
+    return i;
+}
+
+typedef int (*xbzrle_scan_fn)(const uint8_t *, const uint8_t *, int);
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* The vector scanners compare one vector at a time and leave the final
+ * partial vector to the word-at-a-time code.
+ */
+static int zrun_lensse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int len)
+{
+    int i = 0;
+
+    while (i + 16 <= len) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (mask != 0xffff) {
+            return i + ctz32(~mask);
+        }
+        i += 16;
+    }
+
+    return i + zrun_lenint(old_buf + i, new_buf + i, len - i);
+}
+
+static int nzrun_lensse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int len)
+{
+    int i = 0;
+
+    while (i + 16 <= len) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 16;
+    }
+
+    return i + nzrun_lenint(old_buf + i, new_buf + i, len - i);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/* Note that due to restrictions/bugs wrt __builtin functions in gcc <= 4.8,
+ * the includes have to be within the corresponding push_options region, and
+ * therefore the regions themselves have to be ordered with increasing ISA.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int zrun_lenavx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int len)
+{
+    int i = 0;
+
+    while (i + 32 <= len) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (mask != UINT32_MAX) {
+            return i + ctz32(~mask);
+        }
+        i += 32;
+    }
+
+    return i + zrun_lenint(old_buf + i, new_buf + i, len - i);
+}
+
+static int nzrun_lenavx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int len)
+{
+    int i = 0;
+
+    while (i + 32 <= len) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+        i += 32;
+    }
+
+    return i + nzrun_lenint(old_buf + i, new_buf + i, len - i);
+}
+#pragma GCC pop_options
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int zrun_lenavx512bw(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int len)
+{
+    int i = 0;
+
+    while (i + 64 <= len) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (mask != UINT64_MAX) {
+            return i + ctz64(~mask);
+        }
+        i += 64;
+    }
+
+    return i + zrun_lenint(old_buf + i, new_buf + i, len - i);
+}
+
+static int nzrun_lenavx512bw(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int len)
+{
+    int i = 0;
+
+    while (i + 64 <= len) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (mask) {
+            return i + ctz64(mask);
+        }
+        i += 64;
+    }
+
+    return i + nzrun_lenint(old_buf + i, new_buf + i, len - i);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW  1
+#define CACHE_AVX2      2
+#define CACHE_SSE2      4
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ZRUN  zrun_lenint
+# define INIT_NZRUN nzrun_lenint
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ZRUN  zrun_lensse2
+# define INIT_NZRUN nzrun_lensse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static xbzrle_scan_fn zrun_accel = INIT_ZRUN;
+static xbzrle_scan_fn nzrun_accel = INIT_NZRUN;
+
+static void init_accel(unsigned cache)
+{
+    xbzrle_scan_fn zrun_fn = zrun_lenint;
+    xbzrle_scan_fn nzrun_fn = nzrun_lenint;
+
+    if (cache & CACHE_SSE2) {
+        zrun_fn = zrun_lensse2;
+        nzrun_fn = nzrun_lensse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        zrun_fn = zrun_lenavx2;
+        nzrun_fn = nzrun_lenavx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        zrun_fn = zrun_lenavx512bw;
+        nzrun_fn = nzrun_lenavx512bw;
+    }
+#endif
+    zrun_accel = zrun_fn;
+    nzrun_accel = nzrun_fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* The OS must also save the opmask and ZMM state.  */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested the integer scanners, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define zrun_accel   zrun_lenint
+#define nzrun_accel  nzrun_lenint
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -27,10 +358,8 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
+    uint32_t zrun_len, nzrun_len;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -41,28 +370,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = zrun_accel(old_buf + i, new_buf + i, slen - i);
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,51 +385,21 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = nzrun_accel(old_buf + i, new_buf + i, slen - i);
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i += nzrun_len;
     }
 
     return d;
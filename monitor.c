@@ -2030,6 +2030,11 @@ static void hmp_info_mtree(Monitor *mon, const QDict *qdict)
                owner);
 }
 
+static void hmp_info_mtree_bql(Monitor *mon, const QDict *qdict)
+{
+    mtree_info_bql((fprintf_function)monitor_printf, mon);
+}
+
 static void hmp_info_numa(Monitor *mon, const QDict *qdict)
 {
     int i;
@@ -66,6 +66,7 @@ enum {
     OPTION_SIZE = 264,
     OPTION_PREALLOCATION = 265,
     OPTION_SHRINK = 266,
+    OPTION_RANDOM = 267,
 };
 
 typedef enum OutputFormat {
@@ -3963,6 +3964,7 @@ typedef struct BenchData {
     int n;
     int flush_interval;
     bool drain_on_flush;
+    bool random;
     uint8_t *buf;
     QEMUIOVector *qiov;
 
@@ -4030,8 +4032,16 @@ static void bench_cb(void *opaque, int ret)
          * and b->offset is ready for the next submission.
          */
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
+        if (b->random) {
+            /* Pick the next request uniformly among the whole buffers that
+             * fit into the image */
+            uint64_t rnd = ((uint64_t)g_random_int() << 32) | g_random_int();
+
+            b->offset = rnd % (b->image_size / b->bufsize) * b->bufsize;
+        } else {
+            b->offset += b->step;
+            b->offset %= b->image_size;
+        }
         if (b->write) {
             acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
         } else {
@@ -4059,6 +4069,7 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    bool random = false;
     int64_t image_size;
     BlockBackend *blk = NULL;
     BenchData data = {};
@@ -4076,6 +4087,7 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
@@ -4201,6 +4213,9 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            random = true;
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -4236,6 +4251,17 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
+    if (random && (offset || step)) {
+        error_report("--random can't be combined with an offset or step size");
+        ret = -1;
+        goto out;
+    }
+    if (random && image_size < bufsize) {
+        error_report("Image is smaller than the buffer size");
+        ret = -1;
+        goto out;
+    }
+
     data = (BenchData) {
         .blk            = blk,
         .image_size     = image_size,
@@ -4247,11 +4273,19 @@ static int img_bench(int argc, char **argv)
         .write          = is_write,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
+        .random         = random,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
+    if (random) {
+        printf("Sending %d random %s requests, %d bytes each, "
+               "%d in parallel\n",
+               data.n, data.write ? "write" : "read", data.bufsize,
+               data.nrreq);
+    } else {
+        printf("Sending %d %s requests, %d bytes each, %d in parallel "
+               "(starting at offset %" PRId64 ", step size %d)\n",
+               data.n, data.write ? "write" : "read", data.bufsize,
+               data.nrreq, data.offset, data.step);
+    }
     if (flush_interval) {
         printf("Sending flush every %d requests\n", flush_interval);
     }
@@ -1007,6 +1007,15 @@ int main(int argc, char **argv)
         }
     }
 
+    /*
+     * All connections share one BlockBackend, so they see each other's
+     * writes and a flush covers all of them.  Only tell clients that they
+     * may open several connections if we are going to accept them.
+     */
+    if (shared > 1) {
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
+
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          writethrough, NULL, &local_err);
     if (!exp) {
@@ -27,8 +27,7 @@ def dump_aiocontext(context, verbose):
         gdb.write('----\n%s\n' % entry)
         if verbose and cur['io_read'] == sym_fd_coroutine_enter:
             coptr = (cur['opaque'].cast(gdb.lookup_type('FDYieldUntilData').pointer()))['co']
-            coptr = coptr.cast(gdb.lookup_type('CoroutineUContext').pointer())
-            coroutine.bt_jmpbuf(coptr['env']['__jmpbuf'])
+            coroutine.bt_regs(coroutine.get_coroutine_regs(coptr))
         cur = cur['node']['le_next'];
 
     gdb.write('----\n')
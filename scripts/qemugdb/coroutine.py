@@ -69,9 +69,20 @@ def get_jmpbuf_regs(jmpbuf):
         'r15': jmpbuf[JB_R15],
         'rip': glibc_ptr_demangle(jmpbuf[JB_PC], pointer_guard) }
 
-def bt_jmpbuf(jmpbuf):
-    '''Backtrace a jmpbuf'''
-    regs = get_jmpbuf_regs(jmpbuf)
+def get_asm_frame_regs(sp):
+    '''Registers pushed by coroutine_asm_switch on x86_64'''
+    frame = sp.cast(gdb.lookup_type('uint64_t').pointer())
+    return {'r15': frame[0],
+        'r14': frame[1],
+        'r13': frame[2],
+        'r12': frame[3],
+        'rbx': frame[4],
+        'rbp': frame[5],
+        'rip': frame[6],
+        'rsp': gdb.parse_and_eval('(uint64_t)%s + 56' % sp) }
+
+def bt_regs(regs):
+    '''Backtrace a set of saved registers'''
     old = dict()
 
     for i in regs:
@@ -89,6 +100,14 @@ def coroutine_to_jmpbuf(co):
     coroutine_pointer = co.cast(gdb.lookup_type('CoroutineUContext').pointer())
     return coroutine_pointer['env']['__jmpbuf']
 
+def get_coroutine_regs(co):
+    try:
+        coroutine_type = gdb.lookup_type('CoroutineAsm')
+    except gdb.error:
+        return get_jmpbuf_regs(coroutine_to_jmpbuf(co))
+
+    return get_asm_frame_regs(co.cast(coroutine_type.pointer())['sp'])
+
 
 class CoroutineCommand(gdb.Command):
     '''Display coroutine backtrace'''
@@ -102,18 +121,18 @@ class CoroutineCommand(gdb.Command):
             gdb.write('usage: qemu coroutine <coroutine-pointer>\n')
             return
 
-        bt_jmpbuf(coroutine_to_jmpbuf(gdb.parse_and_eval(argv[0])))
+        bt_regs(get_coroutine_regs(gdb.parse_and_eval(argv[0])))
 
 class CoroutineSPFunction(gdb.Function):
     def __init__(self):
         gdb.Function.__init__(self, 'qemu_coroutine_sp')
 
     def invoke(self, addr):
-        return get_jmpbuf_regs(coroutine_to_jmpbuf(addr))['rsp'].cast(VOID_PTR)
+        return get_coroutine_regs(addr)['rsp'].cast(VOID_PTR)
 
 class CoroutinePCFunction(gdb.Function):
     def __init__(self):
         gdb.Function.__init__(self, 'qemu_coroutine_pc')
 
     def invoke(self, addr):
-        return get_jmpbuf_regs(coroutine_to_jmpbuf(addr))['rip'].cast(VOID_PTR)
+        return get_coroutine_regs(addr)['rip'].cast(VOID_PTR)
@@ -0,0 +1,184 @@
+#!/usr/bin/env python
+#
+# Pretty-printer for ring trace backend binary trace files
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# For help see docs/devel/tracing.txt
+
+from __future__ import print_function
+import bisect
+import struct
+import simpletrace
+from tracetool import read_events, Event
+from tracetool.backend.simple import is_string
+
+header_magic = 0x474e4952554d4551
+header_version = 1
+pad_event_id = 0xffffffff
+
+chunk_type_mapping = 0
+chunk_type_clock = 1
+chunk_type_events = 2
+
+file_header_fmt = '=QII'
+chunk_header_fmt = '=II'
+clock_fmt = '=QQ'
+events_header_fmt = '=IIQ'
+rec_header_fmt = '=IIQ'
+
+def read_trace_header(fobj):
+    """Read and verify trace file header"""
+    header = simpletrace.read_header(fobj, file_header_fmt)
+    if header is None:
+        raise ValueError('Not a valid trace file!')
+    if header[0] != header_magic:
+        raise ValueError('Not a valid ring trace file, header magic %d != %d' %
+                         (header[0], header_magic))
+    if header[1] != header_version:
+        raise ValueError('Ring trace format %d not supported with this QEMU '
+                         'release!' % header[1])
+
+def get_record(edict, idtoname, tid, data, off):
+    """Deserialize a trace record at data[off:] into a tuple
+       (name, ticks, tid, arg1, ..., argN)."""
+    (event_id, length, ticks) = struct.unpack_from(rec_header_fmt, data, off)
+    name = idtoname[event_id]
+    rec = (name, ticks, tid)
+    try:
+        event = edict[name]
+    except KeyError as e:
+        import sys
+        sys.stderr.write('%s event is logged but is not declared ' \
+                         'in the trace events file, try using ' \
+                         'trace-events-all instead.\n' % str(e))
+        sys.exit(1)
+
+    off += struct.calcsize(rec_header_fmt)
+    for type, name in event.args:
+        if is_string(type):
+            (len,) = struct.unpack_from('=L', data, off)
+            rec = rec + (data[off + 4:off + 4 + len],)
+            off += 4 + len
+        else:
+            (value,) = struct.unpack_from('=Q', data, off)
+            rec = rec + (value,)
+            off += 8
+    return rec
+
+def read_trace_records(edict, idtoname, fobj):
+    """Deserialize trace records from a file, returning a list of record
+    tuples (name, timestamp, tid, arg1, ..., argN) sorted by timestamp.
+
+    Each thread has its own buffer in QEMU, so the file has to be read
+    completely before records can be put in order.  Timestamps are
+    converted from host ticks to nanoseconds using the clock records
+    in the file.
+
+    Note that `idtoname` is modified by the mapping records in the file.
+
+    Args:
+        edict (str -> Event): events dict, indexed by name
+        idtoname (int -> str): event names dict, indexed by event ID
+        fobj (file): input file
+
+    """
+    records = []
+    clocks = []
+    rec_header_len = struct.calcsize(rec_header_fmt)
+    events_header_len = struct.calcsize(events_header_fmt)
+
+    while True:
+        chunk = simpletrace.read_header(fobj, chunk_header_fmt)
+        if chunk is None:
+            break
+
+        (chunk_type, length) = chunk
+        data = fobj.read(length)
+        if chunk_type == chunk_type_mapping:
+            (event_id,) = struct.unpack_from('=I', data)
+            idtoname[event_id] = data[4:].decode()
+        elif chunk_type == chunk_type_clock:
+            clocks.append(struct.unpack(clock_fmt, data))
+        elif chunk_type == chunk_type_events:
+            (tid, _, dropped) = struct.unpack_from(events_header_fmt, data)
+            if dropped:
+                records.append(("dropped", clocks[-1][0], tid, dropped))
+            off = events_header_len
+            while off + rec_header_len <= length:
+                (event_id, reclen, _) = struct.unpack_from(rec_header_fmt,
+                                                           data, off)
+                if event_id != pad_event_id:
+                    records.append(get_record(edict, idtoname, tid,
+                                              data, off))
+                off += reclen
+
+    to_ns = ticks_to_ns(clocks)
+    records.sort(key=lambda rec: rec[1])
+    return [(rec[0], to_ns(rec[1])) + rec[2:] for rec in records]
+
+def ticks_to_ns(clocks):
+    """Return a function that converts host ticks to nanoseconds.
+
+    The tick rate can drift, so interpolate between the two clock records
+    around each timestamp instead of using a single rate for the whole
+    file.  Timestamps outside the recorded range use the nearest pair.
+
+    Args:
+        clocks (list of (ticks, ns)): clock records from the file
+
+    """
+    clocks = sorted(set(clocks))
+    ticks = [c[0] for c in clocks]
+
+    def convert(t):
+        i = max(0, min(bisect.bisect_right(ticks, t) - 1, len(clocks) - 2))
+        (ticks0, ns0) = clocks[i]
+        (ticks1, ns1) = clocks[min(i + 1, len(clocks) - 1)]
+        scale = 1.0
+        if ticks1 != ticks0:
+            scale = float(ns1 - ns0) / (ticks1 - ticks0)
+        return ns0 + int((t - ticks0) * scale)
+
+    return convert
+
+def process(events, log, analyzer):
+    """Invoke an analyzer on each event in a log."""
+    if isinstance(events, str):
+        events = read_events(open(events, 'r'), events)
+    if isinstance(log, str):
+        log = open(log, 'rb')
+
+    read_trace_header(log)
+
+    dropped_event = Event.build("Dropped_Event(uint64_t num_events_dropped)")
+    edict = {"dropped": dropped_event}
+    idtoname = {}
+
+    for event in events:
+        edict[event.name] = event
+
+    simpletrace.process_records(edict,
+                                read_trace_records(edict, idtoname, log),
+                                analyzer)
+
+def run(analyzer):
+    """Execute an analyzer on a trace file given on the command-line.
+
+    The pid field passed to the analyzer holds the thread id."""
+    import sys
+
+    if len(sys.argv) != 3:
+        sys.stderr.write('usage: %s <trace-events> <trace-file>\n' %
+                         sys.argv[0])
+        sys.exit(1)
+
+    events = read_events(open(sys.argv[1], 'r'), sys.argv[1])
+    process(events, sys.argv[2], analyzer)
+
+class Formatter(simpletrace.Formatter):
+    id_name = 'tid'
+
+if __name__ == '__main__':
+    run(Formatter())
@@ -188,6 +188,17 @@ def process(events, log, analyzer, read_header=True):
         for event_id, event in enumerate(events):
             idtoname[event_id] = event.name
 
+    process_records(edict, read_trace_records(edict, idtoname, log), analyzer)
+
+def process_records(edict, records, analyzer):
+    """Invoke an analyzer on each record tuple (name, timestamp, pid, arg1, ...).
+
+    Args:
+        edict (str -> Event): events dict, indexed by name
+        records (iterable): trace records, e.g. from read_trace_records()
+        analyzer (Analyzer): the analyzer to run
+
+    """
     def build_fn(analyzer, event):
         if isinstance(event, str):
             return analyzer.catchall
@@ -210,7 +221,7 @@ def process(events, log, analyzer, read_header=True):
 
     analyzer.begin()
     fn_cache = {}
-    for rec in read_trace_records(edict, idtoname, log):
+    for rec in records:
         event_num = rec[0]
         event = edict[event_num]
         if event_num not in fn_cache:
@@ -218,6 +229,32 @@ def process(events, log, analyzer, read_header=True):
         fn_cache[event_num](event, rec)
     analyzer.end()
 
+class Formatter(Analyzer):
+    """Print each trace record on a line of its own."""
+
+    id_name = 'pid'
+
+    def __init__(self):
+        self.last_timestamp = None
+
+    def catchall(self, event, rec):
+        timestamp = rec[1]
+        if self.last_timestamp is None:
+            self.last_timestamp = timestamp
+        delta_ns = timestamp - self.last_timestamp
+        self.last_timestamp = timestamp
+
+        fields = [event.name, '%0.3f' % (delta_ns / 1000.0),
+                  '%s=%d' % (self.id_name, rec[2])]
+        i = 3
+        for type, name in event.args:
+            if is_string(type):
+                fields.append('%s=%s' % (name, rec[i]))
+            else:
+                fields.append('%s=0x%x' % (name, rec[i]))
+            i += 1
+        print(' '.join(fields))
+
 def run(analyzer):
     """Execute an analyzer on a trace file given on the command-line.
 
@@ -238,26 +275,4 @@ def run(analyzer):
     process(events, sys.argv[2], analyzer, read_header=read_header)
 
 if __name__ == '__main__':
-    class Formatter(Analyzer):
-        def __init__(self):
-            self.last_timestamp = None
-
-        def catchall(self, event, rec):
-            timestamp = rec[1]
-            if self.last_timestamp is None:
-                self.last_timestamp = timestamp
-            delta_ns = timestamp - self.last_timestamp
-            self.last_timestamp = timestamp
-
-            fields = [event.name, '%0.3f' % (delta_ns / 1000.0),
-                      'pid=%d' % rec[2]]
-            i = 3
-            for type, name in event.args:
-                if is_string(type):
-                    fields.append('%s=%s' % (name, rec[i]))
-                else:
-                    fields.append('%s=0x%x' % (name, rec[i]))
-                i += 1
-            print(' '.join(fields))
-
     run(Formatter())
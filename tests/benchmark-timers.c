@@ -0,0 +1,152 @@
+/*
+ * QEMUTimerList speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+
+static const int nr_timers[] = { 100, 1000, 10000 };
+
+static QEMUTimerList *timer_list;
+static unsigned long fired;
+
+static void notify_cb(void *opaque, QEMUClockType type)
+{
+}
+
+static void timer_cb(void *opaque)
+{
+    fired++;
+}
+
+static QEMUTimer *timers_new(int n)
+{
+    QEMUTimer *timers = g_new0(QEMUTimer, n);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        timer_init_tl(&timers[i], timer_list, SCALE_NS, timer_cb, NULL);
+    }
+    return timers;
+}
+
+static void timers_free(QEMUTimer *timers, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        timer_del(&timers[i]);
+        timer_deinit(&timers[i]);
+    }
+    g_free(timers);
+}
+
+static void bench_report(const char *name, int n, double ops)
+{
+    g_print("%-8s %6d timers: %.0f ops in %.2f secs: %.2f Mops/sec\n",
+            name, n, ops, g_test_timer_last(), ops / g_test_timer_last() / 1e6);
+}
+
+/* Arm every timer with a random far-away deadline, then cancel them all */
+static void bench_arm_cancel(int n)
+{
+    QEMUTimer *timers = timers_new(n);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    double ops = 0;
+    int i;
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < n; i++) {
+            timer_mod_ns(&timers[i], now + NANOSECONDS_PER_SECOND * 3600 +
+                         g_test_rand_int_range(0, INT32_MAX));
+        }
+        g_assert(timerlist_deadline_ns(timer_list) > 0);
+        for (i = 0; i < n; i++) {
+            timer_del(&timers[i]);
+        }
+        ops += 2 * n;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    bench_report("arm/del", n, ops);
+    timers_free(timers, n);
+}
+
+/* Keep all timers pending and move them around, as periodic timers do */
+static void bench_rearm(int n)
+{
+    QEMUTimer *timers = timers_new(n);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    double ops = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        timer_mod_ns(&timers[i], now + NANOSECONDS_PER_SECOND * 3600 +
+                     g_test_rand_int_range(0, INT32_MAX));
+    }
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < n; i++) {
+            timer_mod_ns(&timers[i], now + NANOSECONDS_PER_SECOND * 3600 +
+                         g_test_rand_int_range(0, INT32_MAX));
+            timerlist_deadline_ns(timer_list);
+        }
+        ops += n;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    bench_report("rearm", n, ops);
+    timers_free(timers, n);
+}
+
+/* Arm every timer in the past and let timerlist_run_timers() expire them */
+static void bench_expire(int n)
+{
+    QEMUTimer *timers = timers_new(n);
+    double ops = 0;
+    int64_t now;
+    int i;
+
+    g_test_timer_start();
+    do {
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        for (i = 0; i < n; i++) {
+            timer_mod_ns(&timers[i], now - g_test_rand_int_range(0, INT32_MAX));
+        }
+        fired = 0;
+        timerlist_run_timers(timer_list);
+        g_assert_cmpint(fired, ==, n);
+        ops += n;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    bench_report("expire", n, ops);
+    timers_free(timers, n);
+}
+
+static void test_timers_speed(void)
+{
+    size_t i;
+
+    timer_list = timerlist_new(QEMU_CLOCK_REALTIME, notify_cb, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(nr_timers); i++) {
+        bench_arm_cancel(nr_timers[i]);
+        bench_rearm(nr_timers[i]);
+        bench_expire(nr_timers[i]);
+    }
+
+    timerlist_free(timer_list);
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks(NULL);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/timers/speed", test_timers_speed);
+
+    return g_test_run();
+}
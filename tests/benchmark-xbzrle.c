@@ -0,0 +1,89 @@
+/*
+ * XBZRLE encoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/cutils.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES 256
+
+typedef struct XbzrleBenchPattern {
+    const char *name;
+    /* Bytes dirtied every @stride bytes of a page */
+    int run;
+    int stride;
+} XbzrleBenchPattern;
+
+static const XbzrleBenchPattern patterns[] = {
+    { "unchanged", 0, PAGE_SIZE },
+    { "one-word", 8, PAGE_SIZE },
+    { "sparse", 8, 512 },
+    { "runs", 64, 256 },
+    { "dense", 1, 2 },
+};
+
+static void bench_encode(const XbzrleBenchPattern *pattern)
+{
+    uint8_t *old_buf = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    double total = 0.0;
+    int i, j;
+
+    for (i = 0; i < NR_PAGES * PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, NR_PAGES * PAGE_SIZE);
+    for (i = 0; i < NR_PAGES * PAGE_SIZE; i += pattern->stride) {
+        for (j = 0; j < pattern->run; j++) {
+            new_buf[i + j] = ~old_buf[i + j];
+        }
+    }
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                 new_buf + i * PAGE_SIZE,
+                                 PAGE_SIZE, dst, PAGE_SIZE);
+        }
+        total += NR_PAGES * PAGE_SIZE;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    total /= MiB;
+    g_print("%-10s ", pattern->name);
+    g_print("done: %.2f MB in %.2f secs: ", total, g_test_timer_last());
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(dst);
+}
+
+static void test_encode_speed(void)
+{
+    int accel = 0;
+    size_t i;
+
+    /* Walk through the available scanners, most preferred first */
+    do {
+        g_print("\nxbzrle encode, accelerator #%d:\n", accel++);
+        for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+            bench_encode(&patterns[i]);
+        }
+    } while (test_xbzrle_encode_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/encode/speed", test_encode_speed);
+
+    return g_test_run();
+}
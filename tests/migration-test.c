@@ -730,6 +730,127 @@ static void test_precopy_unix(void)
     g_free(uri);
 }
 
+/*
+ * Device state that opts into parallel saving (e.g. the VGA of the x86
+ * guest) is sent on the multifd channels at switchover.
+ */
+static void test_multifd_unix(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, false)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter(from, "x-multifd-channels", 2);
+    migrate_set_parameter(to, "x-multifd-channels", 2);
+    migrate_set_capability(from, "x-multifd", true);
+    migrate_set_capability(to, "x-multifd", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+/*
+ * Note: caller is responsible to free the returned object via
+ * qobject_unref() after use
+ */
+static QDict *wait_for_dirty_rate(QTestState *who)
+{
+    QDict *rsp_return;
+
+    while (true) {
+        rsp_return = wait_command(who, "{ 'execute': 'query-dirty-rate' }");
+        if (!strcmp(qdict_get_str(rsp_return, "status"), "measured")) {
+            return rsp_return;
+        }
+        qobject_unref(rsp_return);
+        usleep(1000 * 100);
+    }
+}
+
+static void test_dirty_rate(void)
+{
+    QTestState *from, *to;
+    QDict *rsp, *rsp_return;
+    int64_t now = g_get_real_time() / G_USEC_PER_SEC;
+
+    if (test_migrate_start(&from, &to, "tcp:0:0", false)) {
+        return;
+    }
+
+    rsp_return = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+    g_assert_cmpstr(qdict_get_str(rsp_return, "status"), ==, "unstarted");
+    g_assert(!qdict_haskey(rsp_return, "dirty-rate"));
+    qobject_unref(rsp_return);
+
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                          "  'arguments': { 'calc-time': 0 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                          "  'arguments': { 'calc-time': 1,"
+                          "                 'sample-pages': 0 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    /* The guest keeps rewriting all of its test memory */
+    wait_for_serial("src_serial");
+
+    rsp_return = wait_command(from, "{ 'execute': 'calc-dirty-rate',"
+                                    "  'arguments': { 'calc-time': 1 } }");
+    qobject_unref(rsp_return);
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                          "  'arguments': { 'calc-time': 1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    rsp_return = wait_for_dirty_rate(from);
+    g_assert_cmpstr(qdict_get_str(rsp_return, "mode"), ==, "page-sampling");
+    g_assert_cmpint(qdict_get_int(rsp_return, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(rsp_return, "sample-pages"), ==, 512);
+    g_assert_cmpint(qdict_get_int(rsp_return, "start-time"), >=, now);
+    g_assert_cmpint(qdict_get_int(rsp_return, "dirty-pages-rate"), >, 0);
+    qobject_unref(rsp_return);
+
+    rsp_return = wait_command(from, "{ 'execute': 'calc-dirty-rate',"
+                                    "  'arguments': { 'calc-time': 1,"
+                                    "                 'mode': 'dirty-log' } }");
+    qobject_unref(rsp_return);
+
+    rsp_return = wait_for_dirty_rate(from);
+    g_assert_cmpstr(qdict_get_str(rsp_return, "mode"), ==, "dirty-log");
+    g_assert_cmpint(qdict_get_int(rsp_return, "dirty-pages-rate"), >, 0);
+    qobject_unref(rsp_return);
+
+    test_migrate_end(from, to, false);
+}
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/migration-test-XXXXXX";
@@ -765,6 +886,8 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
+    qtest_add_func("/migration/multifd/unix", test_multifd_unix);
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
 
     ret = g_test_run();
 
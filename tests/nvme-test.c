@@ -9,24 +9,392 @@
 
 #include "qemu/osdep.h"
 #include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/pci-pc.h"
+#include "qemu/bswap.h"
+#include "hw/pci/pci_regs.h"
+#include "block/nvme.h"
 
-/* Tests only initialization so far. TODO: Replace with functional tests */
+#define TEST_IMAGE_SIZE     (1 * 1024 * 1024)
+#define TEST_QUEUE_SIZE     16
+#define TEST_BLOCK_SIZE     512
+#define TEST_TIMEOUT_US     (5 * 1000 * 1000)
+
+#define NVME_DEVFN          QPCI_DEVFN(4, 0)
+#define NVME_SQE_SIZE       64
+#define NVME_CQE_SIZE       16
+
+static char tmp_path[] = "/tmp/qtest.XXXXXX";
+
+typedef struct NvmeTestQueue {
+    uint16_t qid;
+    uint64_t sq_addr;
+    uint64_t cq_addr;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    bool phase;
+} NvmeTestQueue;
+
+typedef struct NvmeTestDev {
+    QOSState *qs;
+    QPCIDevice *dev;
+    QPCIBar bar;
+    QPCIBar cmb;
+    uint64_t dbs;       /* Shadow doorbell buffer, or 0 */
+    uint64_t eis;       /* EventIdx buffer, or 0 */
+    uint16_t cid;
+    NvmeTestQueue admin;
+    NvmeTestQueue io;
+} NvmeTestDev;
+
+static void nvme_test_init_queue(NvmeTestDev *d, NvmeTestQueue *q,
+                                 uint16_t qid)
+{
+    q->qid = qid;
+    q->sq_addr = guest_alloc(d->qs->alloc, TEST_QUEUE_SIZE * NVME_SQE_SIZE);
+    q->cq_addr = guest_alloc(d->qs->alloc, TEST_QUEUE_SIZE * NVME_CQE_SIZE);
+    qtest_memset(d->qs->qts, q->cq_addr, 0, TEST_QUEUE_SIZE * NVME_CQE_SIZE);
+    q->sq_tail = 0;
+    q->cq_head = 0;
+    q->phase = true;
+}
+
+/* Start a controller with an enabled admin queue pair */
+static NvmeTestDev *nvme_test_start(bool cmb)
+{
+    NvmeTestDev *d = g_new0(NvmeTestDev, 1);
+    uint32_t cc;
+
+    d->qs = qtest_pc_boot("-drive id=drv0,if=none,file=%s,format=raw "
+                          "-device nvme,addr=04.0,drive=drv0,serial=foo%s",
+                          tmp_path, cmb ? ",cmb_size_mb=1" : "");
+    d->dev = qpci_device_find(d->qs->pcibus, NVME_DEVFN);
+    g_assert(d->dev != NULL);
+    qpci_device_enable(d->dev);
+    d->bar = qpci_iomap(d->dev, 0, NULL);
+    if (cmb) {
+        d->cmb = qpci_iomap(d->dev, 2, NULL);
+    }
+
+    nvme_test_init_queue(d, &d->admin, 0);
+    qpci_io_writel(d->dev, d->bar, 0x24,
+                   (TEST_QUEUE_SIZE - 1) | (TEST_QUEUE_SIZE - 1) << 16);
+    qpci_io_writel(d->dev, d->bar, 0x28, d->admin.sq_addr);
+    qpci_io_writel(d->dev, d->bar, 0x2c, d->admin.sq_addr >> 32);
+    qpci_io_writel(d->dev, d->bar, 0x30, d->admin.cq_addr);
+    qpci_io_writel(d->dev, d->bar, 0x34, d->admin.cq_addr >> 32);
+
+    cc = 1 << CC_EN_SHIFT | 6 << CC_IOSQES_SHIFT | 4 << CC_IOCQES_SHIFT;
+    qpci_io_writel(d->dev, d->bar, 0x14, cc);
+    g_assert(NVME_CSTS_RDY(qpci_io_readl(d->dev, d->bar, 0x1c)));
+
+    return d;
+}
+
+static void nvme_test_stop(NvmeTestDev *d)
+{
+    g_free(d->dev);
+    qtest_shutdown(d->qs);
+    g_free(d);
+}
+
+static bool nvme_test_intx(NvmeTestDev *d)
+{
+    return qpci_config_readw(d->dev, PCI_STATUS) & PCI_STATUS_INTERRUPT;
+}
+
+/* Same as the Linux driver: ring the doorbell if we moved past EventIdx */
+static bool nvme_test_need_event(uint16_t event_idx, uint16_t new_idx,
+                                 uint16_t old)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
+}
+
+static void nvme_test_submit(NvmeTestDev *d, NvmeTestQueue *q, NvmeCmd *cmd)
+{
+    cmd->cid = cpu_to_le16(++d->cid);
+    qtest_memwrite(d->qs->qts, q->sq_addr + q->sq_tail * NVME_SQE_SIZE,
+                   cmd, sizeof(*cmd));
+    q->sq_tail = (q->sq_tail + 1) % TEST_QUEUE_SIZE;
+
+    if (d->dbs && q->qid) {
+        qtest_writel(d->qs->qts, d->dbs + q->qid * 8, q->sq_tail);
+    }
+    qpci_io_writel(d->dev, d->bar, 0x1000 + q->qid * 8, q->sq_tail);
+}
+
+/* Wait for the next completion and return its status, without DNR masked */
+static uint16_t nvme_test_wait(NvmeTestDev *d, NvmeTestQueue *q)
+{
+    uint64_t addr = q->cq_addr + q->cq_head * NVME_CQE_SIZE;
+    gint64 start_time = g_get_monotonic_time();
+    uint16_t status;
+
+    for (;;) {
+        status = qtest_readw(d->qs->qts, addr + offsetof(NvmeCqe, status));
+        if ((status & 1) == q->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() - start_time <= TEST_TIMEOUT_US);
+        qtest_clock_step(d->qs->qts, 1000);
+    }
+
+    q->cq_head = (q->cq_head + 1) % TEST_QUEUE_SIZE;
+    if (!q->cq_head) {
+        q->phase = !q->phase;
+    }
+    return status >> 1;
+}
+
+/* Tell the controller that we consumed the completions */
+static void nvme_test_cq_doorbell(NvmeTestDev *d, NvmeTestQueue *q,
+                                  uint16_t old_head)
+{
+    if (d->dbs && q->qid) {
+        uint16_t event_idx;
+
+        qtest_writel(d->qs->qts, d->dbs + q->qid * 8 + 4, q->cq_head);
+        event_idx = qtest_readl(d->qs->qts, d->eis + q->qid * 8 + 4);
+        if (!nvme_test_need_event(event_idx, q->cq_head, old_head)) {
+            return;
+        }
+    }
+    qpci_io_writel(d->dev, d->bar, 0x1000 + q->qid * 8 + 4, q->cq_head);
+}
+
+static uint16_t nvme_test_cmd(NvmeTestDev *d, NvmeTestQueue *q, NvmeCmd *cmd)
+{
+    uint16_t old_head = q->cq_head;
+    uint16_t status;
+
+    nvme_test_submit(d, q, cmd);
+    status = nvme_test_wait(d, q);
+    nvme_test_cq_doorbell(d, q, old_head);
+    return status;
+}
+
+static void nvme_test_create_io_queues(NvmeTestDev *d)
+{
+    NvmeCreateCq ccq = {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+    };
+    NvmeCreateSq csq = {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+    };
+
+    nvme_test_init_queue(d, &d->io, 1);
+
+    ccq.prp1 = cpu_to_le64(d->io.cq_addr);
+    ccq.cqid = cpu_to_le16(1);
+    ccq.qsize = cpu_to_le16(TEST_QUEUE_SIZE - 1);
+    ccq.cq_flags = cpu_to_le16(NVME_Q_PC | 1 << 1);
+    g_assert_cmphex(nvme_test_cmd(d, &d->admin, (NvmeCmd *)&ccq), ==,
+                    NVME_SUCCESS);
+
+    csq.prp1 = cpu_to_le64(d->io.sq_addr);
+    csq.sqid = cpu_to_le16(1);
+    csq.qsize = cpu_to_le16(TEST_QUEUE_SIZE - 1);
+    csq.sq_flags = cpu_to_le16(NVME_Q_PC);
+    csq.cqid = cpu_to_le16(1);
+    g_assert_cmphex(nvme_test_cmd(d, &d->admin, (NvmeCmd *)&csq), ==,
+                    NVME_SUCCESS);
+}
+
+static uint16_t nvme_test_rw_sgl(NvmeTestDev *d, uint8_t opcode,
+                                 uint64_t slba, uint32_t nlb,
+                                 uint64_t addr, uint32_t len, uint8_t type)
+{
+    NvmeRwCmd rw = {
+        .opcode = opcode,
+        .flags = NVME_PSDT_SGL_MPTR_CONTIGUOUS << 6,
+        .nsid = cpu_to_le32(1),
+    };
+    NvmeSglDescriptor sgl = {
+        .addr = cpu_to_le64(addr),
+        .len = cpu_to_le32(len),
+        .type = type << 4,
+    };
+
+    memcpy(&rw.prp1, &sgl, sizeof(sgl));
+    rw.slba = cpu_to_le64(slba);
+    rw.nlb = cpu_to_le16(nlb - 1);
+    return nvme_test_cmd(d, &d->io, (NvmeCmd *)&rw);
+}
+
+static void nvme_test_write_sgl_list(NvmeTestDev *d, uint64_t list,
+                                     const uint64_t *addrs, int n)
+{
+    NvmeSglDescriptor *descs = g_new0(NvmeSglDescriptor, n);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        descs[i].addr = cpu_to_le64(addrs[i]);
+        descs[i].len = cpu_to_le32(TEST_BLOCK_SIZE);
+        descs[i].type = NVME_SGL_DESCR_TYPE_DATA_BLOCK << 4;
+    }
+    qtest_memwrite(d->qs->qts, list, descs, n * sizeof(*descs));
+    g_free(descs);
+}
+
+/* SGL data blocks may point into the controller memory buffer */
+static void test_sgl_cmb(void)
+{
+    NvmeTestDev *d = nvme_test_start(true);
+    uint8_t pattern[TEST_BLOCK_SIZE], buf[TEST_BLOCK_SIZE];
+    uint64_t ram, list, addrs[2];
+    NvmeRwCmd rw = {
+        .opcode = NVME_CMD_READ,
+        .nsid = cpu_to_le32(1),
+    };
+
+    nvme_test_create_io_queues(d);
+    ram = guest_alloc(d->qs->alloc, TEST_BLOCK_SIZE);
+    list = guest_alloc(d->qs->alloc, 2 * sizeof(NvmeSglDescriptor));
+
+    generate_pattern(pattern, sizeof(pattern), 16);
+    qtest_memwrite(d->qs->qts, d->cmb.addr, pattern, sizeof(pattern));
+    g_assert_cmphex(nvme_test_rw_sgl(d, NVME_CMD_WRITE, 0, 1, d->cmb.addr,
+                                     TEST_BLOCK_SIZE,
+                                     NVME_SGL_DESCR_TYPE_DATA_BLOCK), ==,
+                    NVME_SUCCESS);
+
+    /* Read it back into guest memory with PRPs... */
+    rw.prp1 = cpu_to_le64(ram);
+    g_assert_cmphex(nvme_test_cmd(d, &d->io, (NvmeCmd *)&rw), ==,
+                    NVME_SUCCESS);
+    qtest_memread(d->qs->qts, ram, buf, sizeof(buf));
+    g_assert(!memcmp(buf, pattern, sizeof(buf)));
+
+    /* ...and into another part of the CMB with an SGL */
+    g_assert_cmphex(nvme_test_rw_sgl(d, NVME_CMD_READ, 0, 1,
+                                     d->cmb.addr + 4096, TEST_BLOCK_SIZE,
+                                     NVME_SGL_DESCR_TYPE_DATA_BLOCK), ==,
+                    NVME_SUCCESS);
+    qtest_memread(d->qs->qts, d->cmb.addr + 4096, buf, sizeof(buf));
+    g_assert(!memcmp(buf, pattern, sizeof(buf)));
+
+    /* A single command cannot use both the CMB and guest memory */
+    addrs[0] = d->cmb.addr;
+    addrs[1] = ram;
+    nvme_test_write_sgl_list(d, list, addrs, 2);
+    g_assert_cmphex(nvme_test_rw_sgl(d, NVME_CMD_READ, 0, 2, list,
+                                     2 * sizeof(NvmeSglDescriptor),
+                                     NVME_SGL_DESCR_TYPE_LAST_SEGMENT), ==,
+                    NVME_INVALID_USE_OF_CMB | NVME_DNR);
+
+    nvme_test_stop(d);
+}
+
+/* The number of descriptors in the segments of a command is limited */
+static void test_sgl_max_descrs(void)
+{
+    const int max_descrs = 1024;
+    NvmeTestDev *d = nvme_test_start(false);
+    uint64_t data, list, *addrs;
+    int i;
+
+    nvme_test_create_io_queues(d);
+    data = guest_alloc(d->qs->alloc, (max_descrs + 1) * TEST_BLOCK_SIZE);
+    list = guest_alloc(d->qs->alloc,
+                       (max_descrs + 1) * sizeof(NvmeSglDescriptor));
+
+    addrs = g_new(uint64_t, max_descrs + 1);
+    for (i = 0; i <= max_descrs; i++) {
+        addrs[i] = data + i * TEST_BLOCK_SIZE;
+    }
+    nvme_test_write_sgl_list(d, list, addrs, max_descrs + 1);
+    g_free(addrs);
+
+    g_assert_cmphex(nvme_test_rw_sgl(d, NVME_CMD_READ, 0, max_descrs, list,
+                                     max_descrs * sizeof(NvmeSglDescriptor),
+                                     NVME_SGL_DESCR_TYPE_LAST_SEGMENT), ==,
+                    NVME_SUCCESS);
+    g_assert_cmphex(nvme_test_rw_sgl(d, NVME_CMD_READ, 0, max_descrs + 1,
+                                     list, (max_descrs + 1) *
+                                     sizeof(NvmeSglDescriptor),
+                                     NVME_SGL_DESCR_TYPE_LAST_SEGMENT), ==,
+                    NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR);
+
+    nvme_test_stop(d);
+}
+
+/*
+ * With shadow doorbells the guest only rings the completion queue doorbell
+ * when told to by EventIdx; the pin interrupt must still go away.
+ */
+static void test_dbbuf_intx(void)
+{
+    NvmeTestDev *d = nvme_test_start(false);
+    uint64_t dbs = guest_alloc(d->qs->alloc, 4096);
+    uint64_t eis = guest_alloc(d->qs->alloc, 4096);
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_DBBUF_CONFIG,
+    };
+    uint16_t old_head;
+    int i;
+
+    qtest_memset(d->qs->qts, dbs, 0, 4096);
+    qtest_memset(d->qs->qts, eis, 0, 4096);
+    cmd.prp1 = cpu_to_le64(dbs);
+    cmd.prp2 = cpu_to_le64(eis);
+    g_assert_cmphex(nvme_test_cmd(d, &d->admin, &cmd), ==, NVME_SUCCESS);
+    d->dbs = dbs;
+    d->eis = eis;
+
+    nvme_test_create_io_queues(d);
+    g_assert(!nvme_test_intx(d));
+
+    /* EventIdx must follow the head, not just allow the first update */
+    for (i = 0; i < 3; i++) {
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.opcode = NVME_CMD_FLUSH;
+        cmd.nsid = cpu_to_le32(1);
+        old_head = d->io.cq_head;
+        nvme_test_submit(d, &d->io, &cmd);
+        g_assert_cmphex(nvme_test_wait(d, &d->io), ==, NVME_SUCCESS);
+        g_assert(nvme_test_intx(d));
+
+        nvme_test_cq_doorbell(d, &d->io, old_head);
+        g_assert(!nvme_test_intx(d));
+    }
+
+    nvme_test_stop(d);
+}
+
+/* Tests only initialization */
 static void nop(void)
 {
+    qtest_start("-drive id=drv0,if=none,file=null-co://,format=raw "
+                "-device nvme,drive=drv0,serial=foo");
+    qtest_end();
 }
 
 int main(int argc, char **argv)
 {
-    int ret;
+    const char *arch = qtest_get_arch();
+    int fd, ret;
 
     g_test_init(&argc, &argv, NULL);
     qtest_add_func("/nvme/nop", nop);
 
-    qtest_start("-drive id=drv0,if=none,file=null-co://,format=raw "
-                "-device nvme,drive=drv0,serial=foo");
+    /* The functional tests use the PC PCI bus and guest allocator */
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        return g_test_run();
+    }
+
+    fd = mkstemp(tmp_path);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
+
+    qtest_add_func("/nvme/sgl/cmb", test_sgl_cmb);
+    qtest_add_func("/nvme/sgl/max-descrs", test_sgl_max_descrs);
+    qtest_add_func("/nvme/dbbuf/intx", test_dbbuf_intx);
+
     ret = g_test_run();
 
-    qtest_end();
+    unlink(tmp_path);
 
     return ret;
 }
@@ -18,6 +18,8 @@
 #include "qemu/error-report.h"
 #include "qemu/coroutine.h"
 #include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "iothread.h"
 
 static AioContext *ctx;
 
@@ -319,6 +321,102 @@ static void test_bh_flush(void)
     qemu_bh_delete(data.bh);
 }
 
+typedef struct {
+    int n;
+    bool done;
+} BHConcurrentTestData;
+
+static void bh_concurrent_cb(void *opaque)
+{
+    BHConcurrentTestData *data = opaque;
+
+    atomic_inc(&data->n);
+}
+
+/* Like a drain from the main thread, while the home thread is in aio_poll() */
+static void *test_bh_delete_concurrent_thread(void *opaque)
+{
+    BHConcurrentTestData *data = opaque;
+    QEMUBH *bh;
+    int i;
+
+    rcu_register_thread();
+    for (i = 0; i < 10000; i++) {
+        bh = aio_bh_new(ctx, bh_concurrent_cb, data);
+        qemu_bh_schedule(bh);
+        qemu_bh_delete(bh);
+        aio_bh_schedule_oneshot(ctx, bh_concurrent_cb, data);
+
+        aio_context_acquire(ctx);
+        aio_poll(ctx, false);
+        aio_context_release(ctx);
+    }
+
+    atomic_set(&data->done, true);
+    aio_notify(ctx);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void test_bh_delete_concurrent(void)
+{
+    BHConcurrentTestData data = { .n = 0 };
+    QemuThread thread;
+
+    qemu_thread_create(&thread, "test_bh_delete_concurrent_thread",
+                       test_bh_delete_concurrent_thread,
+                       &data, QEMU_THREAD_JOINABLE);
+
+    /* The blocking polls look at BHs that the other thread frees */
+    while (!atomic_read(&data.done)) {
+        aio_poll(ctx, true);
+    }
+    qemu_thread_join(&thread);
+
+    while (aio_poll(ctx, false)) {
+        /* nothing */
+    }
+    g_assert_cmpint(data.n, ==, 10000);
+}
+
+static void bh_schedule_batched_cb(void *opaque)
+{
+    BHTestData *data = opaque;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        qemu_bh_schedule_batched(data->bh);
+    }
+    g_assert_cmpint(data->n, ==, 0);
+}
+
+static void test_bh_schedule_batched(void)
+{
+    BHTestData data = { .n = 0 };
+    QEMUBH *bh;
+
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+    bh = aio_bh_new(ctx, bh_schedule_batched_cb, &data);
+
+    /* Coalesced and run at the end of the same iteration */
+    qemu_bh_schedule(bh);
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    /* Outside the event loop this is the same as qemu_bh_schedule */
+    qemu_bh_schedule_batched(data.bh);
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+
+    qemu_bh_delete(bh);
+    qemu_bh_delete(data.bh);
+}
+
 static void test_set_event_notifier(void)
 {
     EventNotifierTestData data = { .n = 0, .active = 0 };
@@ -876,6 +974,132 @@ static void test_queue_chaining(void)
     g_assert_cmpint(data_b.i, ==, data_b.max);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct {
+    AioUringRequest req;
+    EventNotifier e;
+    EventNotifier idle;
+    EventNotifier parked;
+    QemuEvent done;
+    bool sqe_added;
+    int step;
+    int n;
+} UringTestData;
+
+static void uring_prep_nop(struct io_uring_sqe *sqe, void *opaque)
+{
+    io_uring_prep_nop(sqe);
+}
+
+static void uring_nop_cb(AioUringRequest *req)
+{
+    UringTestData *data = container_of(req, UringTestData, req);
+
+    qemu_event_set(&data->done);
+}
+
+static void uring_add_sqe_bh(void *opaque)
+{
+    UringTestData *data = opaque;
+
+    data->sqe_added = aio_add_sqe(qemu_get_current_aio_context(),
+                                  uring_prep_nop, NULL, &data->req);
+    if (!data->sqe_added) {
+        qemu_event_set(&data->done);
+    }
+}
+
+static void uring_event_cb(EventNotifier *e)
+{
+    UringTestData *data = container_of(e, UringTestData, e);
+
+    g_assert(event_notifier_test_and_clear(e));
+    atomic_inc(&data->n);
+    qemu_event_set(&data->done);
+}
+
+static bool uring_poll_false(void *opaque)
+{
+    return false;
+}
+
+/* Timers run without list_lock taken, so removing a handler that io_uring
+ * neither armed nor still has queued frees it right away.
+ */
+static void uring_remove_idle_cb(void *opaque)
+{
+    UringTestData *data = opaque;
+    AioContext *uring_ctx = qemu_get_current_aio_context();
+
+    if (data->step == 0) {
+        /* pfd.events == 0, so the handler is never armed */
+        aio_set_event_notifier(uring_ctx, &data->idle, false,
+                               NULL, uring_poll_false);
+
+        /* Parked by the next aio_poll(), external clients are disabled */
+        aio_set_event_notifier(uring_ctx, &data->parked, true,
+                               dummy_notifier_read, NULL);
+    } else {
+        aio_set_event_notifier(uring_ctx, &data->idle, false, NULL, NULL);
+        aio_set_event_notifier(uring_ctx, &data->parked, true, NULL, NULL);
+    }
+    qemu_event_set(&data->done);
+}
+
+/* IOThreads do not use a GSource, so they monitor fds with io_uring */
+static void test_io_uring(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *uring_ctx = iothread_get_aio_context(iothread);
+    UringTestData data = {
+        .req.cb = uring_nop_cb,
+        .req.res = -EINPROGRESS,
+    };
+    QEMUTimer *timer;
+    int i;
+
+    qemu_event_init(&data.done, false);
+    aio_bh_schedule_oneshot(uring_ctx, uring_add_sqe_bh, &data);
+    qemu_event_wait(&data.done);
+    if (!data.sqe_added) {
+        g_test_skip("io_uring not supported by the kernel");
+        goto out;
+    }
+    g_assert_cmpint(data.req.res, ==, 0);
+
+    event_notifier_init(&data.idle, false);
+    event_notifier_init(&data.parked, false);
+    timer = aio_timer_new(uring_ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                          uring_remove_idle_cb, &data);
+    aio_disable_external(uring_ctx);
+    for (data.step = 0; data.step < 2; data.step++) {
+        qemu_event_reset(&data.done);
+        timer_mod(timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+        qemu_event_wait(&data.done);
+    }
+    aio_enable_external(uring_ctx);
+    timer_free(timer);
+    event_notifier_cleanup(&data.idle);
+    event_notifier_cleanup(&data.parked);
+
+    /* The removed handlers must be gone from the ring's queue */
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(uring_ctx, &data.e, false, uring_event_cb, NULL);
+    for (i = 0; i < 3; i++) {
+        qemu_event_reset(&data.done);
+        event_notifier_set(&data.e);
+        qemu_event_wait(&data.done);
+        g_assert_cmpint(atomic_read(&data.n), ==, i + 1);
+    }
+    aio_set_event_notifier(uring_ctx, &data.e, false, NULL, NULL);
+    event_notifier_cleanup(&data.e);
+
+out:
+    iothread_join(iothread);
+    qemu_event_destroy(&data.done);
+}
+#endif
+
 /* End of tests.  */
 
 int main(int argc, char **argv)
@@ -894,6 +1118,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
     g_test_add_func("/aio/bh/flush",                test_bh_flush);
+    g_test_add_func("/aio/bh/delete-concurrent",    test_bh_delete_concurrent);
+    g_test_add_func("/aio/bh/schedule-batched",     test_bh_schedule_batched);
     g_test_add_func("/aio/event/add-remove",        test_set_event_notifier);
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
@@ -902,6 +1128,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
+#ifdef CONFIG_LINUX_IO_URING
+    g_test_add_func("/aio/io-uring",                test_io_uring);
+#endif
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
@@ -0,0 +1,132 @@
+/*
+ * Block status cache tests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+
+#define TEST_IMAGE_SIZE (1 * 1024 * 1024)
+
+typedef struct BDRVTestState {
+    int block_status_calls;
+} BDRVTestState;
+
+static int64_t bdrv_test_getlength(BlockDriverState *bs)
+{
+    return TEST_IMAGE_SIZE;
+}
+
+static int coroutine_fn bdrv_test_co_block_status(BlockDriverState *bs,
+                                                  bool want_zero,
+                                                  int64_t offset,
+                                                  int64_t bytes,
+                                                  int64_t *pnum,
+                                                  int64_t *map,
+                                                  BlockDriverState **file)
+{
+    BDRVTestState *s = bs->opaque;
+
+    s->block_status_calls++;
+    *pnum = bytes;
+    return BDRV_BLOCK_DATA;
+}
+
+static int coroutine_fn bdrv_test_co_pwritev(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    return 0;
+}
+
+static int coroutine_fn bdrv_test_co_pdiscard(BlockDriverState *bs,
+                                              int64_t offset, int bytes)
+{
+    return 0;
+}
+
+static BlockDriver bdrv_test = {
+    .format_name            = "test",
+    .instance_size          = sizeof(BDRVTestState),
+
+    .bdrv_getlength         = bdrv_test_getlength,
+    .bdrv_co_block_status   = bdrv_test_co_block_status,
+    .block_status_cacheable = true,
+    .bdrv_co_pwritev        = bdrv_test_co_pwritev,
+    .bdrv_co_pdiscard       = bdrv_test_co_pdiscard,
+};
+
+static int test_block_status(BlockDriverState *bs, int64_t offset,
+                             int64_t bytes)
+{
+    int64_t pnum;
+    int ret;
+
+    ret = bdrv_block_status(bs, offset, bytes, &pnum, NULL, NULL);
+    g_assert_cmpint(ret, >=, 0);
+    g_assert(ret & BDRV_BLOCK_DATA);
+    g_assert_cmpint(pnum, ==, bytes);
+
+    return ((BDRVTestState *) bs->opaque)->block_status_calls;
+}
+
+static void test_cache(void)
+{
+    BlockBackend *blk;
+    BlockDriverState *bs;
+    uint8_t buf[512] = { 0 };
+
+    blk = blk_new(BLK_PERM_ALL, BLK_PERM_ALL);
+    bs = bdrv_new_open_driver(&bdrv_test, "test-node",
+                              BDRV_O_RDWR | BDRV_O_UNMAP, &error_abort);
+    blk_insert_bs(blk, bs, &error_abort);
+
+    /* A miss, then hits for the same range and for a part of it */
+    g_assert_cmpint(test_block_status(bs, 0, 65536), ==, 1);
+    g_assert_cmpint(test_block_status(bs, 0, 65536), ==, 1);
+    g_assert_cmpint(test_block_status(bs, 4096, 4096), ==, 1);
+
+    /* Ranges that are not cached yet miss */
+    g_assert_cmpint(test_block_status(bs, 65536, 65536), ==, 2);
+    g_assert_cmpint(test_block_status(bs, 65536, 65536), ==, 2);
+
+    /* A write drops all cached results of the node, not just its range */
+    g_assert_cmpint(blk_pwrite(blk, 0, buf, sizeof(buf), 0), ==, sizeof(buf));
+    g_assert_cmpint(test_block_status(bs, 65536, 65536), ==, 3);
+    g_assert_cmpint(test_block_status(bs, 0, 65536), ==, 4);
+    g_assert_cmpint(test_block_status(bs, 0, 65536), ==, 4);
+
+    /* So does a discard */
+    g_assert_cmpint(blk_pdiscard(blk, 0, 65536), ==, 0);
+    g_assert_cmpint(test_block_status(bs, 0, 65536), ==, 5);
+    g_assert_cmpint(test_block_status(bs, 0, 65536), ==, 5);
+
+    bdrv_unref(bs);
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/block-status-cache/cache", test_cache);
+
+    return g_test_run();
+}
@@ -345,6 +345,51 @@ static void test_order(void)
         g_assert_cmpint(records[i].state, ==, expected_pos[i].state);
     }
 }
+#ifndef _WIN32
+/*
+ * Check that a burst of concurrent coroutines reuses the stacks of
+ * the previous one instead of mapping new ones
+ */
+
+enum {
+    STACK_POOL_BURST = 1000,
+};
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void stack_pool_burst(void)
+{
+    Coroutine *co[STACK_POOL_BURST];
+    int i;
+
+    for (i = 0; i < STACK_POOL_BURST; i++) {
+        co[i] = qemu_coroutine_create(yield_once, NULL);
+        qemu_coroutine_enter(co[i]);
+    }
+    for (i = 0; i < STACK_POOL_BURST; i++) {
+        qemu_coroutine_enter(co[i]);
+    }
+}
+
+static void test_stack_pool(void)
+{
+    CoroutineStackStats before, after;
+
+    stack_pool_burst();
+    qemu_coroutine_stack_get_stats(&before);
+    g_assert_cmpint(before.in_use_peak, >=, STACK_POOL_BURST);
+
+    stack_pool_burst();
+    qemu_coroutine_stack_get_stats(&after);
+    g_assert_cmpint(after.nr_maps, ==, before.nr_maps);
+    g_assert_cmpint(after.nr_unmaps, ==, before.nr_unmaps);
+    g_assert_cmpint(after.mapped_peak, ==, before.mapped_peak);
+}
+#endif
+
 /*
  * Lifecycle benchmark
  */
@@ -492,6 +537,9 @@ int main(int argc, char **argv)
      */
     if (CONFIG_COROUTINE_POOL) {
         g_test_add_func("/basic/no-dangling-access", test_no_dangling_access);
+#ifndef _WIN32
+        g_test_add_func("/basic/stack-pool", test_stack_pool);
+#endif
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
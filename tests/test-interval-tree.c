@@ -0,0 +1,122 @@
+/*
+ * Interval tree tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define N_NODES 512
+#define N_OPS 20000
+#define RANGE 4096
+
+typedef struct TestNode {
+    IntervalTreeNode node;
+    bool inserted;
+} TestNode;
+
+static TestNode nodes[N_NODES];
+static IntervalTreeRoot root;
+
+static void check_query(uint64_t start, uint64_t last)
+{
+    bool seen[N_NODES] = { false };
+    IntervalTreeNode *n;
+    uint64_t prev_start = 0;
+    int i, found = 0, expected = 0;
+
+    for (n = interval_tree_iter_first(&root, start, last); n;
+         n = interval_tree_iter_next(&root, n, start, last)) {
+        TestNode *t = container_of(n, TestNode, node);
+
+        i = t - nodes;
+        g_assert(t->inserted);
+        g_assert(!seen[i]);
+        g_assert(n->start <= last && n->last >= start);
+        g_assert_cmpuint(n->start, >=, prev_start);
+        prev_start = n->start;
+        seen[i] = true;
+        found++;
+    }
+
+    for (i = 0; i < N_NODES; i++) {
+        if (nodes[i].inserted &&
+            nodes[i].node.start <= last && nodes[i].node.last >= start) {
+            g_assert(seen[i]);
+            expected++;
+        }
+    }
+    g_assert_cmpint(found, ==, expected);
+}
+
+static void test_empty(void)
+{
+    IntervalTreeRoot empty = { NULL };
+
+    g_assert(interval_tree_is_empty(&empty));
+    g_assert(interval_tree_iter_first(&empty, 0, UINT64_MAX) == NULL);
+}
+
+static void test_duplicates(void)
+{
+    TestNode dup[8];
+    IntervalTreeRoot r = { NULL };
+    IntervalTreeNode *n;
+    int i, count = 0;
+
+    for (i = 0; i < ARRAY_SIZE(dup); i++) {
+        dup[i].node.start = 100;
+        dup[i].node.last = 199;
+        interval_tree_insert(&dup[i].node, &r);
+    }
+
+    for (n = interval_tree_iter_first(&r, 199, 199); n;
+         n = interval_tree_iter_next(&r, n, 199, 199)) {
+        count++;
+    }
+    g_assert_cmpint(count, ==, ARRAY_SIZE(dup));
+    g_assert(interval_tree_iter_first(&r, 200, UINT64_MAX) == NULL);
+    g_assert(interval_tree_iter_first(&r, 0, 99) == NULL);
+
+    for (i = 0; i < ARRAY_SIZE(dup); i++) {
+        interval_tree_remove(&dup[i].node, &r);
+    }
+    g_assert(interval_tree_is_empty(&r));
+}
+
+static void test_random(void)
+{
+    int op;
+
+    for (op = 0; op < N_OPS; op++) {
+        TestNode *t = &nodes[g_test_rand_int_range(0, N_NODES)];
+        uint64_t start = g_test_rand_int_range(0, RANGE);
+        uint64_t last = start + g_test_rand_int_range(0, RANGE / 16);
+
+        if (t->inserted) {
+            interval_tree_remove(&t->node, &root);
+            t->inserted = false;
+        } else {
+            t->node.start = start;
+            t->node.last = last;
+            interval_tree_insert(&t->node, &root);
+            t->inserted = true;
+        }
+
+        start = g_test_rand_int_range(0, RANGE);
+        last = start + g_test_rand_int_range(0, RANGE / 4);
+        check_query(start, last);
+    }
+
+    check_query(0, UINT64_MAX);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/duplicates", test_duplicates);
+    g_test_add_func("/interval-tree/random", test_random);
+    return g_test_run();
+}
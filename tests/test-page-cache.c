@@ -0,0 +1,105 @@
+/*
+ * XBZRLE page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "../migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+/* Two sets of eight ways */
+#define CACHE_PAGES 16
+#define NUM_SETS 2
+
+static uint64_t page_addr(int set, int n)
+{
+    return (uint64_t)(n * NUM_SETS + set) * PAGE_SIZE;
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE,
+                                  &error_abort);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    /* Pages that map to the same set do not evict each other */
+    for (i = 0; i < 8; i++) {
+        memset(page, i, PAGE_SIZE);
+        g_assert_cmpint(cache_insert(cache, page_addr(0, i), page, 0), ==, 0);
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, page_addr(0, i), 0));
+        g_assert_cmpint(get_cached_data(cache, page_addr(0, i))[0], ==, i);
+    }
+    g_assert(!cache_is_cached(cache, page_addr(1, 0), 0));
+    g_assert(get_cached_data(cache, page_addr(1, 0)) == NULL);
+
+    /* Updating a cached page does not evict anything */
+    memset(page, 0xff, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, page_addr(0, 3), page, 0), ==, 0);
+    g_assert_cmpint(get_cached_data(cache, page_addr(0, 3))[0], ==, 0xff);
+
+    cache_fini(cache);
+}
+
+static void test_eviction(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES * PAGE_SIZE, PAGE_SIZE,
+                                  &error_abort);
+    uint8_t page[PAGE_SIZE] = { 0 };
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        g_assert_cmpint(cache_insert(cache, page_addr(0, i), page, 0), ==, 0);
+    }
+
+    /* The whole set is still fresh one generation later */
+    g_assert_cmpint(cache_insert(cache, page_addr(0, 8), page, 1), ==, -1);
+    g_assert(!cache_is_cached(cache, page_addr(0, 8), 1));
+
+    /* Touch page 0 so that page 1 becomes the eviction victim */
+    g_assert(cache_is_cached(cache, page_addr(0, 0), 5));
+    g_assert_cmpint(cache_insert(cache, page_addr(0, 8), page, 5), ==, 1);
+    g_assert(cache_is_cached(cache, page_addr(0, 8), 5));
+    g_assert(!cache_is_cached(cache, page_addr(0, 1), 5));
+    for (i = 2; i < 8; i++) {
+        g_assert(cache_is_cached(cache, page_addr(0, i), 5));
+    }
+    g_assert(cache_is_cached(cache, page_addr(0, 0), 5));
+
+    /* The other set was not affected */
+    g_assert_cmpint(cache_insert(cache, page_addr(1, 0), page, 5), ==, 0);
+
+    cache_fini(cache);
+}
+
+static void test_small_cache(void)
+{
+    Error *err = NULL;
+    PageCache *cache;
+    uint8_t page[PAGE_SIZE] = { 0 };
+
+    g_assert(cache_init(3 * PAGE_SIZE, PAGE_SIZE, &err) == NULL);
+    error_free_or_abort(&err);
+
+    /* A cache smaller than a set is fully associative */
+    cache = cache_init(2 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    g_assert_cmpint(cache_insert(cache, 0, page, 0), ==, 0);
+    g_assert_cmpint(cache_insert(cache, 2 * PAGE_SIZE, page, 0), ==, 0);
+    g_assert_cmpint(cache_insert(cache, 4 * PAGE_SIZE, page, 2), ==, 1);
+    g_assert(cache_is_cached(cache, 4 * PAGE_SIZE, 2));
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert-lookup", test_insert_lookup);
+    g_test_add_func("/page-cache/eviction", test_eviction);
+    g_test_add_func("/page-cache/small-cache", test_small_cache);
+
+    return g_test_run();
+}
@@ -135,6 +135,30 @@ static void test_submit_many(void)
     }
 }
 
+static void test_submit_overflow(void)
+{
+    /* More work items than the per-thread queues can hold.  */
+    const int count = 20000;
+    WorkerTestData *data = g_new(WorkerTestData, count);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, worker_cb, &data[i], done_cb, &data[i]);
+    }
+
+    active = count;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < count; i++) {
+        g_assert_cmpint(data[i].n, ==, 1);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+    g_free(data);
+}
+
 static void do_test_cancel(bool sync)
 {
     WorkerTestData data[100];
@@ -233,6 +257,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/submit-overflow", test_submit_overflow);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
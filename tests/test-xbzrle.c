@@ -174,6 +174,52 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_runs(void)
+{
+    uint8_t *buffer = g_malloc0(PAGE_SIZE);
+    uint8_t *test = g_malloc0(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t buf[2];
+    int start, len, dlen, rc;
+
+    /* A single changed run at every offset and of every length up to a
+     * few vectors, so that runs start and end at every lane position.
+     */
+    for (start = 0; start < 256; start++) {
+        for (len = 1; len <= 160; len++) {
+            memset(test + start, 0xff, len);
+
+            dlen = xbzrle_encode_buffer(buffer, test, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            g_assert_cmpint(dlen, ==, uleb128_encode_small(buf, start) +
+                                      uleb128_encode_small(buf, len) + len);
+
+            rc = xbzrle_decode_buffer(compressed, dlen, buffer, PAGE_SIZE);
+            g_assert_cmpint(rc, ==, start + len);
+            g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+
+            memset(test + start, 0, len);
+            memset(buffer + start, 0, len);
+        }
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
+static void test_encode_decode_accel(void)
+{
+    do {
+        test_encode_decode_zero();
+        test_encode_decode_unchanged();
+        test_encode_decode_1_byte();
+        test_encode_decode_overflow();
+        test_encode_decode_runs();
+        test_encode_decode();
+    } while (test_xbzrle_encode_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +232,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_runs", test_encode_decode_runs);
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
@@ -14,6 +14,9 @@
 #ifdef CONFIG_TRACE_SIMPLE
 #include "trace/simple.h"
 #endif
+#ifdef CONFIG_TRACE_RING
+#include "trace/ring.h"
+#endif
 #ifdef CONFIG_TRACE_FTRACE
 #include "trace/ftrace.h"
 #endif
@@ -252,6 +255,12 @@ void trace_init_file(const char *file)
 {
 #ifdef CONFIG_TRACE_SIMPLE
     st_set_trace_file(file);
+#ifdef CONFIG_TRACE_RING
+    /* "--trace file" only applies to the simple backend if both are on */
+    rt_set_trace_file(NULL);
+#endif
+#elif defined CONFIG_TRACE_RING
+    rt_set_trace_file(file);
 #elif defined CONFIG_TRACE_LOG
     /* If both the simple and the log backends are enabled, "--trace file"
      * only applies to the simple backend; use "-D" for the log backend.
@@ -295,6 +304,13 @@ bool trace_init_backends(void)
     }
 #endif
 
+#ifdef CONFIG_TRACE_RING
+    if (!rt_init()) {
+        fprintf(stderr, "failed to initialize ring tracing backend.\n");
+        return false;
+    }
+#endif
+
 #ifdef CONFIG_TRACE_FTRACE
     if (!ftrace_init()) {
         fprintf(stderr, "failed to initialize ftrace backend.\n");
@@ -11,6 +11,9 @@
 #include "qapi/error.h"
 #include "qapi/qapi-commands-trace.h"
 #include "control.h"
+#ifdef CONFIG_TRACE_RING
+#include "trace/ring.h"
+#endif
 
 
 static CPUState *get_cpu(bool has_vcpu, int vcpu, Error **errp)
@@ -168,3 +171,10 @@ void qmp_trace_event_set_state(const char *name, bool enable,
         }
     }
 }
+
+#ifdef CONFIG_TRACE_RING
+void qmp_trace_ring_dump(const char *filename, Error **errp)
+{
+    rt_dump(filename, errp);
+}
+#endif
@@ -0,0 +1,581 @@
+/*
+ * Ring trace backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "trace/control.h"
+#include "trace/ring.h"
+#include "qemu/error-report.h"
+
+/*
+ * Each thread records events into a ring buffer of its own, so emitting an
+ * event takes no lock and no atomic read-modify-write operation.  Only the
+ * thread that owns a ring writes records to it and moves its head; records
+ * become visible to readers when the head is published.
+ *
+ * The rings can be used in two ways:
+ *
+ * - if a trace file was given, a writeout thread drains all rings to the
+ *   file periodically, moving the tails forward.  Events are dropped when
+ *   a ring is full.
+ *
+ * - otherwise the rings work as a flight recorder: a full ring discards its
+ *   oldest records, and a snapshot is written out on demand by rt_dump().
+ *   The owning thread moves the tail here, always before it overwrites the
+ *   data, so a reader that copies the buffer and then rereads the tail
+ *   knows which part of its copy is intact.
+ *
+ * Records carry the host tick counter rather than nanoseconds; the file
+ * contains pairs of tick and get_clock() values that the decoder uses to
+ * convert them.
+ */
+
+/** Trace file magic number, "QEMURING" */
+#define RING_TRACE_MAGIC 0x474e4952554d4551ULL
+
+/** Trace file version number, bump if format changes */
+#define RING_TRACE_VERSION 1
+
+/** Filler at the end of the buffer when a record does not fit there */
+#define RING_PAD_EVENT_ID UINT32_MAX
+
+enum {
+    RING_BUF_LEN = 4096 * 64,       /* per thread, must be a power of two */
+    RING_WRITEOUT_MS = 100,
+    RING_MAX_EXITED = 16,           /* buffers of exited threads kept */
+};
+
+enum {
+    RING_CHUNK_MAPPING,
+    RING_CHUNK_CLOCK,
+    RING_CHUNK_EVENTS,
+};
+
+enum {
+    RING_MODE_OFF,
+    RING_MODE_STREAM,
+    RING_MODE_FLIGHT,
+};
+
+/* Trace buffer entry; the length is a multiple of 8 */
+typedef struct {
+    uint32_t event;
+    uint32_t length;        /* in bytes, including the header */
+    uint64_t timestamp;     /* cpu_get_host_ticks() */
+    uint64_t arguments[];
+} RingTraceRecordHeader;
+
+typedef struct {
+    uint64_t magic;         /* RING_TRACE_MAGIC */
+    uint32_t version;       /* RING_TRACE_VERSION */
+    uint32_t pid;
+} RingTraceFileHeader;
+
+/* The rest of the file is a sequence of chunks */
+typedef struct {
+    uint32_t type;          /* RING_CHUNK_* */
+    uint32_t length;        /* in bytes, excluding the header */
+} RingTraceChunk;
+
+typedef struct {
+    uint64_t ticks;
+    uint64_t ns;
+} RingTraceClock;
+
+/* Followed by the records */
+typedef struct {
+    uint32_t tid;
+    uint32_t reserved;
+    uint64_t dropped;       /* since the previous chunk for this thread */
+} RingTraceEvents;
+
+/* The records of a ring, copied by rt_dump() so it can write them unlocked */
+typedef struct {
+    uint8_t *data;
+    size_t off;
+    size_t len;
+    uint32_t tid;
+} TraceRingSnapshot;
+
+typedef struct TraceRing {
+    uint8_t *buf;
+    size_t head;            /* end of the last finished record */
+    size_t tail;            /* start of the oldest record */
+    unsigned long dropped;
+    unsigned long dropped_written;
+    uint32_t tid;
+    bool exited;
+    Notifier exit_notifier;
+    QTAILQ_ENTRY(TraceRing) next;
+} TraceRing;
+
+/*
+ * Use glib's primitives since QEMU abstractions cannot be used due to
+ * reentrancy in the tracer.  The lock protects the list of rings and the
+ * trace file; it is never taken when recording an event, except for the
+ * first event of each thread.
+ */
+static GMutex ring_lock;
+static GCond ring_writeout_cond;
+static GCond ring_flushed_cond;
+static bool ring_flush_requested;
+static unsigned int ring_writeout_gen;
+
+static QTAILQ_HEAD(, TraceRing) ring_list = QTAILQ_HEAD_INITIALIZER(ring_list);
+static unsigned int ring_nr_exited;
+
+static int ring_mode;
+static uint32_t ring_pid;
+static FILE *ring_fp;
+
+static __thread TraceRing *thread_ring;
+static __thread bool thread_ring_exited;
+
+static void ring_free(TraceRing *ring)
+{
+    QTAILQ_REMOVE(&ring_list, ring, next);
+    ring_nr_exited--;
+    /* don't use g_free, can deadlock when traced */
+    free(ring->buf);
+    free(ring);
+}
+
+static void ring_thread_exit(Notifier *n, void *unused)
+{
+    TraceRing *ring = container_of(n, TraceRing, exit_notifier);
+    TraceRing *old;
+
+    thread_ring = NULL;
+    thread_ring_exited = true;
+
+    g_mutex_lock(&ring_lock);
+    ring->exited = true;
+    if (++ring_nr_exited > RING_MAX_EXITED &&
+        atomic_read(&ring_mode) == RING_MODE_FLIGHT) {
+        QTAILQ_FOREACH(old, &ring_list, next) {
+            if (old->exited) {
+                ring_free(old);
+                break;
+            }
+        }
+    }
+    g_mutex_unlock(&ring_lock);
+}
+
+static TraceRing *ring_new(void)
+{
+    TraceRing *ring;
+
+    if (thread_ring_exited) {
+        return NULL;
+    }
+
+    /* don't use g_malloc, can deadlock when traced */
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->buf = malloc(RING_BUF_LEN);
+    if (!ring->buf) {
+        free(ring);
+        return NULL;
+    }
+    ring->tid = qemu_get_thread_id();
+    ring->exit_notifier.notify = ring_thread_exit;
+    qemu_thread_atexit_add(&ring->exit_notifier);
+
+    g_mutex_lock(&ring_lock);
+    QTAILQ_INSERT_TAIL(&ring_list, ring, next);
+    g_mutex_unlock(&ring_lock);
+
+    thread_ring = ring;
+    return ring;
+}
+
+/* Drop the oldest records until the tail is at or past @tail */
+static void ring_discard(TraceRing *ring, size_t tail)
+{
+    size_t t = ring->tail;
+    RingTraceRecordHeader *hdr;
+
+    while ((ssize_t)(tail - t) > 0) {
+        hdr = (RingTraceRecordHeader *)(ring->buf + (t & (RING_BUF_LEN - 1)));
+        t += hdr->length;
+    }
+
+    /* Readers must see the new tail before they can see new data */
+    atomic_set(&ring->tail, t);
+    smp_wmb();
+}
+
+int rt_record_start(RingTraceRecord *rec, uint32_t event, size_t arglen)
+{
+    TraceRing *ring = thread_ring;
+    RingTraceRecordHeader *hdr;
+    size_t len = ROUND_UP(sizeof(*hdr) + arglen, 8);
+    size_t head, off, pad;
+    int mode = atomic_read(&ring_mode);
+
+    if (mode == RING_MODE_OFF) {
+        return -ENOSPC;
+    }
+    if (unlikely(!ring)) {
+        ring = ring_new();
+        if (!ring) {
+            return -ENOMEM;
+        }
+    }
+
+    head = ring->head;
+    off = head & (RING_BUF_LEN - 1);
+    pad = off + len > RING_BUF_LEN ? RING_BUF_LEN - off : 0;
+
+    if (head + pad + len - atomic_load_acquire(&ring->tail) > RING_BUF_LEN) {
+        if (mode == RING_MODE_STREAM) {
+            /* Trace Buffer Full, Event dropped ! */
+            atomic_set(&ring->dropped, ring->dropped + 1);
+            return -ENOSPC;
+        }
+        ring_discard(ring, head + pad + len - RING_BUF_LEN);
+    }
+
+    if (pad) {
+        /* Only event and length are needed, pad may be as small as 8 */
+        hdr = (RingTraceRecordHeader *)(ring->buf + off);
+        hdr->event = RING_PAD_EVENT_ID;
+        hdr->length = pad;
+        off = 0;
+    }
+
+    hdr = (RingTraceRecordHeader *)(ring->buf + off);
+    hdr->event = event;
+    hdr->length = len;
+    hdr->timestamp = cpu_get_host_ticks();
+
+    rec->ptr = (uint8_t *)hdr->arguments;
+    rec->head = head + pad + len;
+    return 0;
+}
+
+void rt_record_finish(RingTraceRecord *rec)
+{
+    atomic_store_release(&thread_ring->head, rec->head);
+}
+
+static bool ring_write_chunk(FILE *fp, uint32_t type, const void *data,
+                             size_t len, const void *data2, size_t len2)
+{
+    RingTraceChunk chunk = {
+        .type = type,
+        .length = len + len2,
+    };
+
+    return fwrite(&chunk, sizeof(chunk), 1, fp) == 1 &&
+           fwrite(data, len, 1, fp) == 1 &&
+           (!len2 || fwrite(data2, len2, 1, fp) == 1);
+}
+
+static bool ring_write_clock(FILE *fp)
+{
+    RingTraceClock clock = {
+        .ticks = cpu_get_host_ticks(),
+        .ns = get_clock(),
+    };
+
+    return ring_write_chunk(fp, RING_CHUNK_CLOCK,
+                            &clock, sizeof(clock), NULL, 0);
+}
+
+static bool ring_write_header(FILE *fp)
+{
+    RingTraceFileHeader header = {
+        .magic = RING_TRACE_MAGIC,
+        .version = RING_TRACE_VERSION,
+        .pid = ring_pid,
+    };
+    TraceEventIter iter;
+    TraceEvent *ev;
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        return false;
+    }
+
+    trace_event_iter_init(&iter, NULL);
+    while ((ev = trace_event_iter_next(&iter)) != NULL) {
+        uint32_t id = trace_event_get_id(ev);
+        const char *name = trace_event_get_name(ev);
+
+        if (!ring_write_chunk(fp, RING_CHUNK_MAPPING, &id, sizeof(id),
+                              name, strlen(name))) {
+            return false;
+        }
+    }
+
+    return ring_write_clock(fp);
+}
+
+/* Write the records in @data; they may wrap around the end of the buffer */
+static bool ring_write_events(FILE *fp, uint32_t tid, unsigned long dropped,
+                              const uint8_t *data, size_t off, size_t len)
+{
+    struct {
+        RingTraceChunk chunk;
+        RingTraceEvents events;
+    } hdr = {
+        .chunk.type = RING_CHUNK_EVENTS,
+        .chunk.length = sizeof(hdr.events) + len,
+        .events.tid = tid,
+        .events.dropped = dropped,
+    };
+    size_t len1 = MIN(len, RING_BUF_LEN - off);
+
+    return fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+           (!len1 || fwrite(data + off, len1, 1, fp) == 1) &&
+           (len1 == len || fwrite(data, len - len1, 1, fp) == 1);
+}
+
+/* Called with ring_lock held, in stream mode */
+static bool ring_drain(TraceRing *ring)
+{
+    size_t tail = ring->tail;
+    size_t head = atomic_load_acquire(&ring->head);
+    unsigned long dropped = atomic_read(&ring->dropped);
+    bool ret;
+
+    if (head == tail && dropped == ring->dropped_written) {
+        return false;
+    }
+
+    /* Nothing to do on errors, the file is unusable anyway */
+    ret = ring_write_events(ring_fp, ring->tid,
+                            dropped - ring->dropped_written,
+                            ring->buf, tail & (RING_BUF_LEN - 1), head - tail);
+    ring->dropped_written = dropped;
+    atomic_store_release(&ring->tail, head);
+    return ret;
+}
+
+/* Called with ring_lock held, in flight recorder mode */
+static bool ring_snapshot(TraceRing *ring, TraceRingSnapshot *snap)
+{
+    size_t head, tail, skip, len, off, len1;
+
+    /* don't use g_malloc, can deadlock when traced */
+    snap->data = malloc(RING_BUF_LEN);
+    if (!snap->data) {
+        return false;
+    }
+    snap->tid = ring->tid;
+
+    /* The tail must be read first, it is never past the head */
+    do {
+        tail = atomic_read(&ring->tail);
+        smp_rmb();
+        head = atomic_load_acquire(&ring->head);
+    } while (head - tail > RING_BUF_LEN);
+
+    len = head - tail;
+    off = tail & (RING_BUF_LEN - 1);
+    len1 = MIN(len, RING_BUF_LEN - off);
+    memcpy(snap->data, ring->buf + off, len1);
+    memcpy(snap->data + len1, ring->buf, len - len1);
+
+    /* Records that were discarded while copying may have been overwritten */
+    smp_rmb();
+    skip = MIN(atomic_read(&ring->tail) - tail, len);
+    snap->off = skip;
+    snap->len = len - skip;
+    return true;
+}
+
+/* Called with ring_lock held, in stream mode */
+static void ring_writeout(void)
+{
+    TraceRing *ring, *next;
+    bool written = false;
+
+    QTAILQ_FOREACH_SAFE(ring, &ring_list, next, next) {
+        written |= ring_drain(ring);
+        if (ring->exited) {
+            ring_free(ring);
+        }
+    }
+
+    if (written) {
+        ring_write_clock(ring_fp);
+        fflush(ring_fp);
+    }
+}
+
+static gpointer ring_writeout_thread(gpointer opaque)
+{
+    gint64 deadline;
+
+    g_mutex_lock(&ring_lock);
+    for (;;) {
+        deadline = g_get_monotonic_time() +
+                   RING_WRITEOUT_MS * G_TIME_SPAN_MILLISECOND;
+        while (!ring_flush_requested) {
+            if (!g_cond_wait_until(&ring_writeout_cond, &ring_lock,
+                                   deadline)) {
+                break;
+            }
+        }
+
+        ring_flush_requested = false;
+        ring_writeout();
+        ring_writeout_gen++;
+        g_cond_broadcast(&ring_flushed_cond);
+    }
+    g_mutex_unlock(&ring_lock);
+    return NULL;
+}
+
+void rt_flush_trace_buffer(void)
+{
+    unsigned int gen;
+
+    if (atomic_read(&ring_mode) != RING_MODE_STREAM) {
+        return;
+    }
+
+    g_mutex_lock(&ring_lock);
+    gen = ring_writeout_gen;
+    ring_flush_requested = true;
+    g_cond_signal(&ring_writeout_cond);
+    while (ring_writeout_gen == gen) {
+        g_cond_wait(&ring_flushed_cond, &ring_lock);
+    }
+    g_mutex_unlock(&ring_lock);
+}
+
+void rt_dump(const char *file, Error **errp)
+{
+    TraceRing *ring;
+    TraceRingSnapshot *snaps;
+    unsigned int nr = 0, i = 0, j;
+    FILE *fp;
+    bool ok = true;
+
+    if (atomic_read(&ring_mode) != RING_MODE_FLIGHT) {
+        error_setg(errp, "Trace ring buffers are not in flight recorder mode");
+        return;
+    }
+
+    fp = fopen(file, "wb");
+    if (!fp) {
+        error_setg_file_open(errp, errno, file);
+        return;
+    }
+
+    /* Only copy the rings under the lock, writing the file can be slow */
+    g_mutex_lock(&ring_lock);
+    QTAILQ_FOREACH(ring, &ring_list, next) {
+        nr++;
+    }
+    snaps = calloc(nr + 1, sizeof(*snaps));
+    if (snaps) {
+        QTAILQ_FOREACH(ring, &ring_list, next) {
+            if (!ring_snapshot(ring, &snaps[i])) {
+                ok = false;
+                break;
+            }
+            i++;
+        }
+    }
+    g_mutex_unlock(&ring_lock);
+
+    if (!snaps || !ok) {
+        error_setg(errp, "Could not allocate trace snapshot buffer");
+        goto out;
+    }
+
+    ok = ring_write_header(fp);
+    for (j = 0; j < i; j++) {
+        ok = ok && (!snaps[j].len ||
+                    ring_write_events(fp, snaps[j].tid, 0, snaps[j].data,
+                                      snaps[j].off, snaps[j].len));
+    }
+    ok = ok && ring_write_clock(fp);
+    if (!ok) {
+        error_setg_errno(errp, errno, "Could not write trace to '%s'", file);
+    }
+
+out:
+    for (j = 0; j < i; j++) {
+        free(snaps[j].data);
+    }
+    free(snaps);
+    if (fclose(fp) != 0 && ok) {
+        error_setg_errno(errp, errno, "Could not write trace to '%s'", file);
+    }
+}
+
+/* Helper function to create a thread with signals blocked, see simple.c */
+static GThread *trace_thread_create(GThreadFunc fn)
+{
+    GThread *thread;
+#ifndef _WIN32
+    sigset_t set, oldset;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+#endif
+
+    thread = g_thread_new("trace-ring", fn, NULL);
+
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#endif
+
+    return thread;
+}
+
+/**
+ * Start recording events
+ *
+ * @file        The trace file name, or NULL for flight recorder mode
+ */
+void rt_set_trace_file(const char *file)
+{
+    if (atomic_read(&ring_mode) != RING_MODE_OFF) {
+        return;
+    }
+
+    if (file) {
+        ring_fp = fopen(file, "wb");
+        if (ring_fp && ring_write_header(ring_fp) &&
+            trace_thread_create(ring_writeout_thread)) {
+            atomic_set(&ring_mode, RING_MODE_STREAM);
+            atexit(rt_flush_trace_buffer);
+            return;
+        }
+
+        warn_report("could not write trace file '%s', "
+                    "using flight recorder mode", file);
+        if (ring_fp) {
+            fclose(ring_fp);
+            ring_fp = NULL;
+        }
+    }
+
+    atomic_set(&ring_mode, RING_MODE_FLIGHT);
+}
+
+bool rt_init(void)
+{
+    ring_pid = getpid();
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+ * Ring trace backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+bool rt_init(void);
+void rt_set_trace_file(const char *file);
+void rt_flush_trace_buffer(void);
+
+/**
+ * rt_dump:
+ * @file: Name of the file to write
+ * @errp: Error object
+ *
+ * Write a snapshot of all per-thread ring buffers to @file.  Only
+ * available in flight recorder mode, i.e. when no trace file was set.
+ */
+void rt_dump(const char *file, Error **errp);
+
+typedef struct {
+    uint8_t *ptr;       /* where the next argument goes */
+    size_t head;        /* ring offset just past the record */
+} RingTraceRecord;
+
+#define RING_TRACE_MAX_STRLEN 512
+
+/**
+ * Initialize a trace record and claim space for it in the calling thread's
+ * ring buffer
+ *
+ * @arglen  number of bytes required for arguments
+ */
+int rt_record_start(RingTraceRecord *rec, uint32_t event, size_t arglen);
+
+/**
+ * Append a 64-bit argument to a trace record
+ */
+static inline void rt_record_write_u64(RingTraceRecord *rec, uint64_t val)
+{
+    memcpy(rec->ptr, &val, sizeof(val));
+    rec->ptr += sizeof(val);
+}
+
+/**
+ * Append a string argument to a trace record
+ */
+static inline void rt_record_write_str(RingTraceRecord *rec, const char *s,
+                                       uint32_t slen)
+{
+    memcpy(rec->ptr, &slen, sizeof(slen));
+    if (slen) {
+        memcpy(rec->ptr + sizeof(slen), s, slen);
+    }
+    rec->ptr += sizeof(slen) + slen;
+}
+
+/**
+ * Mark a trace record completed and make it visible to readers
+ *
+ * Don't append any more arguments to the trace record after calling this.
+ */
+void rt_record_finish(RingTraceRecord *rec);
+
+#endif /* TRACE_RING_H */
@@ -23,6 +23,9 @@
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+#include <poll.h>
+#endif
 
 struct AioHandler
 {
@@ -36,6 +39,12 @@ struct AioHandler
     void *opaque;
     bool is_external;
     QLIST_ENTRY(AioHandler) node;
+#ifdef CONFIG_LINUX_IO_URING
+    QSLIST_ENTRY(AioHandler) io_uring_next;
+    bool io_uring_queued;       /* on ctx->io_uring_submit_list */
+    bool io_uring_armed;        /* a poll request is in flight */
+    bool io_uring_parked;       /* waiting for external clients */
+#endif
 };
 
 #ifdef CONFIG_EPOLL_CREATE1
@@ -187,6 +196,365 @@ static bool aio_epoll_check_poll(AioContext *ctx, GPollFD *pfds,
 
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+
+#define AIO_IO_URING_ENTRIES 256
+
+/* user_data of a CQE is either an AioHandler whose poll request completed,
+ * an AioUringRequest tagged with AIO_IO_URING_REQUEST, one of these
+ * constants, or NULL for poll removals.
+ */
+#define AIO_IO_URING_REQUEST 1
+#define AIO_IO_URING_TIMEOUT 2
+
+static inline unsigned poll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? POLLIN : 0) |
+           (pfd_events & G_IO_OUT ? POLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? POLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? POLLERR : 0);
+}
+
+static inline int pfd_events_from_poll(int poll_events)
+{
+    return (poll_events & POLLIN ? G_IO_IN : 0) |
+           (poll_events & POLLOUT ? G_IO_OUT : 0) |
+           (poll_events & POLLHUP ? G_IO_HUP : 0) |
+           (poll_events & POLLERR ? G_IO_ERR : 0);
+}
+
+static struct io_uring_sqe *aio_io_uring_get_sqe(AioContext *ctx)
+{
+    struct io_uring *ring = &ctx->io_uring;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    int ret;
+
+    if (likely(sqe)) {
+        return sqe;
+    }
+
+    /* No free sqes left, submit the pending ones first */
+    do {
+        ret = io_uring_submit(ring);
+    } while (ret == -EINTR);
+    assert(ret > 0);
+
+    sqe = io_uring_get_sqe(ring);
+    assert(sqe);
+    return sqe;
+}
+
+/* Called from the home thread to (re)start polling a handler's fd */
+static void aio_io_uring_arm(AioContext *ctx, AioHandler *node)
+{
+    struct io_uring_sqe *sqe;
+
+    if (node->deleted || !node->pfd.events ||
+        node->io_uring_armed || node->io_uring_parked) {
+        return;
+    }
+
+    /* aio_dispatch_handlers() would skip the handler anyway.  Arming it
+     * again would only make the poll request complete over and over.
+     */
+    if (!aio_node_check(ctx, node->is_external)) {
+        node->io_uring_parked = true;
+        ctx->io_uring_nr_parked++;
+        return;
+    }
+
+    sqe = aio_io_uring_get_sqe(ctx);
+    io_uring_prep_poll_add(sqe, node->pfd.fd,
+                           poll_events_from_pfd(node->pfd.events));
+    io_uring_sqe_set_data(sqe, node);
+    node->io_uring_armed = true;
+}
+
+/* Called with list_lock taken, from any thread */
+static void aio_io_uring_update(AioContext *ctx, AioHandler *node)
+{
+    if (!ctx->io_uring_enabled) {
+        return;
+    }
+    if (!atomic_xchg(&node->io_uring_queued, true)) {
+        QSLIST_INSERT_HEAD_ATOMIC(&ctx->io_uring_submit_list, node,
+                                  io_uring_next);
+    }
+}
+
+/* Deleted handlers must stay around until the kernel is done with them */
+static bool aio_io_uring_busy(AioHandler *node)
+{
+    return node->io_uring_armed || atomic_read(&node->io_uring_queued);
+}
+
+/* Returns the number of deleted handlers that io_uring is done with */
+static int aio_io_uring_fill_sq(AioContext *ctx)
+{
+    QSLIST_HEAD(, AioHandler) submit_list;
+    AioHandler *node;
+    int nr_deleted = 0;
+
+    if (ctx->io_uring_nr_parked && !aio_external_disabled(ctx)) {
+        ctx->io_uring_nr_parked = 0;
+        QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+            if (node->io_uring_parked) {
+                node->io_uring_parked = false;
+                aio_io_uring_arm(ctx, node);
+            }
+        }
+    }
+
+    QSLIST_MOVE_ATOMIC(&submit_list, &ctx->io_uring_submit_list);
+    while ((node = QSLIST_FIRST(&submit_list))) {
+        QSLIST_REMOVE_HEAD(&submit_list, io_uring_next);
+        atomic_mb_set(&node->io_uring_queued, false);
+
+        if (node->io_uring_armed) {
+            /* The events changed or the handler is going away.  Cancel the
+             * poll request, aio_io_uring_poll_done() arms it again with the
+             * new events if needed.
+             */
+            struct io_uring_sqe *sqe = aio_io_uring_get_sqe(ctx);
+
+            io_uring_prep_rw(IORING_OP_POLL_REMOVE, sqe, -1, node, 0, 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        } else if (node->deleted) {
+            /* No completion will come for it, so make sure that
+             * aio_dispatch_handlers() runs and frees it.
+             */
+            nr_deleted++;
+        } else {
+            aio_io_uring_arm(ctx, node);
+        }
+    }
+    return nr_deleted;
+}
+
+static void aio_io_uring_poll_done(AioContext *ctx, AioHandler *node, int res)
+{
+    node->io_uring_armed = false;
+    if (res > 0) {
+        node->pfd.revents |= pfd_events_from_poll(res);
+    }
+
+    /* Poll requests are one-shot.  The handler runs before the next
+     * io_uring_enter(2), so level-triggered semantics are preserved.
+     */
+    aio_io_uring_arm(ctx, node);
+}
+
+static int aio_io_uring_reap(AioContext *ctx)
+{
+    struct io_uring_cqe *cqe;
+    int n = 0;
+
+    while (io_uring_peek_cqe(&ctx->io_uring, &cqe) == 0) {
+        uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+
+        io_uring_cqe_seen(&ctx->io_uring, cqe);
+
+        if (data == AIO_IO_URING_TIMEOUT) {
+            /* -ETIME on expiry; -EINVAL means no timeout support */
+            if (res == -EINVAL) {
+                ctx->io_uring_failed = true;
+            }
+            continue;
+        } else if (!data) {
+            continue;
+        } else if (data & AIO_IO_URING_REQUEST) {
+            AioUringRequest *req = (AioUringRequest *)
+                                   (data & ~AIO_IO_URING_REQUEST);
+
+            req->res = res;
+            ctx->io_uring_inflight--;
+            QSIMPLEQ_INSERT_TAIL(&ctx->io_uring_completed, req, next);
+        } else {
+            aio_io_uring_poll_done(ctx, (AioHandler *)data, res);
+        }
+        n++;
+    }
+    return n;
+}
+
+/* Submit everything that is queued and wait for events with a single
+ * io_uring_enter(2).  Returns the number of completions that were reaped,
+ * plus the number of deleted handlers that can be freed; if positive,
+ * aio_dispatch_handlers() must be called.
+ */
+static int aio_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    unsigned wait_nr = 0;
+    int nr_deleted;
+    int ret;
+
+    nr_deleted = aio_io_uring_fill_sq(ctx);
+
+    /* Don't block if there are completions to reap already */
+    if (timeout && io_uring_peek_cqe(&ctx->io_uring, &cqe) != 0) {
+        wait_nr = 1;
+        if (timeout > 0) {
+            struct io_uring_sqe *sqe = aio_io_uring_get_sqe(ctx);
+
+            ts.tv_sec = timeout / NANOSECONDS_PER_SECOND;
+            ts.tv_nsec = timeout % NANOSECONDS_PER_SECOND;
+            io_uring_prep_timeout(sqe, &ts, 1, 0);
+            io_uring_sqe_set_data(sqe, (void *)AIO_IO_URING_TIMEOUT);
+        }
+    }
+
+    if (wait_nr || io_uring_sq_ready(&ctx->io_uring)) {
+        do {
+            ret = io_uring_submit_and_wait(&ctx->io_uring, wait_nr);
+        } while (ret == -EINTR);
+        assert(ret >= 0);
+    }
+
+    return aio_io_uring_reap(ctx) + nr_deleted;
+}
+
+static bool aio_io_uring_dispatch(AioContext *ctx)
+{
+    AioUringRequest *req;
+    bool progress = false;
+
+    if (!in_aio_context_home_thread(ctx)) {
+        return false;
+    }
+
+    /* Remove each request before calling it, in case the callback
+     * calls aio_poll().
+     */
+    while ((req = QSIMPLEQ_FIRST(&ctx->io_uring_completed))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->io_uring_completed, next);
+        req->cb(req);
+        progress = true;
+    }
+    return progress;
+}
+
+static bool aio_io_uring_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    if (io_uring_queue_init(AIO_IO_URING_ENTRIES, &ctx->io_uring, 0) < 0) {
+        /* Probably an old kernel, don't try again */
+        ctx->io_uring_failed = true;
+        return false;
+    }
+
+    qemu_lockcnt_lock(&ctx->list_lock);
+    ctx->io_uring_enabled = true;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        aio_io_uring_arm(ctx, node);
+    }
+    qemu_lockcnt_unlock(&ctx->list_lock);
+    return true;
+}
+
+static void aio_io_uring_disable(AioContext *ctx)
+{
+    QSLIST_HEAD(, AioHandler) submit_list;
+    AioHandler *node;
+
+    /* Requests must complete before the ring goes away.  Their callbacks
+     * still run from aio_io_uring_dispatch().
+     */
+    qemu_lockcnt_inc(&ctx->list_lock);
+    while (ctx->io_uring_inflight) {
+        io_uring_submit_and_wait(&ctx->io_uring, 1);
+        aio_io_uring_reap(ctx);
+    }
+    qemu_lockcnt_dec(&ctx->list_lock);
+
+    qemu_lockcnt_lock(&ctx->list_lock);
+    ctx->io_uring_enabled = false;
+    io_uring_queue_exit(&ctx->io_uring);
+
+    /* Closing the ring cancelled every poll request */
+    QSLIST_MOVE_ATOMIC(&submit_list, &ctx->io_uring_submit_list);
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        node->io_uring_queued = false;
+        node->io_uring_armed = false;
+        node->io_uring_parked = false;
+    }
+    ctx->io_uring_nr_parked = 0;
+    qemu_lockcnt_unlock(&ctx->list_lock);
+}
+
+/* Called from aio_poll(), returns whether to wait with io_uring */
+static bool aio_io_uring_check(AioContext *ctx)
+{
+    /* The ring is not thread-safe.  Other threads can still run a
+     * non-blocking aio_poll(), e.g. bdrv_drain_poll_top_level() from
+     * the main thread; they fall back to ppoll(2).
+     */
+    if (!in_aio_context_home_thread(ctx)) {
+        return false;
+    }
+
+    if (ctx->io_uring_enabled) {
+        if (!atomic_read(&ctx->use_g_source) && !ctx->io_uring_failed) {
+            return true;
+        }
+        aio_io_uring_disable(ctx);
+        return false;
+    }
+    if (atomic_read(&ctx->use_g_source) || ctx->io_uring_failed) {
+        return false;
+    }
+    return aio_io_uring_try_enable(ctx);
+}
+
+bool aio_add_sqe(AioContext *ctx,
+                 void (*prep_sqe)(struct io_uring_sqe *sqe, void *opaque),
+                 void *opaque, AioUringRequest *req)
+{
+    struct io_uring_sqe *sqe;
+
+    assert(in_aio_context_home_thread(ctx));
+    if (!aio_io_uring_check(ctx)) {
+        return false;
+    }
+
+    sqe = aio_io_uring_get_sqe(ctx);
+    prep_sqe(sqe, opaque);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)req | AIO_IO_URING_REQUEST));
+    ctx->io_uring_inflight++;
+    return true;
+}
+
+#else
+
+static void aio_io_uring_update(AioContext *ctx, AioHandler *node)
+{
+}
+
+static bool aio_io_uring_busy(AioHandler *node)
+{
+    return false;
+}
+
+static int aio_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    assert(false);
+}
+
+static bool aio_io_uring_dispatch(AioContext *ctx)
+{
+    return false;
+}
+
+static bool aio_io_uring_check(AioContext *ctx)
+{
+    return false;
+}
+
+#endif
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -232,8 +600,10 @@ void aio_set_fd_handler(AioContext *ctx,
             g_source_remove_poll(&ctx->source, &node->pfd);
         }
 
-        /* If a read is in progress, just mark the node as deleted */
-        if (qemu_lockcnt_count(&ctx->list_lock)) {
+        /* If a read is in progress, or io_uring still has a poll request
+         * for the node, just mark the node as deleted
+         */
+        if (qemu_lockcnt_count(&ctx->list_lock) || aio_io_uring_busy(node)) {
             node->deleted = 1;
             node->pfd.revents = 0;
         } else {
@@ -274,7 +644,16 @@ void aio_set_fd_handler(AioContext *ctx,
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
     }
 
-    aio_epoll_update(ctx, node, is_new);
+    if (deleted) {
+        /* The node is freed below, so it must not stay in the epoll set
+         * or be queued for io_uring, which would touch it later.
+         */
+        node->pfd.events = 0;
+        aio_epoll_update(ctx, node, false);
+    } else {
+        aio_epoll_update(ctx, node, is_new);
+        aio_io_uring_update(ctx, node);
+    }
     qemu_lockcnt_unlock(&ctx->list_lock);
     aio_notify(ctx);
 
@@ -418,7 +797,7 @@ static bool aio_dispatch_handlers(AioContext *ctx)
             progress = true;
         }
 
-        if (node->deleted) {
+        if (node->deleted && !aio_io_uring_busy(node)) {
             if (qemu_lockcnt_dec_if_lock(&ctx->list_lock)) {
                 QLIST_REMOVE(node, node);
                 g_free(node);
@@ -432,12 +811,17 @@ static bool aio_dispatch_handlers(AioContext *ctx)
 
 void aio_dispatch(AioContext *ctx)
 {
+    AioBHBatch batch;
+
+    aio_bh_batch_begin(ctx, &batch);
     qemu_lockcnt_inc(&ctx->list_lock);
     aio_bh_poll(ctx);
+    aio_io_uring_dispatch(ctx);
     aio_dispatch_handlers(ctx);
     qemu_lockcnt_dec(&ctx->list_lock);
 
     timerlistgroup_run_timers(&ctx->tlg);
+    aio_bh_batch_end(&batch);
 }
 
 /* These thread-local variables are used only in a small part of aio_poll
@@ -582,6 +966,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     bool progress;
     int64_t timeout;
     int64_t start = 0;
+    AioBHBatch batch;
 
     /* aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
@@ -595,6 +980,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
         atomic_add(&ctx->notify_me, 2);
     }
 
+    aio_bh_batch_begin(ctx, &batch);
     qemu_lockcnt_inc(&ctx->list_lock);
 
     if (ctx->poll_max_ns) {
@@ -602,7 +988,13 @@ bool aio_poll(AioContext *ctx, bool blocking)
     }
 
     progress = try_poll_mode(ctx, blocking);
-    if (!progress) {
+    if (aio_io_uring_check(ctx)) {
+        /* Even if polling made progress, submit queued requests and reap
+         * the completions that are already there.
+         */
+        timeout = blocking && !progress ? aio_compute_timeout(ctx) : 0;
+        ret = aio_io_uring_wait(ctx, timeout);
+    } else if (!progress) {
         assert(npfd == 0);
 
         /* fill pollfds */
@@ -688,6 +1080,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     npfd = 0;
 
     progress |= aio_bh_poll(ctx);
+    progress |= aio_io_uring_dispatch(ctx);
 
     if (ret > 0) {
         progress |= aio_dispatch_handlers(ctx);
@@ -696,12 +1089,17 @@ bool aio_poll(AioContext *ctx, bool blocking)
     qemu_lockcnt_dec(&ctx->list_lock);
 
     progress |= timerlistgroup_run_timers(&ctx->tlg);
+    progress |= aio_bh_batch_end(&batch);
 
     return progress;
 }
 
 void aio_context_setup(AioContext *ctx)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    QSLIST_INIT(&ctx->io_uring_submit_list);
+    QSIMPLEQ_INIT(&ctx->io_uring_completed);
+#endif
 #ifdef CONFIG_EPOLL_CREATE1
     assert(!ctx->epollfd);
     ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
@@ -716,6 +1114,23 @@ void aio_context_setup(AioContext *ctx)
 
 void aio_context_destroy(AioContext *ctx)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->io_uring_enabled) {
+        AioHandler *node, *tmp;
+
+        assert(!ctx->io_uring_inflight);
+        io_uring_queue_exit(&ctx->io_uring);
+        ctx->io_uring_enabled = false;
+
+        /* Free the handlers that were waiting for their poll requests */
+        QLIST_FOREACH_SAFE(node, &ctx->aio_handlers, node, tmp) {
+            if (node->deleted) {
+                QLIST_REMOVE(node, node);
+                g_free(node);
+            }
+        }
+    }
+#endif
 #ifdef CONFIG_EPOLL_CREATE1
     aio_epoll_disable(ctx);
 #endif
@@ -315,11 +315,15 @@ static bool aio_dispatch_handlers(AioContext *ctx, HANDLE event)
 
 void aio_dispatch(AioContext *ctx)
 {
+    AioBHBatch batch;
+
+    aio_bh_batch_begin(ctx, &batch);
     qemu_lockcnt_inc(&ctx->list_lock);
     aio_bh_poll(ctx);
     aio_dispatch_handlers(ctx, INVALID_HANDLE_VALUE);
     qemu_lockcnt_dec(&ctx->list_lock);
     timerlistgroup_run_timers(&ctx->tlg);
+    aio_bh_batch_end(&batch);
 }
 
 bool aio_poll(AioContext *ctx, bool blocking)
@@ -329,6 +333,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     bool progress, have_select_revents, first;
     int count;
     int timeout;
+    AioBHBatch batch;
 
     progress = false;
 
@@ -343,6 +348,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
         atomic_add(&ctx->notify_me, 2);
     }
 
+    aio_bh_batch_begin(ctx, &batch);
     qemu_lockcnt_inc(&ctx->list_lock);
     have_select_revents = aio_prepare(ctx);
 
@@ -401,6 +407,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     qemu_lockcnt_dec(&ctx->list_lock);
 
     progress |= timerlistgroup_run_timers(&ctx->tlg);
+    progress |= aio_bh_batch_end(&batch);
     return progress;
 }
 
@@ -30,6 +30,8 @@
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/rcu_queue.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine_int.h"
 #include "trace.h"
@@ -37,16 +39,114 @@
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+enum {
+    /* Already enqueued and waiting for aio_bh_poll() */
+    BH_PENDING   = (1 << 0),
+
+    /* Invoke the callback */
+    BH_SCHEDULED = (1 << 1),
+
+    /* Delete without invoking callback */
+    BH_DELETED   = (1 << 2),
+
+    /* Delete after invoking callback */
+    BH_ONESHOT   = (1 << 3),
+
+    /* Schedule periodically when the event loop is idle */
+    BH_IDLE      = (1 << 4),
+
+    /* Linked into an AioBHBatch by qemu_bh_schedule_batched() */
+    BH_BATCHED   = (1 << 5),
+};
+
 struct QEMUBH {
+    struct rcu_head rcu;
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
-    bool scheduled;
-    bool idle;
-    bool deleted;
+    QSLIST_ENTRY(QEMUBH) next;
+    QSLIST_ENTRY(QEMUBH) batch_next;
+    unsigned flags;
 };
 
+/* Innermost event loop iteration of the current thread */
+static __thread AioBHBatch *bh_batch;
+
+/* BHs taken by the aio_bh_poll() calls of the current thread, one slice
+ * per nested call.  A non-blocking aio_poll() can run concurrently with
+ * the home thread's, e.g. while draining, so slices must not be shared.
+ */
+static __thread QSIMPLEQ_HEAD(, BHListSlice) bh_slice_list;
+
+static BHListSlice *aio_bh_first_slice(AioContext *ctx)
+{
+    BHListSlice *s;
+
+    QSIMPLEQ_FOREACH(s, &bh_slice_list, next) {
+        if (s->ctx == ctx) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Another thread may still be walking a list that held @bh, see
+ * aio_compute_timeout() and aio_ctx_check(), so wait for a grace period.
+ */
+static void aio_bh_free(QEMUBH *bh)
+{
+    g_free_rcu(bh, rcu);
+}
+
+/* Called concurrently from any thread */
+static void aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
+{
+    AioContext *ctx = bh->ctx;
+    unsigned old_flags;
+
+    /* The memory barrier implicit in atomic_fetch_or makes sure that:
+     * 1. idle & any writes needed by the callback are done before the
+     *    locations are read in the aio_bh_poll.
+     * 2. ctx is loaded before the callback has a chance to execute and bh
+     *    could be freed.
+     */
+    old_flags = atomic_fetch_or(&bh->flags, BH_PENDING | new_flags);
+    if (!(old_flags & BH_PENDING)) {
+        QSLIST_INSERT_HEAD_ATOMIC(&ctx->bh_list, bh, next);
+    }
+
+    /* Only wake up the event loop for the first non-idle schedule; if the
+     * BH was already scheduled, aio_bh_poll has not cleared BH_SCHEDULED
+     * yet and will run the callback anyway.
+     */
+    if ((new_flags & (BH_SCHEDULED | BH_IDLE)) == BH_SCHEDULED &&
+        !(old_flags & BH_SCHEDULED)) {
+        aio_notify(ctx);
+    }
+}
+
+/* Only called from aio_bh_poll() and aio_ctx_finalize() */
+static QEMUBH *aio_bh_dequeue(BHList *head, unsigned *flags)
+{
+    QEMUBH *bh = QSLIST_FIRST_RCU(head);
+
+    if (!bh) {
+        return NULL;
+    }
+
+    QSLIST_REMOVE_HEAD(head, next);
+
+    /* The atomic_fetch_and is paired with aio_bh_enqueue().  The implicit
+     * memory barrier ensures that the callback sees all writes done by the
+     * scheduling thread.  It also ensures that the scheduling thread sees
+     * the cleared flags before bh->cb has run, and thus will call
+     * aio_notify again if necessary.
+     */
+    *flags = atomic_fetch_and(&bh->flags,
+                              ~(BH_PENDING | BH_SCHEDULED | BH_IDLE));
+    return bh;
+}
+
 void aio_bh_schedule_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
 {
     QEMUBH *bh;
@@ -56,15 +156,7 @@ void aio_bh_schedule_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
         .cb = cb,
         .opaque = opaque,
     };
-    qemu_lockcnt_lock(&ctx->list_lock);
-    bh->next = ctx->first_bh;
-    bh->scheduled = 1;
-    bh->deleted = 1;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
-    qemu_lockcnt_unlock(&ctx->list_lock);
-    aio_notify(ctx);
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_ONESHOT);
 }
 
 QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
@@ -76,12 +168,6 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
         .cb = cb,
         .opaque = opaque,
     };
-    qemu_lockcnt_lock(&ctx->list_lock);
-    bh->next = ctx->first_bh;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
-    qemu_lockcnt_unlock(&ctx->list_lock);
     return bh;
 }
 
@@ -90,91 +176,164 @@ void aio_bh_call(QEMUBH *bh)
     bh->cb(bh->opaque);
 }
 
-/* Multiple occurrences of aio_bh_poll cannot be called concurrently.
- * The count in ctx->list_lock is incremented before the call, and is
- * not affected by the call.
+/* Only the BHs that were scheduled are visited; nested calls (from a BH
+ * callback that runs aio_poll) continue with the slices of the outer calls
+ * in the same thread.
  */
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
-    int ret;
-    bool deleted = false;
-
-    ret = 0;
-    for (bh = atomic_rcu_read(&ctx->first_bh); bh; bh = next) {
-        next = atomic_rcu_read(&bh->next);
-        /* The atomic_xchg is paired with the one in qemu_bh_schedule.  The
-         * implicit memory barrier ensures that the callback sees all writes
-         * done by the scheduling thread.  It also ensures that the scheduling
-         * thread sees the zero before bh->cb has run, and thus will call
-         * aio_notify again if necessary.
-         */
-        if (atomic_xchg(&bh->scheduled, 0)) {
+    BHListSlice slice;
+    BHListSlice *s;
+    int ret = 0;
+
+    /* A thread-local cannot be statically initialized with its address */
+    if (!bh_slice_list.sqh_last) {
+        QSIMPLEQ_INIT(&bh_slice_list);
+    }
+
+    slice.ctx = ctx;
+    QSLIST_MOVE_ATOMIC(&slice.bh_list, &ctx->bh_list);
+    QSIMPLEQ_INSERT_TAIL(&bh_slice_list, &slice, next);
+
+    while ((s = aio_bh_first_slice(ctx))) {
+        QEMUBH *bh;
+        unsigned flags;
+
+        bh = aio_bh_dequeue(&s->bh_list, &flags);
+        if (!bh) {
+            QSIMPLEQ_REMOVE(&bh_slice_list, s, BHListSlice, next);
+            continue;
+        }
+
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
             /* Idle BHs don't count as progress */
-            if (!bh->idle) {
+            if (!(flags & BH_IDLE)) {
                 ret = 1;
             }
-            bh->idle = 0;
             aio_bh_call(bh);
         }
-        if (bh->deleted) {
-            deleted = true;
+
+        /* A batched BH is freed by aio_bh_batch_end() instead */
+        if ((flags & (BH_DELETED | BH_ONESHOT)) && !(flags & BH_BATCHED)) {
+            aio_bh_free(bh);
         }
     }
 
-    /* remove deleted bhs */
-    if (!deleted) {
-        return ret;
+    return ret;
+}
+
+/* Hand the BHs of @batch over to aio_bh_poll() */
+static void aio_bh_batch_flush(AioBHBatch *batch)
+{
+    QEMUBH *bh;
+    unsigned flags;
+
+    while ((bh = QSLIST_FIRST(&batch->bh_list))) {
+        QSLIST_REMOVE_HEAD(&batch->bh_list, batch_next);
+
+        flags = atomic_fetch_and(&bh->flags, ~BH_BATCHED);
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            aio_bh_enqueue(bh, BH_SCHEDULED);
+        } else if ((flags & (BH_DELETED | BH_PENDING)) == BH_DELETED) {
+            aio_bh_free(bh);
+        }
     }
+}
 
-    if (qemu_lockcnt_dec_if_lock(&ctx->list_lock)) {
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted && !bh->scheduled) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
-            }
+static bool aio_bh_batch_pending(AioContext *ctx)
+{
+    return bh_batch && bh_batch->ctx == ctx &&
+           !QSLIST_EMPTY(&bh_batch->bh_list);
+}
+
+void aio_bh_batch_begin(AioContext *ctx, AioBHBatch *batch)
+{
+    /* A nested event loop might wait for something that the enclosing
+     * iteration has batched, so don't hold it back.
+     */
+    if (bh_batch && bh_batch->ctx == ctx) {
+        aio_bh_batch_flush(bh_batch);
+    }
+
+    batch->ctx = ctx;
+    QSLIST_INIT(&batch->bh_list);
+    batch->prev = bh_batch;
+    bh_batch = batch;
+}
+
+bool aio_bh_batch_end(AioBHBatch *batch)
+{
+    QEMUBH *bh;
+    unsigned flags;
+    bool progress = false;
+
+    /* Pop the batch first, so that BHs that reschedule themselves end up
+     * in the enclosing iteration instead of looping here.
+     */
+    assert(bh_batch == batch);
+    bh_batch = batch->prev;
+
+    while ((bh = QSLIST_FIRST(&batch->bh_list))) {
+        QSLIST_REMOVE_HEAD(&batch->bh_list, batch_next);
+
+        flags = atomic_fetch_and(&bh->flags, ~(BH_BATCHED | BH_SCHEDULED));
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            progress = true;
+            aio_bh_call(bh);
+        }
+
+        /* If still pending, aio_bh_poll() frees it */
+        if ((flags & (BH_DELETED | BH_PENDING)) == BH_DELETED) {
+            aio_bh_free(bh);
         }
-        qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
     }
-    return ret;
+
+    return progress;
 }
 
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
-    bh->idle = 1;
-    /* Make sure that idle & any writes needed by the callback are done
-     * before the locations are read in the aio_bh_poll.
-     */
-    atomic_mb_set(&bh->scheduled, 1);
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_IDLE);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    AioContext *ctx;
+    AioContext *ctx = bh->ctx;
 
-    ctx = bh->ctx;
-    bh->idle = 0;
-    /* The memory barrier implicit in atomic_xchg makes sure that:
-     * 1. idle & any writes needed by the callback are done before the
-     *    locations are read in the aio_bh_poll.
-     * 2. ctx is loaded before scheduled is set and the callback has a chance
-     *    to execute.
-     */
-    if (atomic_xchg(&bh->scheduled, 1) == 0) {
+    if (atomic_read(&bh->flags) & BH_IDLE) {
+        /* An idle BH did not wake up the event loop, do it now */
+        atomic_and(&bh->flags, ~BH_IDLE);
+        aio_bh_enqueue(bh, BH_SCHEDULED);
         aio_notify(ctx);
+        return;
     }
+    aio_bh_enqueue(bh, BH_SCHEDULED);
 }
 
+void qemu_bh_schedule_batched(QEMUBH *bh)
+{
+    AioBHBatch *batch = bh_batch;
+    unsigned old_flags;
+
+    if (!batch || batch->ctx != bh->ctx) {
+        qemu_bh_schedule(bh);
+        return;
+    }
+
+    /* The same BH can be batched by only one thread at a time; the
+     * others piggyback on it.
+     */
+    old_flags = atomic_fetch_or(&bh->flags, BH_BATCHED | BH_SCHEDULED);
+    if (!(old_flags & BH_BATCHED)) {
+        QSLIST_INSERT_HEAD(&batch->bh_list, bh, batch_next);
+    }
+}
 
 /* This func is async.
  */
 void qemu_bh_cancel(QEMUBH *bh)
 {
-    atomic_mb_set(&bh->scheduled, 0);
+    atomic_and(&bh->flags, ~BH_SCHEDULED);
 }
 
 /* This func is async.The bottom half will do the delete action at the finial
@@ -182,21 +341,17 @@ void qemu_bh_cancel(QEMUBH *bh)
  */
 void qemu_bh_delete(QEMUBH *bh)
 {
-    bh->scheduled = 0;
-    bh->deleted = 1;
+    aio_bh_enqueue(bh, BH_DELETED);
 }
 
-int64_t
-aio_compute_timeout(AioContext *ctx)
+/* Called within an RCU read-side critical section */
+static int aio_compute_bh_timeout(BHList *head, int timeout)
 {
-    int64_t deadline;
-    int timeout = -1;
     QEMUBH *bh;
 
-    for (bh = atomic_rcu_read(&ctx->first_bh); bh;
-         bh = atomic_rcu_read(&bh->next)) {
-        if (bh->scheduled) {
-            if (bh->idle) {
+    QSLIST_FOREACH_RCU(bh, head, next) {
+        if ((bh->flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            if (bh->flags & BH_IDLE) {
                 /* idle bottom halves will be polled at least
                  * every 10ms */
                 timeout = 10000000;
@@ -208,6 +363,39 @@ aio_compute_timeout(AioContext *ctx)
         }
     }
 
+    return timeout;
+}
+
+int64_t
+aio_compute_timeout(AioContext *ctx)
+{
+    BHListSlice *s;
+    int64_t deadline;
+    int timeout = -1;
+
+    /* Only true for a GSource nested in aio_dispatch(); the next dispatch
+     * flushes the batch.
+     */
+    if (aio_bh_batch_pending(ctx)) {
+        return 0;
+    }
+
+    /* Another thread's aio_bh_poll() can take and free these BHs */
+    rcu_read_lock();
+    timeout = aio_compute_bh_timeout(&ctx->bh_list, timeout);
+    QSIMPLEQ_FOREACH(s, &bh_slice_list, next) {
+        if (timeout == 0) {
+            break;
+        }
+        if (s->ctx == ctx) {
+            timeout = aio_compute_bh_timeout(&s->bh_list, timeout);
+        }
+    }
+    rcu_read_unlock();
+    if (timeout == 0) {
+        return 0;
+    }
+
     deadline = timerlistgroup_deadline_ns(&ctx->tlg);
     if (deadline == 0) {
         return 0;
@@ -238,15 +426,35 @@ aio_ctx_check(GSource *source)
 {
     AioContext *ctx = (AioContext *) source;
     QEMUBH *bh;
+    BHListSlice *s;
 
     atomic_and(&ctx->notify_me, ~1);
     aio_notify_accept(ctx);
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (bh->scheduled) {
+    if (aio_bh_batch_pending(ctx)) {
+        return true;
+    }
+
+    rcu_read_lock();
+    QSLIST_FOREACH_RCU(bh, &ctx->bh_list, next) {
+        if ((bh->flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            rcu_read_unlock();
             return true;
         }
     }
+
+    QSIMPLEQ_FOREACH(s, &bh_slice_list, next) {
+        if (s->ctx != ctx) {
+            continue;
+        }
+        QSLIST_FOREACH_RCU(bh, &s->bh_list, next) {
+            if ((bh->flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+                rcu_read_unlock();
+                return true;
+            }
+        }
+    }
+    rcu_read_unlock();
     return aio_pending(ctx) || (timerlistgroup_deadline_ns(&ctx->tlg) == 0);
 }
 
@@ -266,6 +474,8 @@ static void
 aio_ctx_finalize(GSource     *source)
 {
     AioContext *ctx = (AioContext *) source;
+    QEMUBH *bh;
+    unsigned flags;
 
     thread_pool_free(ctx->thread_pool);
 
@@ -280,18 +490,15 @@ aio_ctx_finalize(GSource     *source)
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
 
-    qemu_lockcnt_lock(&ctx->list_lock);
-    assert(!qemu_lockcnt_count(&ctx->list_lock));
-    while (ctx->first_bh) {
-        QEMUBH *next = ctx->first_bh->next;
+    /* There must be no aio_bh_poll() calls going on */
+    assert(!aio_bh_first_slice(ctx));
 
+    while ((bh = aio_bh_dequeue(&ctx->bh_list, &flags))) {
         /* qemu_bh_delete() must have been called on BHs in this AioContext */
-        assert(ctx->first_bh->deleted);
+        assert(flags & BH_DELETED);
 
-        g_free(ctx->first_bh);
-        ctx->first_bh = next;
+        g_free(bh);
     }
-    qemu_lockcnt_unlock(&ctx->list_lock);
 
     aio_set_event_notifier(ctx, &ctx->notifier, false, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
@@ -310,6 +517,8 @@ static GSourceFuncs aio_source_funcs = {
 
 GSource *aio_get_g_source(AioContext *ctx)
 {
+    /* The home thread drops the io_uring on its next aio_poll() */
+    atomic_set(&ctx->use_g_source, true);
     g_source_ref(&ctx->source);
     return &ctx->source;
 }
@@ -343,7 +552,7 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 
 void aio_notify(AioContext *ctx)
 {
-    /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
+    /* Write e.g. bh->flags before reading ctx->notify_me.  Pairs
      * with atomic_or in aio_ctx_prepare or atomic_add in aio_poll.
      */
     smp_mb();
@@ -421,6 +630,8 @@ AioContext *aio_context_new(Error **errp)
     g_source_set_can_recurse(&ctx->source, true);
     qemu_lockcnt_init(&ctx->list_lock);
 
+    QSLIST_INIT(&ctx->bh_list);
+
     ctx->co_schedule_bh = aio_bh_new(ctx, co_schedule_bh_cb, ctx);
     QSLIST_INIT(&ctx->scheduled_coroutines);
 
@@ -506,9 +717,11 @@ void aio_context_unref(AioContext *ctx)
     g_source_unref(&ctx->source);
 }
 
-void aio_context_acquire(AioContext *ctx)
+void aio_context_acquire_impl(AioContext *ctx, const char *file, int line)
 {
-    qemu_rec_mutex_lock(&ctx->lock);
+    QemuRecMutexLockFunc lock = atomic_read(&qemu_aio_context_lock_func);
+
+    lock(&ctx->lock, file, line);
 }
 
 void aio_context_release(AioContext *ctx)
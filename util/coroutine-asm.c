@@ -0,0 +1,311 @@
+/*
+ * Host assembly coroutine backend
+ *
+ * Copyright (C) 2006  Anthony Liguori <anthony@codemonkey.ws>
+ * Copyright (C) 2011  Kevin Wolf <kwolf@redhat.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/coroutine_int.h"
+
+#ifdef CONFIG_VALGRIND_H
+#include <valgrind/valgrind.h>
+#endif
+
+#if defined(__SANITIZE_ADDRESS__) || __has_feature(address_sanitizer)
+#ifdef CONFIG_ASAN_IFACE_FIBER
+#define CONFIG_ASAN 1
+#include <sanitizer/asan_interface.h>
+#endif
+#endif
+
+typedef struct {
+    Coroutine base;
+    void *stack;
+    size_t stack_size;
+    CoroutineStackClass *stack_owner;
+
+    /* Saved stack pointer while the coroutine is not running */
+    void *sp;
+
+#ifdef CONFIG_VALGRIND_H
+    unsigned int valgrind_stack_id;
+#endif
+
+} CoroutineAsm;
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+static __thread CoroutineAsm leader;
+static __thread Coroutine *current;
+
+/*
+ * The switch saves the callee-saved registers of the host ABI on the
+ * current stack, stores the stack pointer in *@from_sp, loads @to_sp
+ * and pops the callee-saved registers of the target back.  Everything
+ * else is clobbered by the call as far as the compiler is concerned,
+ * so there is no need to save it.  @action is passed through and
+ * becomes the return value in the resumed context.
+ *
+ * A new coroutine's stack is set up so that the first switch to it
+ * "returns" into coroutine_asm_start, which calls coroutine_trampoline()
+ * with the CoroutineAsm pointer that was stashed in a callee-saved
+ * register slot.
+ */
+CoroutineAction coroutine_asm_switch(void **from_sp, void *to_sp,
+                                     CoroutineAction action);
+void coroutine_asm_start(void);
+void coroutine_trampoline(CoroutineAsm *self);
+
+#if defined(__x86_64__)
+/* rbp, rbx, r12-r15 plus the return address */
+#define COROUTINE_ASM_FRAME_SLOTS 7
+#define COROUTINE_ASM_FRAME_SELF  4 /* rbx */
+
+asm(".text\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_switch\n"
+    ".hidden coroutine_asm_switch\n"
+    ".type coroutine_asm_switch, @function\n"
+    "coroutine_asm_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    movl %edx, %eax\n"
+    "    ret\n"
+    ".size coroutine_asm_switch, .-coroutine_asm_switch\n"
+    "\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_start\n"
+    ".hidden coroutine_asm_start\n"
+    ".type coroutine_asm_start, @function\n"
+    "coroutine_asm_start:\n"
+    "    .cfi_startproc\n"
+    "    .cfi_undefined rip\n"
+    "    movq %rbx, %rdi\n"
+    "    call coroutine_trampoline\n"
+    "    ud2\n"
+    "    .cfi_endproc\n"
+    ".size coroutine_asm_start, .-coroutine_asm_start\n");
+
+#elif defined(__aarch64__)
+/* x19-x28, x29 (fp), x30 (lr), d8-d15 */
+#define COROUTINE_ASM_FRAME_SLOTS 20
+#define COROUTINE_ASM_FRAME_SELF  0  /* x19 */
+#define COROUTINE_ASM_FRAME_LR    11 /* x30 */
+
+asm(".text\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_switch\n"
+    ".hidden coroutine_asm_switch\n"
+    ".type coroutine_asm_switch, %function\n"
+    "coroutine_asm_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x3, sp\n"
+    "    str x3, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    mov w0, w2\n"
+    "    ret\n"
+    ".size coroutine_asm_switch, .-coroutine_asm_switch\n"
+    "\n"
+    ".p2align 4\n"
+    ".globl coroutine_asm_start\n"
+    ".hidden coroutine_asm_start\n"
+    ".type coroutine_asm_start, %function\n"
+    "coroutine_asm_start:\n"
+    "    .cfi_startproc\n"
+    "    .cfi_undefined x30\n"
+    "    mov x0, x19\n"
+    "    bl coroutine_trampoline\n"
+    "    brk #0\n"
+    "    .cfi_endproc\n"
+    ".size coroutine_asm_start, .-coroutine_asm_start\n");
+
+#else
+#error "asm coroutine backend is not available for this host"
+#endif
+
+static void finish_switch_fiber(void *fake_stack_save)
+{
+#ifdef CONFIG_ASAN
+    const void *bottom_old;
+    size_t size_old;
+
+    __sanitizer_finish_switch_fiber(fake_stack_save, &bottom_old, &size_old);
+
+    if (!leader.stack) {
+        leader.stack = (void *)bottom_old;
+        leader.stack_size = size_old;
+    }
+#endif
+}
+
+static void start_switch_fiber(void **fake_stack_save,
+                               const void *bottom, size_t size)
+{
+#ifdef CONFIG_ASAN
+    __sanitizer_start_switch_fiber(fake_stack_save, bottom, size);
+#endif
+}
+
+void coroutine_trampoline(CoroutineAsm *self)
+{
+    Coroutine *co = &self->base;
+
+    finish_switch_fiber(NULL);
+
+    while (true) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    CoroutineAsm *co;
+    uintptr_t *frame;
+
+    co = g_malloc0(sizeof(*co));
+    co->stack_size = COROUTINE_STACK_SIZE;
+    co->stack = qemu_coroutine_stack_alloc(&co->stack_size,
+                                           &co->stack_owner);
+
+#ifdef CONFIG_VALGRIND_H
+    co->valgrind_stack_id =
+        VALGRIND_STACK_REGISTER(co->stack, co->stack + co->stack_size);
+#endif
+
+    /*
+     * Build the frame that coroutine_asm_switch() pops when the coroutine
+     * is first entered.  The stack pointer is 16-byte aligned once the
+     * frame has been popped, as the ABI requires at a call instruction.
+     * All other registers start out as zero; in particular this leaves
+     * a NULL frame pointer to terminate backtraces.
+     */
+    frame = (uintptr_t *)QEMU_ALIGN_PTR_DOWN(co->stack + co->stack_size, 16);
+    frame -= COROUTINE_ASM_FRAME_SLOTS;
+    memset(frame, 0, COROUTINE_ASM_FRAME_SLOTS * sizeof(*frame));
+    frame[COROUTINE_ASM_FRAME_SELF] = (uintptr_t)co;
+#ifdef COROUTINE_ASM_FRAME_LR
+    frame[COROUTINE_ASM_FRAME_LR] = (uintptr_t)coroutine_asm_start;
+#else
+    frame[COROUTINE_ASM_FRAME_SLOTS - 1] = (uintptr_t)coroutine_asm_start;
+#endif
+    co->sp = frame;
+
+    return &co->base;
+}
+
+#ifdef CONFIG_VALGRIND_H
+#if defined(CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE) && !defined(__clang__)
+/* Work around an unused variable in the valgrind.h macro... */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"
+#endif
+static inline void valgrind_stack_deregister(CoroutineAsm *co)
+{
+    VALGRIND_STACK_DEREGISTER(co->valgrind_stack_id);
+}
+#if defined(CONFIG_PRAGMA_DIAGNOSTIC_AVAILABLE) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsm *co = DO_UPCAST(CoroutineAsm, base, co_);
+
+#ifdef CONFIG_VALGRIND_H
+    valgrind_stack_deregister(co);
+#endif
+
+    qemu_coroutine_stack_free(co->stack, co->stack_size, co->stack_owner);
+    g_free(co);
+}
+
+/* This function is marked noinline to prevent GCC from inlining it
+ * into coroutine_trampoline(). If we allow it to do that then it
+ * hoists the code to get the address of the TLS variable "current"
+ * out of the while() loop. This is an invalid transformation because
+ * coroutine_asm_switch() may be called when running thread A but
+ * return in thread B, and so we might be in a different thread
+ * context each time round the loop.
+ */
+CoroutineAction __attribute__((noinline))
+qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                      CoroutineAction action)
+{
+    CoroutineAsm *from = DO_UPCAST(CoroutineAsm, base, from_);
+    CoroutineAsm *to = DO_UPCAST(CoroutineAsm, base, to_);
+    CoroutineAction ret;
+    void *fake_stack_save = NULL;
+
+    current = to_;
+
+    start_switch_fiber(action == COROUTINE_TERMINATE ?
+                       NULL : &fake_stack_save, to->stack, to->stack_size);
+    ret = coroutine_asm_switch(&from->sp, to->sp, action);
+    finish_switch_fiber(fake_stack_save);
+
+    return ret;
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    if (!current) {
+        current = &leader.base;
+    }
+    return current;
+}
+
+bool qemu_in_coroutine(void)
+{
+    return current && current->caller;
+}
@@ -34,6 +34,7 @@ typedef struct {
     Coroutine base;
     void *stack;
     size_t stack_size;
+    CoroutineStackClass *stack_owner;
     sigjmp_buf env;
 } CoroutineSigAltStack;
 
@@ -165,7 +166,8 @@ Coroutine *qemu_coroutine_new(void)
 
     co = g_malloc0(sizeof(*co));
     co->stack_size = COROUTINE_STACK_SIZE;
-    co->stack = qemu_alloc_stack(&co->stack_size);
+    co->stack = qemu_coroutine_stack_alloc(&co->stack_size,
+                                           &co->stack_owner);
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
     coTS = coroutine_get_thread_state();
@@ -254,7 +256,7 @@ void qemu_coroutine_delete(Coroutine *co_)
 {
     CoroutineSigAltStack *co = DO_UPCAST(CoroutineSigAltStack, base, co_);
 
-    qemu_free_stack(co->stack, co->stack_size);
+    qemu_coroutine_stack_free(co->stack, co->stack_size, co->stack_owner);
     g_free(co);
 }
 
@@ -42,6 +42,7 @@ typedef struct {
     Coroutine base;
     void *stack;
     size_t stack_size;
+    CoroutineStackClass *stack_owner;
     sigjmp_buf env;
 
 #ifdef CONFIG_VALGRIND_H
@@ -140,7 +141,8 @@ Coroutine *qemu_coroutine_new(void)
 
     co = g_malloc0(sizeof(*co));
     co->stack_size = COROUTINE_STACK_SIZE;
-    co->stack = qemu_alloc_stack(&co->stack_size);
+    co->stack = qemu_coroutine_stack_alloc(&co->stack_size,
+                                           &co->stack_owner);
     co->base.entry_arg = &old_env; /* stash away our jmp_buf */
 
     uc.uc_link = &old_uc;
@@ -192,7 +194,7 @@ void qemu_coroutine_delete(Coroutine *co_)
     valgrind_stack_deregister(co);
 #endif
 
-    qemu_free_stack(co->stack, co->stack_size);
+    qemu_coroutine_stack_free(co->stack, co->stack_size, co->stack_owner);
     g_free(co);
 }
 
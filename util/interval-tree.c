@@ -0,0 +1,200 @@
+/*
+ * Intrusive interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+static inline int node_height(const IntervalTreeNode *n)
+{
+    return n ? n->height : 0;
+}
+
+/* Nodes with the same start are ordered by address */
+static inline bool node_less(const IntervalTreeNode *a,
+                             const IntervalTreeNode *b)
+{
+    return a->start < b->start ||
+           (a->start == b->start && (uintptr_t)a < (uintptr_t)b);
+}
+
+static void node_update(IntervalTreeNode *n)
+{
+    n->height = 1 + MAX(node_height(n->left), node_height(n->right));
+    n->subtree_last = n->last;
+    if (n->left && n->left->subtree_last > n->subtree_last) {
+        n->subtree_last = n->left->subtree_last;
+    }
+    if (n->right && n->right->subtree_last > n->subtree_last) {
+        n->subtree_last = n->right->subtree_last;
+    }
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *n)
+{
+    IntervalTreeNode *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    node_update(n);
+    node_update(l);
+    return l;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *n)
+{
+    IntervalTreeNode *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    node_update(n);
+    node_update(r);
+    return r;
+}
+
+static IntervalTreeNode *rebalance(IntervalTreeNode *n)
+{
+    int balance;
+
+    node_update(n);
+    balance = node_height(n->left) - node_height(n->right);
+    if (balance > 1) {
+        if (node_height(n->left->left) < node_height(n->left->right)) {
+            n->left = rotate_left(n->left);
+        }
+        return rotate_right(n);
+    }
+    if (balance < -1) {
+        if (node_height(n->right->right) < node_height(n->right->left)) {
+            n->right = rotate_right(n->right);
+        }
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static IntervalTreeNode *do_insert(IntervalTreeNode *n, IntervalTreeNode *node)
+{
+    if (!n) {
+        node->left = node->right = NULL;
+        node_update(node);
+        return node;
+    }
+    if (node_less(node, n)) {
+        n->left = do_insert(n->left, node);
+    } else {
+        n->right = do_insert(n->right, node);
+    }
+    return rebalance(n);
+}
+
+static IntervalTreeNode *remove_min(IntervalTreeNode *n, IntervalTreeNode **min)
+{
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = remove_min(n->left, min);
+    return rebalance(n);
+}
+
+static IntervalTreeNode *do_remove(IntervalTreeNode *n, IntervalTreeNode *node)
+{
+    IntervalTreeNode *min, *right;
+
+    assert(n);
+    if (n == node) {
+        if (!n->right) {
+            return n->left;
+        }
+        right = remove_min(n->right, &min);
+        min->left = n->left;
+        min->right = right;
+        return rebalance(min);
+    }
+    if (node_less(node, n)) {
+        n->left = do_remove(n->left, node);
+    } else {
+        n->right = do_remove(n->right, node);
+    }
+    return rebalance(n);
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    assert(node->start <= node->last);
+    root->root = do_insert(root->root, node);
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    root->root = do_remove(root->root, node);
+    node->left = node->right = NULL;
+}
+
+static IntervalTreeNode *do_first(IntervalTreeNode *n,
+                                  uint64_t start, uint64_t last)
+{
+    while (n && n->subtree_last >= start) {
+        /*
+         * If anything on the left ends after start, the leftmost overlap
+         * is in the left subtree, or there is no overlap in @n at all:
+         * everything from there on starts after last.
+         */
+        if (n->left && n->left->subtree_last >= start) {
+            n = n->left;
+            continue;
+        }
+        if (n->start > last) {
+            return NULL;
+        }
+        if (n->last >= start) {
+            return n;
+        }
+        n = n->right;
+    }
+    return NULL;
+}
+
+static IntervalTreeNode *do_next(IntervalTreeNode *n,
+                                 const IntervalTreeNode *prev,
+                                 uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *found;
+
+    while (n && n->subtree_last >= start) {
+        if (!node_less(prev, n)) {
+            /* Only the right subtree comes after prev */
+            n = n->right;
+            continue;
+        }
+        found = do_next(n->left, prev, start, last);
+        if (found) {
+            return found;
+        }
+        if (n->start > last) {
+            return NULL;
+        }
+        if (n->last >= start) {
+            return n;
+        }
+        return do_first(n->right, start, last);
+    }
+    return NULL;
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    return do_first(root->root, start, last);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeRoot *root,
+                                          IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last)
+{
+    return do_next(root->root, node, start, last);
+}
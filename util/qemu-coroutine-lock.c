@@ -40,7 +40,16 @@ void qemu_co_queue_init(CoQueue *queue)
     QSIMPLEQ_INIT(&queue->entries);
 }
 
-void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock)
+/*
+ * CoMutexes are relocked on behalf of the caller at @file:@line; with
+ * @profile, the relock is recorded there if the profiler is enabled.
+ * CoRwlock waits use !@profile, because the whole rwlock operation is
+ * already accounted for.
+ */
+static void coroutine_fn qemu_co_queue_do_wait(CoQueue *queue,
+                                               QemuLockable *lock,
+                                               bool profile,
+                                               const char *file, int line)
 {
     Coroutine *self = qemu_coroutine_self();
     QSIMPLEQ_INSERT_TAIL(&queue->entries, self, co_queue_next);
@@ -64,10 +73,22 @@ void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock)
      * other cases of QemuLockable.
      */
     if (lock) {
-        qemu_lockable_lock(lock);
+        if (lock->unlock == (QemuLockUnlockFunc *)qemu_co_mutex_unlock) {
+            QemuCoMutexLockFunc f = profile ?
+                atomic_read(&qemu_co_mutex_lock_func) : qemu_co_mutex_lock_impl;
+            f(lock->object, file, line);
+        } else {
+            qemu_lockable_lock(lock);
+        }
     }
 }
 
+void coroutine_fn qemu_co_queue_wait_impl(CoQueue *queue, QemuLockable *lock,
+                                          const char *file, int line)
+{
+    qemu_co_queue_do_wait(queue, lock, true, file, line);
+}
+
 static bool qemu_co_queue_do_restart(CoQueue *queue, bool single)
 {
     Coroutine *next;
@@ -236,7 +257,8 @@ static void coroutine_fn qemu_co_mutex_lock_slowpath(AioContext *ctx,
     trace_qemu_co_mutex_lock_return(mutex, self);
 }
 
-void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
+void coroutine_fn qemu_co_mutex_lock_impl(CoMutex *mutex,
+                                          const char *file, int line)
 {
     AioContext *ctx = qemu_get_current_aio_context();
     Coroutine *self = qemu_coroutine_self();
@@ -338,14 +360,15 @@ void qemu_co_rwlock_init(CoRwlock *lock)
     qemu_co_mutex_init(&lock->mutex);
 }
 
-void qemu_co_rwlock_rdlock(CoRwlock *lock)
+void qemu_co_rwlock_rdlock_impl(CoRwlock *lock, const char *file, int line)
 {
     Coroutine *self = qemu_coroutine_self();
 
-    qemu_co_mutex_lock(&lock->mutex);
+    qemu_co_mutex_lock_impl(&lock->mutex, file, line);
     /* For fairness, wait if a writer is in line.  */
     while (lock->pending_writer) {
-        qemu_co_queue_wait(&lock->queue, &lock->mutex);
+        qemu_co_queue_do_wait(&lock->queue, QEMU_MAKE_LOCKABLE(&lock->mutex),
+                              false, file, line);
     }
     lock->reader++;
     qemu_co_mutex_unlock(&lock->mutex);
@@ -391,12 +414,13 @@ void qemu_co_rwlock_downgrade(CoRwlock *lock)
     self->locks_held++;
 }
 
-void qemu_co_rwlock_wrlock(CoRwlock *lock)
+void qemu_co_rwlock_wrlock_impl(CoRwlock *lock, const char *file, int line)
 {
-    qemu_co_mutex_lock(&lock->mutex);
+    qemu_co_mutex_lock_impl(&lock->mutex, file, line);
     lock->pending_writer++;
     while (lock->reader) {
-        qemu_co_queue_wait(&lock->queue, &lock->mutex);
+        qemu_co_queue_do_wait(&lock->queue, QEMU_MAKE_LOCKABLE(&lock->mutex),
+                              false, file, line);
     }
     lock->pending_writer--;
 
@@ -406,16 +430,17 @@ void qemu_co_rwlock_wrlock(CoRwlock *lock)
      */
 }
 
-void qemu_co_rwlock_upgrade(CoRwlock *lock)
+void qemu_co_rwlock_upgrade_impl(CoRwlock *lock, const char *file, int line)
 {
     Coroutine *self = qemu_coroutine_self();
 
-    qemu_co_mutex_lock(&lock->mutex);
+    qemu_co_mutex_lock_impl(&lock->mutex, file, line);
     assert(lock->reader > 0);
     lock->reader--;
     lock->pending_writer++;
     while (lock->reader) {
-        qemu_co_queue_wait(&lock->queue, &lock->mutex);
+        qemu_co_queue_do_wait(&lock->queue, QEMU_MAKE_LOCKABLE(&lock->mutex),
+                              false, file, line);
     }
     lock->pending_writer--;
 
@@ -0,0 +1,329 @@
+/*
+ * Coroutine stack cache
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "trace.h"
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/host-utils.h"
+#include "qemu/coroutine_int.h"
+
+/*
+ * Stacks are cached per thread in power-of-two size classes.  A request
+ * is rounded up to its class, and a stack is filed under the largest
+ * class that it can satisfy, so that anything taken from a class list is
+ * at least as big as the class.  Requests outside the range go straight
+ * to qemu_alloc_stack().
+ *
+ * The cache is sized by demand: each thread tracks how many stacks of a
+ * class it has handed out at most (the high-water mark) during the
+ * current and the previous generation, and keeps at most that many.  A
+ * generation ends every STACK_GEN_OPS allocations and frees; at that
+ * point stacks beyond the limit are unmapped, oldest first, and the
+ * deeper part of the stacks that stayed unused for a whole generation
+ * is given back to the kernel.  The memory stays mapped, so reusing such
+ * a stack only costs page faults where the coroutine actually goes deep.
+ *
+ * A stack that is freed by another thread than the one that allocated it
+ * goes to the cache of the freeing thread, but is accounted as no longer
+ * in use in the class it was allocated from.  The per-thread cache is
+ * reference counted by its stacks, so this also works after the
+ * allocating thread has exited.
+ */
+enum {
+    STACK_CLASS_MIN = 16,       /* 64 KiB */
+    STACK_CLASS_MAX = 24,       /* 16 MiB */
+    STACK_NR_CLASSES = STACK_CLASS_MAX - STACK_CLASS_MIN + 1,
+
+    STACK_GEN_OPS = 4096,
+
+    /* Part of an idle stack that is kept committed when decommitting */
+    STACK_HOT_SIZE = 64 * 1024,
+};
+
+typedef struct {
+    void *stack;
+    size_t size;
+    unsigned int gen;           /* generation in which it was freed */
+    bool decommitted;
+} CachedStack;
+
+typedef struct StackCache StackCache;
+
+typedef struct CoroutineStackClass {
+    StackCache *cache;
+
+    /* Oldest first; allocation and free work on the tail */
+    CachedStack *stacks;
+    unsigned int nr_stacks;
+    unsigned int max_stacks;
+
+    unsigned int in_use;        /* handed out by this thread, atomic */
+    unsigned int peak;          /* high-water mark of in_use, this gen */
+    unsigned int prev_peak;     /* high-water mark of in_use, last gen */
+    unsigned int max_peak;      /* all-time high-water mark of in_use */
+} StackClass;
+
+struct StackCache {
+    StackClass classes[STACK_NR_CLASSES];
+    /* One for the thread, and one for each stack that is in use */
+    unsigned int refcnt;
+};
+
+static __thread StackCache *stack_cache;
+static __thread unsigned int stack_gen;
+static __thread unsigned int stack_gen_ops;
+static __thread bool stack_cache_disabled;
+static __thread Notifier stack_cache_cleanup_notifier;
+
+static QemuMutex stack_stats_lock;
+static CoroutineStackStats stack_stats;
+
+static void *coroutine_stack_map(size_t *sz)
+{
+    void *stack = qemu_alloc_stack(sz);
+
+    qemu_mutex_lock(&stack_stats_lock);
+    stack_stats.mapped++;
+    stack_stats.mapped_peak = MAX(stack_stats.mapped_peak,
+                                  stack_stats.mapped);
+    stack_stats.nr_maps++;
+    qemu_mutex_unlock(&stack_stats_lock);
+    return stack;
+}
+
+static void coroutine_stack_unmap(void *stack, size_t sz)
+{
+    qemu_free_stack(stack, sz);
+
+    qemu_mutex_lock(&stack_stats_lock);
+    stack_stats.mapped--;
+    stack_stats.nr_unmaps++;
+    qemu_mutex_unlock(&stack_stats_lock);
+}
+
+static void coroutine_stack_decommit(CachedStack *s)
+{
+#if !defined(HOST_IA64) && !defined(HOST_HPPA)
+    size_t pagesz = getpagesize();
+
+    /* The stack grows down from stack + size, above the guard page */
+    if (s->size > pagesz + STACK_HOT_SIZE) {
+        qemu_madvise(s->stack + pagesz, s->size - pagesz - STACK_HOT_SIZE,
+                     QEMU_MADV_DONTNEED);
+        qemu_mutex_lock(&stack_stats_lock);
+        stack_stats.nr_decommits++;
+        qemu_mutex_unlock(&stack_stats_lock);
+    }
+#endif
+    s->decommitted = true;
+}
+
+static unsigned int stack_class_limit(StackClass *sc)
+{
+    return MAX(sc->peak, sc->prev_peak);
+}
+
+static void stack_class_trim(StackClass *sc, unsigned int limit)
+{
+    unsigned int excess, i;
+
+    unsigned int in_use = atomic_read(&sc->in_use);
+
+    if (in_use + sc->nr_stacks <= limit) {
+        return;
+    }
+
+    excess = MIN(sc->nr_stacks, in_use + sc->nr_stacks - limit);
+    for (i = 0; i < excess; i++) {
+        coroutine_stack_unmap(sc->stacks[i].stack, sc->stacks[i].size);
+    }
+    sc->nr_stacks -= excess;
+    memmove(sc->stacks, sc->stacks + excess,
+            sc->nr_stacks * sizeof(sc->stacks[0]));
+}
+
+static void coroutine_stack_end_gen(void)
+{
+    StackClass *sc;
+    unsigned int i, j;
+
+    for (i = 0; i < STACK_NR_CLASSES; i++) {
+        sc = &stack_cache->classes[i];
+
+        trace_qemu_coroutine_stack_gen(1ULL << (i + STACK_CLASS_MIN),
+                                       atomic_read(&sc->in_use), sc->peak,
+                                       sc->nr_stacks);
+
+        stack_class_trim(sc, stack_class_limit(sc));
+        for (j = 0; j < sc->nr_stacks; j++) {
+            if (sc->stacks[j].gen != stack_gen &&
+                !sc->stacks[j].decommitted) {
+                coroutine_stack_decommit(&sc->stacks[j]);
+            }
+        }
+
+        sc->prev_peak = sc->peak;
+        sc->peak = atomic_read(&sc->in_use);
+    }
+
+    stack_gen++;
+    stack_gen_ops = 0;
+}
+
+static void coroutine_stack_op(void)
+{
+    if (++stack_gen_ops == STACK_GEN_OPS) {
+        coroutine_stack_end_gen();
+    }
+}
+
+static void stack_cache_unref(StackCache *cache)
+{
+    if (atomic_fetch_dec(&cache->refcnt) == 1) {
+        g_free(cache);
+    }
+}
+
+static void coroutine_stack_cache_cleanup(Notifier *n, void *value)
+{
+    unsigned int i;
+
+    /* Coroutines deleted after this point free their stack directly */
+    stack_cache_disabled = true;
+
+    for (i = 0; i < STACK_NR_CLASSES; i++) {
+        StackClass *sc = &stack_cache->classes[i];
+
+        stack_class_trim(sc, 0);
+        g_free(sc->stacks);
+        sc->stacks = NULL;
+        sc->max_stacks = 0;
+    }
+
+    /* Stacks that are still in use keep the in_use counters alive */
+    stack_cache_unref(stack_cache);
+    stack_cache = NULL;
+}
+
+static StackCache *stack_cache_get(void)
+{
+    unsigned int i;
+
+    if (!stack_cache) {
+        stack_cache = g_new0(StackCache, 1);
+        stack_cache->refcnt = 1;
+        for (i = 0; i < STACK_NR_CLASSES; i++) {
+            stack_cache->classes[i].cache = stack_cache;
+        }
+        stack_cache_cleanup_notifier.notify = coroutine_stack_cache_cleanup;
+        qemu_thread_atexit_add(&stack_cache_cleanup_notifier);
+    }
+    return stack_cache;
+}
+
+void *qemu_coroutine_stack_alloc(size_t *sz, CoroutineStackClass **owner)
+{
+    StackCache *cache;
+    StackClass *sc;
+    CachedStack *s;
+    unsigned int in_use;
+    int cls;
+
+    *owner = NULL;
+    if (!CONFIG_COROUTINE_POOL || stack_cache_disabled) {
+        return coroutine_stack_map(sz);
+    }
+
+    cls = *sz <= 1 ? 0 : 64 - clz64(*sz - 1);
+    cls = MAX(cls, STACK_CLASS_MIN);
+    if (cls > STACK_CLASS_MAX) {
+        return coroutine_stack_map(sz);
+    }
+
+    cache = stack_cache_get();
+    coroutine_stack_op();
+    sc = &cache->classes[cls - STACK_CLASS_MIN];
+    in_use = atomic_fetch_inc(&sc->in_use) + 1;
+    atomic_inc(&cache->refcnt);
+    *owner = sc;
+
+    sc->peak = MAX(sc->peak, in_use);
+    if (sc->peak > sc->max_peak) {
+        sc->max_peak = sc->peak;
+        qemu_mutex_lock(&stack_stats_lock);
+        stack_stats.in_use_peak = MAX(stack_stats.in_use_peak, sc->max_peak);
+        qemu_mutex_unlock(&stack_stats_lock);
+    }
+
+    if (sc->nr_stacks) {
+        s = &sc->stacks[--sc->nr_stacks];
+        *sz = s->size;
+        return s->stack;
+    }
+
+    *sz = 1ULL << cls;
+    return coroutine_stack_map(sz);
+}
+
+void qemu_coroutine_stack_free(void *stack, size_t sz,
+                               CoroutineStackClass *owner)
+{
+    StackClass *sc;
+    CachedStack *s;
+    int cls;
+
+    /* The owner may belong to another thread, even one that has exited */
+    if (owner) {
+        atomic_dec(&owner->in_use);
+        stack_cache_unref(owner->cache);
+    }
+
+    if (!CONFIG_COROUTINE_POOL || stack_cache_disabled) {
+        coroutine_stack_unmap(stack, sz);
+        return;
+    }
+
+    /* Usable size, see qemu_alloc_stack() */
+    cls = 63 - clz64(sz - getpagesize());
+    if (cls < STACK_CLASS_MIN || cls > STACK_CLASS_MAX) {
+        coroutine_stack_unmap(stack, sz);
+        return;
+    }
+
+    coroutine_stack_op();
+    sc = &stack_cache_get()->classes[cls - STACK_CLASS_MIN];
+
+    if (atomic_read(&sc->in_use) + sc->nr_stacks >= stack_class_limit(sc)) {
+        coroutine_stack_unmap(stack, sz);
+        return;
+    }
+
+    if (sc->nr_stacks == sc->max_stacks) {
+        sc->max_stacks = MAX(sc->max_stacks * 2, 16);
+        sc->stacks = g_renew(CachedStack, sc->stacks, sc->max_stacks);
+    }
+
+    s = &sc->stacks[sc->nr_stacks++];
+    s->stack = stack;
+    s->size = sz;
+    s->gen = stack_gen;
+    s->decommitted = false;
+}
+
+void qemu_coroutine_stack_get_stats(CoroutineStackStats *stats)
+{
+    qemu_mutex_lock(&stack_stats_lock);
+    *stats = stack_stats;
+    qemu_mutex_unlock(&stack_stats_lock);
+}
+
+static void __attribute__((__constructor__)) coroutine_stack_init(void)
+{
+    qemu_mutex_init(&stack_stats_lock);
+}
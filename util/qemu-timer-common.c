@@ -23,6 +23,10 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/timer.h"
+#ifdef CONFIG_TSC_CLOCK
+#include "qemu/thread.h"
+#include "qemu/cpuid.h"
+#endif
 
 /***********************************************************/
 /* real time host monotonic timer */
@@ -47,6 +51,198 @@ static void __attribute__((constructor)) init_get_clock(void)
 
 int use_rt_clock;
 
+#ifdef CONFIG_TSC_CLOCK
+/*
+ * The TSC clock source computes get_clock() from the time stamp counter
+ * instead of calling clock_gettime().  It is only used if the TSC is
+ * invariant and the kernel trusts it enough to use it as its own
+ * clocksource, which among other things means that it is synchronized
+ * across CPUs.
+ *
+ * During the first TSC_CALIBRATE_NS, get_clock() still uses
+ * clock_gettime() and the TSC frequency is measured.  Afterwards the TSC
+ * is compared against CLOCK_MONOTONIC every TSC_RESYNC_NS.  Differences
+ * are slewed away over the next interval, so that the clock never goes
+ * backwards; if the clock is behind by more than TSC_MAX_SLEW_NS, it
+ * steps forward instead.  If the TSC frequency appears to change, or the
+ * TSC goes backwards, the TSC is abandoned for good.
+ */
+enum {
+    TSC_CALIBRATE_NS = 10 * SCALE_MS,
+    TSC_RESYNC_NS = 1000 * SCALE_MS,
+    TSC_MAX_SLEW_NS = TSC_RESYNC_NS / 8,
+
+    /* Tolerated difference between the TSCs of two CPUs */
+    TSC_MAX_SKEW = 100000,
+};
+
+int use_tsc_clock;
+QemuTscClock tsc_clock;
+
+/* Protects the variables below and writes to tsc_clock */
+static QemuSpin tsc_clock_lock;
+static uint64_t tsc_sync_tsc;
+static int64_t tsc_sync_ns;
+static uint64_t tsc_mult;           /* measured, i.e. not slewed */
+
+static int64_t get_clock_monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Nanoseconds per tick, as a 32.32 fixed point number */
+static uint64_t tsc_clock_mult(int64_t ns, uint64_t ticks)
+{
+    uint64_t lo = (uint64_t)ns << 32, hi = (uint64_t)ns >> 32;
+
+    return divu128(&lo, &hi, ticks) ? 0 : lo;
+}
+
+static void tsc_clock_set(uint64_t tsc, int64_t ns, uint64_t mult)
+{
+    atomic_set(&tsc_clock.sequence, tsc_clock.sequence + 1);
+    smp_wmb();
+    tsc_clock.base_tsc = tsc;
+    tsc_clock.base_ns = ns;
+    tsc_clock.mult = mult;
+    tsc_clock.resync_ticks = ((uint64_t)TSC_RESYNC_NS << 32) / mult;
+    smp_wmb();
+    atomic_set(&tsc_clock.sequence, tsc_clock.sequence + 1);
+}
+
+static void tsc_clock_calibrate(uint64_t tsc, int64_t now)
+{
+    if (!tsc_sync_tsc) {
+        tsc_sync_tsc = tsc;
+        tsc_sync_ns = now;
+    } else if (now - tsc_sync_ns >= TSC_CALIBRATE_NS) {
+        tsc_mult = tsc > tsc_sync_tsc ?
+            tsc_clock_mult(now - tsc_sync_ns, tsc - tsc_sync_tsc) : 0;
+        if (!tsc_mult) {
+            atomic_set(&use_tsc_clock, 0);
+            return;
+        }
+        tsc_sync_tsc = tsc;
+        tsc_sync_ns = now;
+        tsc_clock_set(tsc, now, tsc_mult);
+    }
+}
+
+/*
+ * The clock value for @delta ticks past base_tsc.  The slewed mult only
+ * applies to the resync interval; the TSC may be read much later than
+ * that, e.g. after the host was suspended, and extrapolating the slew
+ * beyond it would multiply the correction.
+ */
+static int64_t tsc_clock_extrapolate(uint64_t delta)
+{
+    uint64_t slewed = MIN(delta, tsc_clock.resync_ticks);
+    uint64_t lo, hi;
+    int64_t ns;
+
+    mulu64(&lo, &hi, slewed, tsc_clock.mult);
+    ns = tsc_clock.base_ns + (int64_t)((lo >> 32) | (hi << 32));
+    mulu64(&lo, &hi, delta - slewed, tsc_mult);
+    return ns + (int64_t)((lo >> 32) | (hi << 32));
+}
+
+/* Called by get_clock_tsc() when the clock parameters are due for update */
+int64_t get_clock_tsc_resync(void)
+{
+    uint64_t tsc, delta, mult;
+    int64_t now, ns, error;
+
+    qemu_spin_lock(&tsc_clock_lock);
+    tsc = get_tsc_ordered();
+    now = get_clock_monotonic();
+    if (!atomic_read(&use_tsc_clock)) {
+        ns = now;
+        goto out;
+    }
+    if (!tsc_mult) {
+        tsc_clock_calibrate(tsc, now);
+        ns = now;
+        goto out;
+    }
+
+    delta = tsc - tsc_clock.base_tsc;
+    if ((int64_t)delta < 0) {
+        ns = tsc_clock.base_ns;
+        if (-(int64_t)delta > TSC_MAX_SKEW) {
+            goto fail;
+        }
+        goto out;
+    }
+
+    ns = tsc_clock_extrapolate(delta);
+    if (delta < tsc_clock.resync_ticks) {
+        /* Another thread got here first */
+        goto out;
+    }
+
+    mult = tsc_clock_mult(now - tsc_sync_ns, tsc - tsc_sync_tsc);
+    if (mult < tsc_mult - tsc_mult / 16 || mult > tsc_mult + tsc_mult / 16) {
+        goto fail;
+    }
+
+    error = now - ns;
+    if (error > TSC_MAX_SLEW_NS) {
+        ns = now;
+        error = 0;
+    }
+    error = MAX(error, -TSC_MAX_SLEW_NS);
+
+    tsc_mult = mult;
+    tsc_sync_tsc = tsc;
+    tsc_sync_ns = now;
+    tsc_clock_set(tsc, ns, muldiv64(mult, TSC_RESYNC_NS + error,
+                                    TSC_RESYNC_NS));
+    goto out;
+
+fail:
+    /*
+     * ns is at least what the TSC clock has returned so far; do not go
+     * back from it in this call.  Later callers use clock_gettime() and
+     * may still see it step back slightly.
+     */
+    atomic_set(&use_tsc_clock, 0);
+    ns = MAX(now, ns);
+out:
+    qemu_spin_unlock(&tsc_clock_lock);
+    return ns;
+}
+
+static bool tsc_clock_usable(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    char buf[16] = "";
+    FILE *f;
+
+    /* Invariant TSC */
+    if (__get_cpuid_max(0x80000000, NULL) < 0x80000007) {
+        return false;
+    }
+    __cpuid(0x80000007, eax, ebx, ecx, edx);
+    if (!(edx & (1 << 8))) {
+        return false;
+    }
+
+    f = fopen("/sys/devices/system/clocksource/clocksource0/"
+              "current_clocksource", "r");
+    if (!f) {
+        return false;
+    }
+    if (!fgets(buf, sizeof(buf), f)) {
+        buf[0] = 0;
+    }
+    fclose(f);
+    return !strcmp(buf, "tsc\n");
+}
+#endif
+
 static void __attribute__((constructor)) init_get_clock(void)
 {
     use_rt_clock = 0;
@@ -58,5 +254,11 @@ static void __attribute__((constructor)) init_get_clock(void)
         }
     }
 #endif
+#ifdef CONFIG_TSC_CLOCK
+    qemu_spin_init(&tsc_clock_lock);
+    if (use_rt_clock && tsc_clock_usable()) {
+        use_tsc_clock = 1;
+    }
+#endif
 }
 #endif
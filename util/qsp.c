@@ -10,11 +10,18 @@
  * help diagnose performance problems, e.g. scalability issues when
  * contention is high.
  *
- * The primitives currently supported are mutexes, recursive mutexes and
- * condition variables. Note that not all related functions are intercepted;
- * instead we profile only those functions that can have a performance impact,
- * either due to blocking (e.g. cond_wait, mutex_lock) or cache line
- * contention (e.g. mutex_lock, mutex_trylock).
+ * The primitives currently supported are mutexes, recursive mutexes,
+ * condition variables, AioContext acquisition, and the coroutine mutexes,
+ * queues and read/write locks. Note that not all related functions are
+ * intercepted; instead we profile only those functions that can have a
+ * performance impact, either due to blocking (e.g. cond_wait, mutex_lock) or
+ * cache line contention (e.g. mutex_lock, mutex_trylock).
+ *
+ * For the coroutine primitives, the time recorded is the time between the
+ * call and the coroutine getting the lock (or being woken up, for CoQueues).
+ * While the coroutine waits, other coroutines run in the same thread, so this
+ * is latency for the waiting request rather than time the thread spent
+ * blocked.
  *
  * QSP's design focuses on speed and scalability. This is achieved
  * by having threads do their profiling entirely on thread-local data.
@@ -61,6 +68,7 @@
 #include "qemu/timer.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
+#include "qemu/coroutine.h"
 #include "exec/tb-hash-xx.h"
 
 enum QSPType {
@@ -68,6 +76,11 @@ enum QSPType {
     QSP_BQL_MUTEX,
     QSP_REC_MUTEX,
     QSP_CONDVAR,
+    QSP_AIO_CONTEXT,
+    QSP_CO_MUTEX,
+    QSP_CO_QUEUE,
+    QSP_CO_RDLOCK,
+    QSP_CO_WRLOCK,
 };
 
 struct QSPCallSite {
@@ -127,6 +140,11 @@ static const char * const qsp_typenames[] = {
     [QSP_BQL_MUTEX] = "BQL mutex",
     [QSP_REC_MUTEX] = "rec_mutex",
     [QSP_CONDVAR]   = "condvar",
+    [QSP_AIO_CONTEXT] = "aio_ctx",
+    [QSP_CO_MUTEX]  = "co_mutex",
+    [QSP_CO_QUEUE]  = "co_queue",
+    [QSP_CO_RDLOCK] = "co_rdlock",
+    [QSP_CO_WRLOCK] = "co_wrlock",
 };
 
 QemuMutexLockFunc qemu_bql_mutex_lock_func = qemu_mutex_lock_impl;
@@ -136,6 +154,12 @@ QemuRecMutexLockFunc qemu_rec_mutex_lock_func = qemu_rec_mutex_lock_impl;
 QemuRecMutexTrylockFunc qemu_rec_mutex_trylock_func =
     qemu_rec_mutex_trylock_impl;
 QemuCondWaitFunc qemu_cond_wait_func = qemu_cond_wait_impl;
+QemuRecMutexLockFunc qemu_aio_context_lock_func = qemu_rec_mutex_lock_impl;
+QemuCoMutexLockFunc qemu_co_mutex_lock_func = qemu_co_mutex_lock_impl;
+QemuCoQueueWaitFunc qemu_co_queue_wait_func = qemu_co_queue_wait_impl;
+QemuCoRwlockLockFunc qemu_co_rwlock_rdlock_func = qemu_co_rwlock_rdlock_impl;
+QemuCoRwlockLockFunc qemu_co_rwlock_upgrade_func = qemu_co_rwlock_upgrade_impl;
+QemuCoRwlockLockFunc qemu_co_rwlock_wrlock_func = qemu_co_rwlock_wrlock_impl;
 
 /*
  * It pays off to _not_ hash callsite->file; hashing a string is slow, and
@@ -430,6 +454,16 @@ QSP_GEN_VOID(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_lock,
              qemu_rec_mutex_lock_impl)
 QSP_GEN_RET1(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_trylock,
              qemu_rec_mutex_trylock_impl)
+QSP_GEN_VOID(QemuRecMutex, QSP_AIO_CONTEXT, qsp_aio_context_lock,
+             qemu_rec_mutex_lock_impl)
+
+QSP_GEN_VOID(CoMutex, QSP_CO_MUTEX, qsp_co_mutex_lock, qemu_co_mutex_lock_impl)
+QSP_GEN_VOID(CoRwlock, QSP_CO_RDLOCK, qsp_co_rwlock_rdlock,
+             qemu_co_rwlock_rdlock_impl)
+QSP_GEN_VOID(CoRwlock, QSP_CO_WRLOCK, qsp_co_rwlock_upgrade,
+             qemu_co_rwlock_upgrade_impl)
+QSP_GEN_VOID(CoRwlock, QSP_CO_WRLOCK, qsp_co_rwlock_wrlock,
+             qemu_co_rwlock_wrlock_impl)
 
 #undef QSP_GEN_RET1
 #undef QSP_GEN_VOID
@@ -448,6 +482,21 @@ qsp_cond_wait(QemuCond *cond, QemuMutex *mutex, const char *file, int line)
     qsp_entry_record(e, t1 - t0);
 }
 
+static void coroutine_fn
+qsp_co_queue_wait(CoQueue *queue, QemuLockable *lock, const char *file,
+                  int line)
+{
+    QSPEntry *e;
+    int64_t t0, t1;
+
+    t0 = get_clock();
+    qemu_co_queue_wait_impl(queue, lock, file, line);
+    t1 = get_clock();
+
+    e = qsp_entry_get(queue, file, line, QSP_CO_QUEUE);
+    qsp_entry_record(e, t1 - t0);
+}
+
 bool qsp_is_enabled(void)
 {
     return atomic_read(&qemu_mutex_lock_func) == qsp_mutex_lock;
@@ -461,6 +510,12 @@ void qsp_enable(void)
     atomic_set(&qemu_rec_mutex_lock_func, qsp_rec_mutex_lock);
     atomic_set(&qemu_rec_mutex_trylock_func, qsp_rec_mutex_trylock);
     atomic_set(&qemu_cond_wait_func, qsp_cond_wait);
+    atomic_set(&qemu_aio_context_lock_func, qsp_aio_context_lock);
+    atomic_set(&qemu_co_mutex_lock_func, qsp_co_mutex_lock);
+    atomic_set(&qemu_co_queue_wait_func, qsp_co_queue_wait);
+    atomic_set(&qemu_co_rwlock_rdlock_func, qsp_co_rwlock_rdlock);
+    atomic_set(&qemu_co_rwlock_upgrade_func, qsp_co_rwlock_upgrade);
+    atomic_set(&qemu_co_rwlock_wrlock_func, qsp_co_rwlock_wrlock);
 }
 
 void qsp_disable(void)
@@ -471,6 +526,12 @@ void qsp_disable(void)
     atomic_set(&qemu_rec_mutex_lock_func, qemu_rec_mutex_lock_impl);
     atomic_set(&qemu_rec_mutex_trylock_func, qemu_rec_mutex_trylock_impl);
     atomic_set(&qemu_cond_wait_func, qemu_cond_wait_impl);
+    atomic_set(&qemu_aio_context_lock_func, qemu_rec_mutex_lock_impl);
+    atomic_set(&qemu_co_mutex_lock_func, qemu_co_mutex_lock_impl);
+    atomic_set(&qemu_co_queue_wait_func, qemu_co_queue_wait_impl);
+    atomic_set(&qemu_co_rwlock_rdlock_func, qemu_co_rwlock_rdlock_impl);
+    atomic_set(&qemu_co_rwlock_upgrade_func, qemu_co_rwlock_upgrade_impl);
+    atomic_set(&qemu_co_rwlock_wrlock_func, qemu_co_rwlock_wrlock_impl);
 }
 
 static gint qsp_tree_cmp(gconstpointer ap, gconstpointer bp, gpointer up)
@@ -22,10 +22,23 @@
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
+#include "qemu/processor.h"
 
-static void do_spawn_thread(ThreadPool *pool);
+/* Requests are handed to the workers through per-worker rings.  The
+ * submitting thread is the only producer; the owning worker and any idle
+ * worker looking for something to steal are the consumers.
+ */
+#define THREAD_POOL_RING_SIZE 256
+
+/* Bounds for the number of times an idle worker polls the rings before
+ * going to sleep.  The budget grows when spinning paid off and shrinks
+ * when the worker had to sleep anyway.
+ */
+#define THREAD_POOL_MIN_SPIN 16
+#define THREAD_POOL_MAX_SPIN 4096
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -39,81 +52,257 @@ struct ThreadPoolElement {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by lock for
+     * requests in request_list.  Requests in a ring are owned by
+     * whoever clears their slot.  After that, only the worker thread
+     * can write to state and ret.
      */
     enum ThreadState state;
     int ret;
 
+    /* Ring slot holding the request, or NULL if it is in request_list.  */
+    ThreadPoolElement **slot;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
-    /* Access to this list is protected by the global mutex.  */
+    /* Requests finished by a worker, pushed with atomic_cmpxchg.  */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
+    /* The following are only accessed from the pool's AioContext.  */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) completed;
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    int index;
+    QemuThread thread;
+
+    /* Set while the worker waits on wakeup; see thread_pool_kick().  */
+    QemuEvent wakeup;
+    bool sleeping;
+    int spin;
+
+    /* Consumers advance head with atomic_cmpxchg and then take the
+     * request with atomic_xchg on its slot, which thread_pool_cancel()
+     * may have cleared already.  The producer only fills empty slots
+     * and publishes them with a store-release of tail.
+     */
+    unsigned int head;
+    unsigned int tail;
+    ThreadPoolElement *ring[THREAD_POOL_RING_SIZE];
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
     int max_threads;
     QEMUBH *new_thread_bh;
 
-    /* The following variables are only accessed from one AioContext. */
+    /* Workers are created, but never destroyed, before the pool is freed.
+     * workers[i] is valid for i < nr_workers.
+     */
+    ThreadPoolWorker **workers;
+    int nr_workers;
+    int nr_idle;         /* workers spinning or sleeping */
+    int nr_spinning;     /* workers polling the rings */
+    bool stopping;
+
+    /* Requests completed by the workers, most recent first.  The
+     * completion BH is scheduled only when this goes from empty to
+     * non-empty.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+
+    /* The following variables are only accessed from one AioContext.
+     * Submissions are serialized by it too, which makes the submitting
+     * thread the only producer for the rings.
+     */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) completed;
+    int next_worker;
 
-    /* The following variables are protected by lock.  */
+    /* The following variables are protected by lock.  Requests only go
+     * to request_list when all the rings are full.
+     */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int nr_overflow;     /* also read atomically outside the lock */
     int cur_threads;
-    int idle_threads;
+    int started_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
-    bool stopping;
 };
 
+static void do_spawn_thread(ThreadPool *pool);
+
+static bool thread_pool_ring_push(ThreadPoolWorker *w, ThreadPoolElement *req)
+{
+    unsigned int tail = w->tail;
+    ThreadPoolElement **slot = &w->ring[tail % THREAD_POOL_RING_SIZE];
+
+    /* The slot can still be busy if a consumer has advanced head but
+     * not taken the request yet.
+     */
+    if (tail - atomic_read(&w->head) >= THREAD_POOL_RING_SIZE ||
+        atomic_read(slot)) {
+        return false;
+    }
+    req->slot = slot;
+    atomic_set(slot, req);
+    atomic_store_release(&w->tail, tail + 1);
+    return true;
+}
+
+static ThreadPoolElement *thread_pool_ring_pop(ThreadPoolWorker *w)
+{
+    unsigned int head, tail;
+    ThreadPoolElement *req;
+
+    for (;;) {
+        head = atomic_read(&w->head);
+        tail = atomic_load_acquire(&w->tail);
+        if (head == tail) {
+            return NULL;
+        }
+        if (atomic_cmpxchg(&w->head, head, head + 1) != head) {
+            continue;
+        }
+
+        /* NULL if the request was canceled, or taken by a consumer that
+         * claimed an older lap of the ring.
+         */
+        req = atomic_xchg(&w->ring[head % THREAD_POOL_RING_SIZE], NULL);
+        if (req) {
+            return req;
+        }
+    }
+}
+
+/* Look in our own ring first, then try to steal from the others.  */
+static ThreadPoolElement *thread_pool_get_request(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    ThreadPoolElement *req;
+    int i, n;
+
+    req = thread_pool_ring_pop(w);
+    if (req) {
+        return req;
+    }
+
+    n = atomic_load_acquire(&pool->nr_workers);
+    for (i = 1; i < n; i++) {
+        req = thread_pool_ring_pop(pool->workers[(w->index + i) % n]);
+        if (req) {
+            trace_thread_pool_steal(pool, req, w->index);
+            return req;
+        }
+    }
+
+    if (atomic_read(&pool->nr_overflow)) {
+        qemu_mutex_lock(&pool->lock);
+        req = QTAILQ_FIRST(&pool->request_list);
+        if (req) {
+            QTAILQ_REMOVE(&pool->request_list, req, reqs);
+            atomic_set(&pool->nr_overflow, pool->nr_overflow - 1);
+            req->state = THREAD_ACTIVE;
+        }
+        qemu_mutex_unlock(&pool->lock);
+    }
+    return req;
+}
+
+static ThreadPoolElement *thread_pool_worker_wait(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    ThreadPoolElement *req = NULL;
+    int i;
+
+    atomic_inc(&pool->nr_idle);
+    atomic_inc(&pool->nr_spinning);
+    for (i = 0; i < w->spin; i++) {
+        req = thread_pool_get_request(w);
+        if (req || atomic_read(&pool->stopping)) {
+            break;
+        }
+        cpu_relax();
+    }
+    atomic_dec(&pool->nr_spinning);
+
+    if (req) {
+        w->spin = MIN(w->spin * 2, THREAD_POOL_MAX_SPIN);
+    } else {
+        w->spin = MAX(w->spin / 2, THREAD_POOL_MIN_SPIN);
+    }
+
+    while (!req && !atomic_read(&pool->stopping)) {
+        qemu_event_reset(&w->wakeup);
+        atomic_set(&w->sleeping, true);
+
+        /* Write sleeping before looking at the rings; pairs with the
+         * barrier in thread_pool_kick().
+         */
+        smp_mb();
+        req = thread_pool_get_request(w);
+        if (!req && !atomic_read(&pool->stopping)) {
+            qemu_event_wait(&w->wakeup);
+            req = thread_pool_get_request(w);
+        }
+        atomic_set(&w->sleeping, false);
+    }
+
+    atomic_dec(&pool->nr_idle);
+    return req;
+}
+
+/* Hand a request back to the AioContext, batching the BH notifications.  */
+static void thread_pool_done(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    do {
+        old = atomic_read(&pool->done_list.slh_first);
+        req->done.sle_next = old;
+    } while (atomic_cmpxchg(&pool->done_list.slh_first, old, req) != old);
+
+    if (!old) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *w = opaque;
+    ThreadPool *pool = w->pool;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (!pool->stopping) {
+    while (!atomic_read(&pool->stopping)) {
         ThreadPoolElement *req;
-        int ret;
-
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+
+        req = thread_pool_get_request(w);
+        if (!req) {
+            req = thread_pool_worker_wait(w);
+            if (!req) {
+                continue;
+            }
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
-
-        ret = req->func(req->arg);
-
-        req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
+        req->ret = req->func(req->arg);
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
+        /* The cmpxchg in thread_pool_done() orders the write of ret.  */
+        thread_pool_done(pool, req);
     }
 
+    qemu_mutex_lock(&pool->lock);
     pool->cur_threads--;
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
@@ -122,7 +311,7 @@ static void *worker_thread(void *opaque)
 
 static void do_spawn_thread(ThreadPool *pool)
 {
-    QemuThread t;
+    ThreadPoolWorker *w;
 
     /* Runs with lock taken.  */
     if (!pool->new_threads) {
@@ -132,7 +321,9 @@ static void do_spawn_thread(ThreadPool *pool)
     pool->new_threads--;
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    w = pool->workers[pool->started_threads++];
+    qemu_thread_create(&w->thread, "worker", worker_thread, w,
+                       QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -146,6 +337,18 @@ static void spawn_thread_bh_fn(void *opaque)
 
 static void spawn_thread(ThreadPool *pool)
 {
+    ThreadPoolWorker *w = g_new0(ThreadPoolWorker, 1);
+
+    /* The worker's ring can be used right away, the thread itself is
+     * started later.
+     */
+    w->pool = pool;
+    w->index = pool->nr_workers;
+    w->spin = THREAD_POOL_MIN_SPIN;
+    qemu_event_init(&w->wakeup, false);
+    pool->workers[w->index] = w;
+    atomic_store_release(&pool->nr_workers, w->index + 1);
+
     pool->cur_threads++;
     pool->new_threads++;
     /* If there are threads being created, they will spawn new workers, so
@@ -160,26 +363,90 @@ static void spawn_thread(ThreadPool *pool)
     }
 }
 
+/* Wake up a worker for a request that was just queued to @w's ring.  */
+static void thread_pool_kick(ThreadPool *pool, ThreadPoolWorker *w)
+{
+    int i, n;
+
+    /* Write the ring before reading sleeping; pairs with the barrier
+     * in thread_pool_worker_wait().
+     */
+    smp_mb();
+    if (atomic_read(&w->sleeping)) {
+        qemu_event_set(&w->wakeup);
+        return;
+    }
+
+    /* The owner is busy.  A spinning worker will steal the request,
+     * otherwise wake up a sleeping one.
+     */
+    if (atomic_read(&pool->nr_spinning)) {
+        return;
+    }
+    n = pool->nr_workers;
+    for (i = 1; i < n; i++) {
+        ThreadPoolWorker *other = pool->workers[(w->index + i) % n];
+
+        if (atomic_read(&other->sleeping)) {
+            qemu_event_set(&other->wakeup);
+            return;
+        }
+    }
+}
+
+static void thread_pool_queue(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolWorker *w;
+    int i, n;
+
+    n = pool->nr_workers;
+    for (i = 0; i < n; i++) {
+        w = pool->workers[pool->next_worker++ % n];
+        if (thread_pool_ring_push(w, req)) {
+            thread_pool_kick(pool, w);
+            return;
+        }
+    }
+
+    /* All rings are full.  Workers look at request_list once theirs are
+     * empty, but one of them may already be asleep; kick it like for a
+     * ring push.
+     */
+    qemu_mutex_lock(&pool->lock);
+    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    atomic_set(&pool->nr_overflow, pool->nr_overflow + 1);
+    qemu_mutex_unlock(&pool->lock);
+    thread_pool_kick(pool, pool->workers[pool->next_worker++ % n]);
+}
+
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) batch;
+    ThreadPoolElement *elem;
 
     aio_context_acquire(pool->ctx);
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
-        }
+
+    /* done_list is most recent first, put the new batch back in
+     * completion order.
+     */
+    QSLIST_MOVE_ATOMIC(&done_list, &pool->done_list);
+    QSIMPLEQ_INIT(&batch);
+    while ((elem = QSLIST_FIRST(&done_list))) {
+        QSLIST_REMOVE_HEAD(&done_list, done);
+        QSIMPLEQ_INSERT_HEAD(&batch, elem, completed);
+    }
+    QSIMPLEQ_CONCAT(&pool->completed, &batch);
+
+    while ((elem = QSIMPLEQ_FIRST(&pool->completed))) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->completed, completed);
 
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
         QLIST_REMOVE(elem, all);
 
         if (elem->common.cb) {
-            /* Read state before ret.  */
-            smp_rmb();
-
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
              */
@@ -190,16 +457,16 @@ restart:
             aio_context_acquire(pool->ctx);
 
             /* We can safely cancel the completion_bh here regardless of someone
-             * else having scheduled it meanwhile because we reenter the
-             * completion function anyway (goto restart).
+             * else having scheduled it meanwhile because we keep going
+             * through pool->completed anyway.  New entries in done_list
+             * schedule the BH again.
              */
             qemu_bh_cancel(pool->completion_bh);
-
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
+            if (atomic_read(&pool->done_list.slh_first)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
         }
+        qemu_aio_unref(elem);
     }
     aio_context_release(pool->ctx);
 }
@@ -208,25 +475,32 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    bool dequeued = false;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
-         */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+    /* No thread has yet started working on elem if we can take it out of
+     * its ring slot or out of request_list.  In that case complete it
+     * right away.
+     */
+    if (elem->slot) {
+        dequeued = atomic_cmpxchg(elem->slot, elem, NULL) == elem;
+    } else {
+        qemu_mutex_lock(&pool->lock);
+        if (elem->state == THREAD_QUEUED) {
+            QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+            atomic_set(&pool->nr_overflow, pool->nr_overflow - 1);
+            dequeued = true;
+        }
+        qemu_mutex_unlock(&pool->lock);
+    }
 
+    if (dequeued) {
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        QSIMPLEQ_INSERT_TAIL(&pool->completed, elem, completed);
+        qemu_bh_schedule(pool->completion_bh);
     }
-
-    qemu_mutex_unlock(&pool->lock);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -252,19 +526,20 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
+    req->slot = NULL;
     req->pool = pool;
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+    if (atomic_read(&pool->nr_idle) == 0 &&
+        pool->nr_workers < pool->max_threads) {
+        qemu_mutex_lock(&pool->lock);
         spawn_thread(pool);
+        qemu_mutex_unlock(&pool->lock);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
+    thread_pool_queue(pool, req);
     return &req->common;
 }
 
@@ -307,11 +582,13 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_sem_init(&pool->sem, 0);
     pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
+    pool->workers = g_new0(ThreadPoolWorker *, pool->max_threads);
 
+    QSLIST_INIT(&pool->done_list);
     QLIST_INIT(&pool->head);
+    QSIMPLEQ_INIT(&pool->completed);
     QTAILQ_INIT(&pool->request_list);
 }
 
@@ -324,6 +601,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -338,16 +617,23 @@ void thread_pool_free(ThreadPool *pool)
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->stopping = true;
+    atomic_mb_set(&pool->stopping, true);
     while (pool->cur_threads > 0) {
-        qemu_sem_post(&pool->sem);
+        for (i = 0; i < pool->started_threads; i++) {
+            qemu_event_set(&pool->workers[i]->wakeup);
+        }
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
 
     qemu_mutex_unlock(&pool->lock);
 
+    for (i = 0; i < pool->nr_workers; i++) {
+        qemu_event_destroy(&pool->workers[i]->wakeup);
+        g_free(pool->workers[i]);
+    }
+    g_free(pool->workers);
+
     qemu_bh_delete(pool->completion_bh);
-    qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);
@@ -173,12 +173,14 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
 }
 
 /**
- * Initialize device IRQ with @irq_type and and register an event notifier.
+ * Connect the first @count interrupt vectors of @irq_type to the event
+ * notifiers in @e, or as many as the device supports.  Returns the number
+ * of vectors that were set up, or a negative error.
  */
-int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
-                           int irq_type, Error **errp)
+int qemu_vfio_pci_init_irqs(QEMUVFIOState *s, EventNotifier **e, int count,
+                            int irq_type, Error **errp)
 {
-    int r;
+    int i, r;
     struct vfio_irq_set *irq_set;
     size_t irq_set_size;
     struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
@@ -192,8 +194,13 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         error_setg(errp, "Device interrupt doesn't support eventfd");
         return -EINVAL;
     }
+    if (!irq_info.count) {
+        error_setg(errp, "Device has no interrupt vectors");
+        return -EINVAL;
+    }
+    count = MIN(count, irq_info.count);
 
-    irq_set_size = sizeof(*irq_set) + sizeof(int);
+    irq_set_size = sizeof(*irq_set) + count * sizeof(int);
     irq_set = g_malloc0(irq_set_size);
 
     /* Get to a known IRQ state */
@@ -202,17 +209,30 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
         .index = irq_info.index,
         .start = 0,
-        .count = 1,
+        .count = count,
     };
 
-    *(int *)&irq_set->data = event_notifier_get_fd(e);
+    for (i = 0; i < count; i++) {
+        ((int *)&irq_set->data)[i] = event_notifier_get_fd(e[i]);
+    }
     r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
     g_free(irq_set);
     if (r) {
         error_setg_errno(errp, errno, "Failed to setup device interrupt");
         return -errno;
     }
-    return 0;
+    return count;
+}
+
+/**
+ * Initialize device IRQ with @irq_type and register an event notifier.
+ */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    int r = qemu_vfio_pci_init_irqs(s, &e, 1, irq_type, errp);
+
+    return r < 0 ? r : 0;
 }
 
 static int qemu_vfio_pci_read_config(QEMUVFIOState *s, void *buf,